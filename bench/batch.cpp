@@ -0,0 +1,146 @@
+/*
+    Copyright Jordan Sissel, 2018
+    This file is part of jordansissel/ipmi.
+
+    jordansissel/ipmi is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    jordansissel/ipmi is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with jordansissel/ipmi.  If not, see <http://www.gnu.org/licenses/>.
+  */
+#include "bench/fake_bmc.h"
+#include "client_manager.h"
+#include "udp_batch_loop.h"
+
+#include <memory>
+#include <thread>
+
+// Compares the UdpBatchLoop transport with one mongoose connection per host:
+// every host goes through an IPMI 1.5 handshake plus one chassis control
+// command, then a second command on the open session. ClientManager closes
+// each session after its command, so its second pass repeats the handshake,
+// and its figures include the Close Session round trip. The hosts are fake
+// BMCs on loopback ports, one per host unless fewer are asked for, served by
+// their own threads. With fewer ports, many sessions share one BMC address
+// and the batch loop tells them apart by session ID.
+//
+// For the batch loop it counts system calls: the sendmmsg(), recvmmsg() and
+// epoll_wait() calls made, per host and per datagram.
+
+static const uint16_t FIRST_PORT = 18000;
+
+static void runBatched(std::vector<std::unique_ptr<IPMI::Client>> &clients,
+                       IPMI::UdpBatchLoop &loop, const char *what) {
+  const IPMI::UdpBatchLoop::Statistics before = loop.statistics();
+  size_t finished = 0, succeeded = 0;
+  const double start = now();
+  for (auto &client : clients) {
+    client->chassisControl(
+        IPMI::ChassisControlCommand::PowerCycle,
+        [&](const IPMI::ChassisControlResult &result) {
+          finished++;
+          succeeded += result.status == IPMI::Status::Success;
+        });
+  }
+  while (finished < clients.size()) {
+    loop.poll(100);
+  }
+  const double elapsed = now() - start;
+
+  const IPMI::UdpBatchLoop::Statistics &after = loop.statistics();
+  const uint64_t calls = after.send_calls + after.receive_calls +
+                         after.wait_calls - before.send_calls -
+                         before.receive_calls - before.wait_calls;
+  const uint64_t datagrams =
+      after.sent + after.received - before.sent - before.received;
+  fprintf(stderr,
+          "batched, %s: %zu ok, %zu failed in %.3fs, %.0f hosts/sec, "
+          "%.2f system calls per host, %.3f per datagram\n",
+          what, succeeded, clients.size() - succeeded, elapsed,
+          clients.size() / elapsed, (double)calls / clients.size(),
+          (double)calls / datagrams);
+}
+
+static void runMongoose(IPMI::ClientManager &manager, const char *what) {
+  const double start = now();
+  manager.chassisControl(IPMI::ChassisControlCommand::PowerCycle);
+  while (!manager.done()) {
+    manager.poll(100);
+  }
+  const double elapsed = now() - start;
+  fprintf(stderr,
+          "mongoose, %s: %zu ok, %zu failed in %.3fs, %.0f hosts/sec\n", what,
+          manager.succeededCount(), manager.failedCount(), elapsed,
+          manager.size() / elapsed);
+}
+
+int main(int argc, char **argv) {
+  // Each port takes a file descriptor for its fake BMC, and each host one
+  // more for its mongoose connection.
+  const size_t hosts = argc > 1 ? atoi(argv[1]) : 1000;
+  const size_t ports = argc > 3 && atoi(argv[3]) > 0 ? atoi(argv[3]) : hosts;
+  const size_t sockets = argc > 4 ? atoi(argv[4]) : 1;
+  const size_t cores = std::thread::hardware_concurrency() > 0
+                           ? std::thread::hardware_concurrency()
+                           : 1;
+  const size_t bmc_threads = argc > 2 ? atoi(argv[2]) : cores;
+
+  uint8_t password[16] = {};
+  strncpy((char *)password, "fancypants", 16);
+
+  std::vector<std::vector<int>> bmcs(bmc_threads == 0 ? 1 : bmc_threads);
+  for (size_t i = 0; i < ports; i++) {
+    const int fd = bindLoopback(FIRST_PORT + i);
+    if (fd < 0) {
+      return 1;
+    }
+    bmcs[i % bmcs.size()].push_back(fd);
+  }
+  for (auto &fds : bmcs) {
+    std::thread(fakeBMC, fds, password, 0).detach();
+  }
+
+  {
+    IPMI::UdpBatchLoop loop;
+    if (loop.open(sockets) == IPMI::Status::Failure) {
+      return 1;
+    }
+    std::vector<std::unique_ptr<IPMI::Client>> clients;
+    char host[32];
+    for (size_t i = 0; i < hosts; i++) {
+      clients.emplace_back(new IPMI::Client(password));
+      snprintf(host, sizeof(host), "127.0.0.1:%zu", FIRST_PORT + i % ports);
+      if (loop.attach(*clients.back(), host) == IPMI::Status::Failure) {
+        return 1;
+      }
+    }
+    runBatched(clients, loop, "handshake+command");
+    runBatched(clients, loop, "command on open sessions");
+    for (auto &client : clients) {
+      loop.detach(*client);
+    }
+  }
+
+  struct mg_mgr mgr;
+  mg_mgr_init(&mgr, NULL);
+  {
+    IPMI::ClientManager manager(&mgr);
+    manager.setMaxActive(hosts);
+    char host[32];
+    for (size_t i = 0; i < hosts; i++) {
+      snprintf(host, sizeof(host), "127.0.0.1:%zu", FIRST_PORT + i % ports);
+      manager.add(host, password);
+    }
+    runMongoose(manager, "handshake+command+close");
+    runMongoose(manager, "handshake+command+close again");
+  }
+  mg_mgr_free(&mgr);
+  return 0;
+}
@@ -0,0 +1,175 @@
+/*
+    Copyright Jordan Sissel, 2018
+    This file is part of jordansissel/ipmi.
+
+    jordansissel/ipmi is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    jordansissel/ipmi is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with jordansissel/ipmi.  If not, see <http://www.gnu.org/licenses/>.
+  */
+#pragma once
+#include "ipmi.h"
+
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+
+// A fake IPMI 1.5 BMC for the benchmarks: it answers the handshake, chassis
+// control and Close Session on loopback, from threads of its own, so that the
+// event loops being measured only run clients.
+
+inline double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Writes the response to C into `out`, authenticated when `session_id` is set.
+template <class C>
+inline size_t reply(uint8_t *out, size_t size, const uint8_t password[16],
+                    uint32_t session_id, uint8_t rq_seq,
+                    const typename C::Response &response) {
+  const IPMI::IPMB request(C::netFn, rq_seq, C::command);
+  if (session_id == 0) {
+    return IPMI::encodeResponse<C>(out, size, request, response);
+  }
+  return IPMI::encodeResponse<C>(out, size, session_id, 0, request,
+                                 IPMI::AuthCode(password, session_id),
+                                 response);
+}
+
+// Writes the reply to the request in `packet` into `out` and returns its
+// length, or 0 if there is none. It keeps no state: the session id is handed
+// out by Get Session Challenge and simply echoed afterwards, and inbound
+// authcodes are not checked.
+inline size_t respond(const uint8_t *packet, size_t length, uint8_t *out,
+                      size_t size, const uint8_t password[16],
+                      uint32_t *next_session) {
+  using namespace IPMI;
+  uint8_t challenge[16] = {};
+  PacketView view(packet, length);
+  RMCP rmcp;
+  Session session;
+  IPMB ipmb;
+  if (rmcp.read(view) == Status::Failure ||
+      session.read(view) == Status::Failure ||
+      ipmb.read(view) == Status::Failure) {
+    return 0;
+  }
+
+  // The session id sits at the same offset with or without an authcode.
+  uint32_t id;
+  memcpy(&id, packet + RMCP_SIZE + 5, 4);
+  const uint8_t rq_seq = ipmb.getSequence();
+
+  switch (ipmb.command) {
+  case GetChannelAuthenticationCapabilities::Command::command:
+    return reply<GetChannelAuthenticationCapabilities::Command>(
+        out, size, password, 0, rq_seq,
+        GetChannelAuthenticationCapabilities::Response(0x01, 1 << 2, 0));
+  case GetSessionChallenge::Command::command: {
+    GetSessionChallenge::Response response;
+    response.session_id = (*next_session)++;
+    memcpy(response.challenge, challenge, 16);
+    return reply<GetSessionChallenge::Command>(out, size, password, 0, rq_seq,
+                                               response);
+  }
+  case ActivateSession::Command::command:
+    return reply<ActivateSession::Command>(out, size, password, id, rq_seq,
+                                           ActivateSession::Response(id, 1));
+  case SetSessionPrivilege::Command::command:
+    return reply<SetSessionPrivilege::Command>(
+        out, size, password, id, rq_seq,
+        SetSessionPrivilege::Response(
+            (uint8_t)AuthenticationCapability::Administrator));
+  case ChassisControl::Command::command:
+    return reply<ChassisControl::Command>(out, size, password, id, rq_seq,
+                                          ChassisControl::Response(0));
+  case CloseSession::Command::command:
+    return reply<CloseSession::Command>(out, size, password, id, rq_seq,
+                                        CloseSession::Response(0));
+  }
+  return 0;
+}
+
+// Answers one request, unless it falls in the `loss` percent dropped at
+// random. Returns false once the socket is closed.
+inline bool answer(int fd, const uint8_t password[16], int loss,
+                   unsigned *seed, uint32_t *next_session) {
+  uint8_t packet[IPMI::MAX_PACKET_SIZE];
+  struct sockaddr_storage from;
+  socklen_t from_length = sizeof(from);
+  const ssize_t length = recvfrom(fd, packet, sizeof(packet), 0,
+                                  (struct sockaddr *)&from, &from_length);
+  if (length <= 0) {
+    return false;
+  }
+  if ((int)(rand_r(seed) % 100) < loss) {
+    return true;
+  }
+
+  uint8_t out[IPMI::MAX_PACKET_SIZE];
+  const size_t size =
+      respond(packet, length, out, sizeof(out), password, next_session);
+  if (size > 0) {
+    sendto(fd, out, size, 0, (struct sockaddr *)&from, from_length);
+  }
+  return true;
+}
+
+// Serves every socket in `fds` from the calling thread until one is closed.
+inline void fakeBMC(std::vector<int> fds, const uint8_t password[16],
+                    int loss) {
+  unsigned seed = fds[0];
+  uint32_t next_session = 1;
+  std::vector<struct pollfd> polled(fds.size());
+  for (size_t i = 0; i < fds.size(); i++) {
+    polled[i].fd = fds[i];
+    polled[i].events = POLLIN;
+  }
+  for (;;) {
+    if (poll(polled.data(), polled.size(), -1) < 0) {
+      return;
+    }
+    for (auto &p : polled) {
+      if ((p.revents & POLLIN) &&
+          !answer(p.fd, password, loss, &seed, &next_session)) {
+        return;
+      }
+    }
+  }
+}
+
+// Binds a UDP socket to `port` on loopback, or returns -1.
+inline int bindLoopback(uint16_t port) {
+  const int fd = socket(AF_INET, SOCK_DGRAM, 0);
+  struct sockaddr_in address = {};
+  address.sin_family = AF_INET;
+  address.sin_port = htons(port);
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (fd < 0 || bind(fd, (struct sockaddr *)&address, sizeof(address)) != 0) {
+    fprintf(stderr, "Cannot bind a fake BMC to port %d\n", port);
+    if (fd >= 0) {
+      close(fd);
+    }
+    return -1;
+  }
+  // One port may serve thousands of sessions, whose requests arrive in
+  // bursts.
+  const int buffer_size = 4 << 20;
+  setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &buffer_size, sizeof(buffer_size));
+  return fd;
+}
@@ -0,0 +1,107 @@
+/*
+    Copyright Jordan Sissel, 2018
+    This file is part of jordansissel/ipmi.
+
+    jordansissel/ipmi is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    jordansissel/ipmi is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with jordansissel/ipmi.  If not, see <http://www.gnu.org/licenses/>.
+  */
+#include "bench/fake_bmc.h"
+#include "client_manager.h"
+#include "mongoose.h"
+
+#include <thread>
+
+// Measures how many hosts per second a ClientManager takes through a full IPMI
+// 1.5 handshake, one chassis control command and Close Session. Every host is
+// the same fake BMC on loopback, which answers from its own thread so that the
+// event loop being measured only runs clients.
+
+static const uint16_t BMC_PORT = 16623;
+
+// Sums the retry counters and averages the round trip estimates of all hosts.
+static void report(const IPMI::ClientManager &manager, int loss) {
+  uint64_t requests = 0, retransmits = 0, timeouts = 0;
+  double srtt = 0, rto = 0;
+  for (size_t i = 0; i < manager.size(); i++) {
+    const IPMI::ClientStatistics stats = manager.client(i).statistics();
+    requests += stats.requests;
+    retransmits += stats.retransmits;
+    timeouts += stats.timeouts;
+    srtt += stats.srtt;
+    rto += stats.rto;
+  }
+  fprintf(stderr,
+          "  %d%% loss: %llu requests, %llu retransmits, %llu timeouts, "
+          "mean srtt %.2fms, mean rto %.0fms\n",
+          loss, (unsigned long long)requests,
+          (unsigned long long)retransmits, (unsigned long long)timeouts,
+          srtt * 1e3 / manager.size(), rto * 1e3 / manager.size());
+}
+
+int main(int argc, char **argv) {
+  const size_t hosts = argc > 1 ? atoi(argv[1]) : 5000;
+  const size_t max_active = argc > 2 ? atoi(argv[2]) : 256;
+  const int loss = argc > 3 ? atoi(argv[3]) : 0;
+
+  uint8_t password[16] = {};
+  strncpy((char *)password, "fancypants", 16);
+
+  const int fd = bindLoopback(BMC_PORT);
+  if (fd < 0) {
+    return 1;
+  }
+  std::thread bmc(fakeBMC, std::vector<int>{fd}, password, loss);
+  bmc.detach();
+
+  struct mg_mgr mgr;
+  mg_mgr_init(&mgr, NULL);
+  IPMI::ClientManager manager(&mgr);
+  manager.setMaxActive(max_active);
+  char host[32];
+  snprintf(host, sizeof(host), "127.0.0.1:%d", BMC_PORT);
+  for (size_t i = 0; i < hosts; i++) {
+    manager.add(host, password);
+  }
+
+  double start = now();
+  manager.chassisControl(IPMI::ChassisControlCommand::PowerCycle);
+  while (!manager.done()) {
+    manager.poll(100);
+  }
+  double elapsed = now() - start;
+  fprintf(stderr,
+          "%zu hosts, %zu at a time: %zu ok, %zu failed in %.3fs, "
+          "%.0f handshakes+commands/sec\n",
+          hosts, max_active, manager.succeededCount(), manager.failedCount(),
+          elapsed, hosts / elapsed);
+  report(manager, loss);
+
+  // A second run against the same hosts, whose sessions were closed by the
+  // first.
+  start = now();
+  manager.chassisControl(IPMI::ChassisControlCommand::PowerCycle);
+  while (!manager.done()) {
+    manager.poll(100);
+  }
+  elapsed = now() - start;
+  fprintf(stderr,
+          "%zu hosts, %zu at a time: %zu ok, %zu failed in %.3fs, "
+          "%.0f handshakes+commands/sec again\n",
+          hosts, max_active, manager.succeededCount(), manager.failedCount(),
+          elapsed, hosts / elapsed);
+  report(manager, loss);
+
+  mg_mgr_free(&mgr);
+  close(fd);
+  return 0;
+}
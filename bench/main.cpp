@@ -0,0 +1,494 @@
+/*
+    Copyright Jordan Sissel, 2018
+    This file is part of jordansissel/ipmi.
+
+    jordansissel/ipmi is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    jordansissel/ipmi is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with jordansissel/ipmi.  If not, see <http://www.gnu.org/licenses/>.
+  */
+#include "bench/fake_bmc.h"
+#include "client.h"
+#include "ipmi.h"
+#include "lanplus.h"
+#include "mongoose.h"
+
+#include <atomic>
+#include <deque>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+// Microbenchmarks for the codec, the authcode and checksum arithmetic and a
+// whole client handshake. Each reports nanoseconds and heap allocations per
+// operation, in a table on stdout and, given a file name, as JSON Lines:
+//
+//   {"name":"decode ChassisControl","iterations":1000000,"ns_per_op":41.2,
+//    "allocs_per_op":0}
+//
+// one object per benchmark, so runs of two versions can be compared with
+// any JSON tool.
+
+extern "C" {
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t count, size_t size);
+void *__libc_realloc(void *pointer, size_t size);
+}
+
+// Every heap allocation in the process, C++ and mbufs alike: the benchmark
+// replaces glibc's malloc() with these counting wrappers.
+static std::atomic<uint64_t> allocations{0};
+
+extern "C" void *malloc(size_t size) {
+  allocations.fetch_add(1, std::memory_order_relaxed);
+  return __libc_malloc(size);
+}
+
+extern "C" void *calloc(size_t count, size_t size) {
+  allocations.fetch_add(1, std::memory_order_relaxed);
+  return __libc_calloc(count, size);
+}
+
+extern "C" void *realloc(void *pointer, size_t size) {
+  allocations.fetch_add(1, std::memory_order_relaxed);
+  return __libc_realloc(pointer, size);
+}
+
+static const size_t iterations = 1000000;
+static FILE *results = NULL;
+
+// Runs `body` `count` times, passing the iteration number, and reports the
+// time and allocations per run.
+template <class Body>
+static void run(const std::string &name, size_t count, Body body) {
+  const uint64_t allocated = allocations.load(std::memory_order_relaxed);
+  const double start = now();
+  for (size_t i = 0; i < count; i++) {
+    body(i);
+  }
+  const double elapsed = now() - start;
+  const double allocs =
+      (double)(allocations.load(std::memory_order_relaxed) - allocated) /
+      count;
+
+  printf("%-48s %10.1f ns/op %8.2f allocs/op\n", name.c_str(),
+         elapsed * 1e9 / count, allocs);
+  if (results != NULL) {
+    fprintf(results,
+            "{\"name\":\"%s\",\"iterations\":%zu,\"ns_per_op\":%.3f,"
+            "\"allocs_per_op\":%.3f}\n",
+            name.c_str(), count, elapsed * 1e9 / count, allocs);
+  }
+}
+
+// Keeps the compiler from dropping work whose result is unused.
+static volatile size_t sink;
+
+// Encodes into a long-lived mbuf, the way Client used to: build the packet,
+// hand it off, then empty the buffer for the next one.
+#define BENCH_MBUF(name, call)                                                 \
+  do {                                                                         \
+    struct mbuf buf;                                                           \
+    mbuf_init(&buf, 30);                                                       \
+    run("encode " name " (mbuf)", iterations, [&](size_t) {                    \
+      call;                                                                    \
+      mbuf_remove(&buf, buf.len);                                              \
+    });                                                                        \
+    mbuf_free(&buf);                                                           \
+  } while (0)
+
+// Encodes into a stack buffer with no allocation.
+#define BENCH_STACK(name, call)                                                \
+  do {                                                                         \
+    uint8_t packet[IPMI::MAX_PACKET_SIZE];                                     \
+    size_t length = 0;                                                         \
+    run("encode " name " (stack)", iterations,                                 \
+        [&](size_t) { length += call; });                                      \
+    if (length == 0) {                                                         \
+      printf("%s: encoder wrote nothing\n", name);                             \
+    }                                                                          \
+  } while (0)
+
+// Decodes the response to C in `packet` over and over, authenticated with
+// `auth` when it is given.
+template <class C>
+static void benchDecode(const char *name, const uint8_t *packet, size_t length,
+                        const IPMI::AuthCode *auth) {
+  size_t decoded = 0;
+  run(std::string("decode ") + name, iterations, [&](size_t) {
+    IPMI::PacketView view(packet, length);
+    IPMI::RMCP rmcp;
+    IPMI::IPMB ipmb;
+    IPMI::Session session;
+    typename C::Response response;
+    const IPMI::Status status =
+        auth == NULL
+            ? IPMI::decode<C>(view, rmcp, ipmb, session, response)
+            : IPMI::decode<C>(view, *auth, rmcp, ipmb, session, response);
+    decoded += status == IPMI::Status::Success;
+  });
+  if (decoded != iterations) {
+    printf("%s: decoding failed\n", name);
+  }
+}
+
+// Carries a client's packets straight to the fake BMC's respond(), in the
+// same thread. Replies wait in `replies` until deliver() hands them over, so
+// the client never receives one while it is still sending.
+class Loopback : public IPMI::Transport {
+  const uint8_t *password;
+  uint32_t next_session = 1;
+  std::deque<std::vector<uint8_t>> replies;
+
+public:
+  IPMI::Client *client = nullptr;
+
+  Loopback(const uint8_t password[16]) : password(password) {}
+
+  void send(const uint8_t *packet, size_t length) override {
+    uint8_t out[IPMI::MAX_PACKET_SIZE];
+    const size_t size =
+        respond(packet, length, out, sizeof(out), password, &next_session);
+    if (size > 0) {
+      replies.emplace_back(out, out + size);
+    }
+  }
+
+  // Hands the oldest reply to the client. Returns false if there was none.
+  bool deliver() {
+    if (replies.empty()) {
+      return false;
+    }
+    std::vector<uint8_t> reply = std::move(replies.front());
+    replies.pop_front();
+    struct mbuf buf;
+    buf.buf = (char *)reply.data();
+    buf.len = buf.size = reply.size();
+    client->receivePacket(buf);
+    return true;
+  }
+};
+
+#if IPMI_LANPLUS
+// Wraps one handshake message in the RMCP and RMCP+ session headers.
+template <class Message>
+static IPMI::PacketView handshakePacket(uint8_t *packet, size_t size,
+                                  IPMI::Lanplus::PayloadType type,
+                                  const Message &message, uint16_t length) {
+  IPMI::PacketWriter writer(packet, size);
+  IPMI::RMCP().write(writer);
+  IPMI::Lanplus::SessionHeader((uint8_t)type, 0, 0, length).write(writer);
+  message.write(writer);
+  return IPMI::PacketView(packet, writer.position());
+}
+
+// Plays the BMC side of the RAKP handshake so that `session` ends up with
+// keys, without needing a BMC.
+static void establish(IPMI::Lanplus::Session &session,
+                      const uint8_t password[16],
+                      IPMI::Lanplus::CipherSuite suite) {
+  using namespace IPMI::Lanplus;
+  const char *digest =
+      suite.authentication == AuthenticationAlgorithm::HMAC_SHA256 ? "SHA256"
+                                                                   : "SHA1";
+  uint8_t user_key[20] = {};
+  memcpy(user_key, password, 16);
+  Hmac user;
+  user.init(digest, user_key, sizeof(user_key));
+
+  uint8_t request[MAX_PACKET_SIZE];
+  uint8_t reply[MAX_PACKET_SIZE];
+  session.openSession(request, sizeof(request));
+
+  OpenSession::Response open = {};
+  open.console_id = session.consoleId();
+  open.bmc_id = 0x01020304;
+  open.suite = suite;
+  IPMI::PacketView view = handshakePacket(reply, sizeof(reply),
+                                    PayloadType::OpenSessionResponse, open,
+                                    OpenSession::Response::DATA_SIZE);
+  session.receiveOpenSession(view);
+
+  RAKP::Message1 rakp1;
+  view = IPMI::PacketView(request, session.rakp1(request, sizeof(request)));
+  view.skip(IPMI::RMCP_SIZE + SESSION_SIZE);
+  rakp1.read(view);
+
+  RAKP::Message2 rakp2 = {};
+  rakp2.console_id = open.console_id;
+  memset(rakp2.bmc_random, 0x5a, 16);
+  memset(rakp2.bmc_guid, 0xa5, 16);
+  user.begin();
+  user.update(&open.console_id, 4);
+  user.update(&open.bmc_id, 4);
+  user.update(rakp1.console_random, 16);
+  user.update(rakp2.bmc_random, 16);
+  user.update(rakp2.bmc_guid, 16);
+  user.update(&rakp1.role, 1);
+  user.update(&rakp1.username_length, 1);
+  user.update(rakp1.username, rakp1.username_length);
+  user.finish(rakp2.authcode);
+  rakp2.authcode_length = user.size();
+  view = handshakePacket(reply, sizeof(reply), PayloadType::RAKP2, rakp2,
+                         rakp2.size());
+  session.receiveRAKP2(view);
+  session.rakp3(request, sizeof(request));
+
+  uint8_t sik[RAKP::MAX_AUTHCODE_SIZE];
+  user.begin();
+  user.update(rakp1.console_random, 16);
+  user.update(rakp2.bmc_random, 16);
+  user.update(&rakp1.role, 1);
+  user.update(&rakp1.username_length, 1);
+  user.update(rakp1.username, rakp1.username_length);
+  user.finish(sik);
+
+  Hmac integrity;
+  integrity.init(digest, sik, user.size());
+  RAKP::Message4 rakp4 = {};
+  rakp4.console_id = open.console_id;
+  integrity.begin();
+  integrity.update(rakp1.console_random, 16);
+  integrity.update(&open.bmc_id, 4);
+  integrity.update(rakp2.bmc_guid, 16);
+  integrity.finish(rakp4.integrity_check);
+  rakp4.integrity_check_length = digest[3] == '2' ? 16 : 12;
+  view = handshakePacket(reply, sizeof(reply), PayloadType::RAKP4, rakp4,
+                         rakp4.size());
+  session.receiveRAKP4(view);
+}
+#endif
+
+int main(int argc, char **argv) {
+  if (argc > 2) {
+    printf("Usage: %s [results.jsonl]\n", argv[0]);
+    return 1;
+  }
+  if (argc == 2) {
+    results = fopen(argv[1], "w");
+    if (results == NULL) {
+      printf("Cannot write %s: %s\n", argv[1], strerror(errno));
+      return 1;
+    }
+  }
+
+  uint8_t password[16] = {};
+  strncpy((char *)password, "fancypants", 16);
+  const uint32_t session = 0xaabbccdd;
+  const uint32_t sequence = 0x11223344;
+  uint8_t challenge[16];
+  memset(challenge, 0x3c, sizeof(challenge));
+  const IPMI::AuthCode auth(password, session);
+
+  // Encoding every request.
+  BENCH_MBUF("getChannelAuthenticationCapabilities",
+             IPMI::getChannelAuthenticationCapabilities(buf));
+  BENCH_STACK("getChannelAuthenticationCapabilities",
+              IPMI::getChannelAuthenticationCapabilities(packet,
+                                                         sizeof(packet)));
+
+  BENCH_MBUF("getSessionChallenge", IPMI::getSessionChallenge(buf));
+  BENCH_STACK("getSessionChallenge",
+              IPMI::getSessionChallenge(packet, sizeof(packet)));
+
+  BENCH_MBUF("activateSession",
+             IPMI::activateSession(buf, password, sequence, session,
+                                   challenge));
+  BENCH_STACK("activateSession",
+              IPMI::activateSession(packet, sizeof(packet), password,
+                                    sequence, session, challenge));
+
+  BENCH_MBUF("setSessionPrivilege",
+             IPMI::setSessionPrivilege(
+                 buf, session, sequence, password,
+                 IPMI::AuthenticationCapability::Administrator));
+  BENCH_STACK("setSessionPrivilege",
+              IPMI::setSessionPrivilege(
+                  packet, sizeof(packet), session, sequence, password,
+                  IPMI::AuthenticationCapability::Administrator));
+
+  BENCH_MBUF("chassisControl",
+             IPMI::chassisControl(buf, session, sequence, password,
+                                  IPMI::ChassisControlCommand::PowerCycle));
+  BENCH_STACK("chassisControl",
+              IPMI::chassisControl(packet, sizeof(packet), session, sequence,
+                                   password,
+                                   IPMI::ChassisControlCommand::PowerCycle));
+
+  BENCH_STACK("getDeviceId",
+              IPMI::encode<IPMI::GetDeviceId::Command>(
+                  packet, sizeof(packet), session, sequence, auth,
+                  IPMI::GetDeviceId::Request()));
+
+  {
+    auto chassis = IPMI::PacketTemplate::chassisControl(session);
+    run("encode chassisControl (template)", iterations, [&](size_t i) {
+      chassis.patch(sequence + i, i % IPMI::RQ_SEQ_COUNT,
+                    (uint8_t)IPMI::ChassisControlCommand::PowerCycle, auth);
+    });
+  }
+
+#if IPMI_LANPLUS
+  {
+    const struct {
+      const char *name;
+      IPMI::Lanplus::CipherSuite suite;
+    } suites[] = {
+        {"encode chassisControl (lanplus suite 3)",
+         IPMI::Lanplus::CIPHER_SUITE_3},
+        {"encode chassisControl (lanplus suite 17)",
+         IPMI::Lanplus::CIPHER_SUITE_17},
+    };
+    for (const auto &s : suites) {
+      IPMI::Lanplus::Session lanplus(password, 16, "root", s.suite);
+      establish(lanplus, password, s.suite);
+      if (!lanplus.isActive()) {
+        printf("%s: handshake failed\n", s.name);
+        continue;
+      }
+
+      uint8_t packet[IPMI::Lanplus::MAX_PACKET_SIZE];
+      size_t length = 0;
+      const IPMI::ChassisControl::Request request(
+          IPMI::ChassisControlCommand::PowerCycle);
+      run(s.name, iterations, [&](size_t) {
+        length += IPMI::Lanplus::encode<IPMI::ChassisControl::Command>(
+            packet, sizeof(packet), lanplus, request);
+      });
+      if (length == 0) {
+        printf("%s: encoder wrote nothing\n", s.name);
+      }
+    }
+  }
+#endif
+
+  // Decoding every response, from replies the fake BMC would send.
+  {
+    using namespace IPMI;
+    uint8_t packet[MAX_PACKET_SIZE];
+    size_t length;
+
+    length = reply<GetChannelAuthenticationCapabilities::Command>(
+        packet, sizeof(packet), password, 0, DEFAULT_RQ_SEQ,
+        GetChannelAuthenticationCapabilities::Response(0x01, 1 << 2, 0));
+    benchDecode<GetChannelAuthenticationCapabilities::Command>(
+        "GetChannelAuthenticationCapabilities", packet, length, NULL);
+
+    GetSessionChallenge::Response challenged;
+    challenged.completion_code = 0;
+    challenged.session_id = session;
+    memcpy(challenged.challenge, challenge, 16);
+    length = reply<GetSessionChallenge::Command>(
+        packet, sizeof(packet), password, 0, DEFAULT_RQ_SEQ, challenged);
+    benchDecode<GetSessionChallenge::Command>("GetSessionChallenge", packet,
+                                              length, NULL);
+
+    length = reply<ActivateSession::Command>(packet, sizeof(packet), password,
+                                             session, DEFAULT_RQ_SEQ,
+                                             ActivateSession::Response(
+                                                 session, sequence));
+    benchDecode<ActivateSession::Command>("ActivateSession", packet, length,
+                                          &auth);
+
+    length = reply<SetSessionPrivilege::Command>(
+        packet, sizeof(packet), password, session, DEFAULT_RQ_SEQ,
+        SetSessionPrivilege::Response(
+            (uint8_t)AuthenticationCapability::Administrator));
+    benchDecode<SetSessionPrivilege::Command>("SetSessionPrivilege", packet,
+                                              length, &auth);
+
+    length = reply<ChassisControl::Command>(packet, sizeof(packet), password,
+                                            session, DEFAULT_RQ_SEQ,
+                                            ChassisControl::Response(0));
+    benchDecode<ChassisControl::Command>("ChassisControl", packet, length,
+                                         &auth);
+
+    GetDeviceId::Response device;
+    device.completion_code = 0;
+    device.device_id = 0x20;
+    device.device_revision = 0x01;
+    device.firmware_major = 1;
+    device.firmware_minor = 0;
+    device.ipmi_version = 0x51;
+    device.additional_support = 0;
+    memset(device.manufacturer_id, 0, sizeof(device.manufacturer_id));
+    memset(device.product_id, 0, sizeof(device.product_id));
+    length = reply<GetDeviceId::Command>(packet, sizeof(packet), password,
+                                         session, DEFAULT_RQ_SEQ, device);
+    benchDecode<GetDeviceId::Command>("GetDeviceId", packet, length, &auth);
+  }
+
+  // Authcodes: MD5 over password, session ID, message, sequence number and
+  // password again. AuthCode hashes the constant prefix once per session.
+  {
+    uint8_t message[7];
+    memset(message, 0x42, sizeof(message));
+    uint8_t digest[16];
+    run("md5 mg_hash_md5_v (authcode)", iterations, [&](size_t i) {
+      const uint32_t seq = sequence + i;
+      const uint8_t *parts[] = {password, (const uint8_t *)&session, message,
+                                (const uint8_t *)&seq, password};
+      const size_t lengths[] = {16, 4, sizeof(message), 4, 16};
+      mg_hash_md5_v(5, parts, lengths, digest);
+      sink = sink + digest[0];
+    });
+    run("md5 AuthCode::compute", iterations, [&](size_t i) {
+      auth.compute(session, sequence + i, message, sizeof(message), digest);
+      sink = sink + digest[0];
+    });
+  }
+
+  // Checksums: an IPMB header, a whole chassis control message and a full
+  // Ethernet datagram.
+  {
+    uint8_t datagram[1500];
+    memset(datagram, 0xa5, sizeof(datagram));
+    for (size_t size : {3, 8, 1500}) {
+      run("sum (" + std::to_string(size) + " bytes)", iterations,
+          [&](size_t i) {
+            datagram[0] = (uint8_t)i;
+            sink = sink + IPMI::sum(datagram, size);
+          });
+    }
+  }
+
+  // A whole IPMI 1.5 session and one chassis control command, against the
+  // fake BMC in the same thread.
+  {
+    Loopback loopback(password);
+    IPMI::TimingWheel wheel(mg_time());
+    size_t succeeded = 0;
+    const size_t handshakes = 100000;
+    run("handshake+chassisControl (loopback)", handshakes, [&](size_t) {
+      IPMI::Client client(password);
+      client.setTimingWheel(&wheel);
+      loopback.client = &client;
+      client.chassisControl(IPMI::ChassisControlCommand::PowerCycle,
+                            [&](const IPMI::ChassisControlResult &result) {
+                              succeeded +=
+                                  result.status == IPMI::Status::Success;
+                            });
+      client.setTransport(&loopback);
+      while (loopback.deliver()) {
+      }
+      client.setTransport(nullptr);
+    });
+    if (succeeded != handshakes) {
+      printf("handshake: %zu of %zu succeeded\n", succeeded, handshakes);
+    }
+  }
+
+  if (results != NULL) {
+    fclose(results);
+  }
+  return 0;
+}
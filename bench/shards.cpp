@@ -0,0 +1,78 @@
+/*
+    Copyright Jordan Sissel, 2018
+    This file is part of jordansissel/ipmi.
+
+    jordansissel/ipmi is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    jordansissel/ipmi is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with jordansissel/ipmi.  If not, see <http://www.gnu.org/licenses/>.
+  */
+#include "bench/fake_bmc.h"
+#include "sharded_client_manager.h"
+
+#include <thread>
+
+// Measures how handshake throughput scales with the number of shards: for 1,
+// 2, 4, ... up to one per core, a fresh ShardedClientManager takes every host
+// through an IPMI 1.5 handshake plus one chassis control command.
+//
+// The fake BMCs listen on PORTS loopback ports, served by their own threads,
+// and each port is a distinct host address so hosts spread over the shards.
+// They share the machine with the shards; give them cores of their own with
+// taskset, or read the figures as a lower bound.
+
+static const uint16_t FIRST_PORT = 17000;
+static const size_t PORTS = 256;
+
+int main(int argc, char **argv) {
+  const size_t hosts = argc > 1 ? atoi(argv[1]) : 5000;
+  const size_t max_active = argc > 2 ? atoi(argv[2]) : 256;
+  const size_t cores = std::thread::hardware_concurrency() > 0
+                           ? std::thread::hardware_concurrency()
+                           : 1;
+  const size_t max_shards = argc > 3 ? atoi(argv[3]) : cores;
+  const size_t bmc_threads = argc > 4 ? atoi(argv[4]) : cores;
+
+  uint8_t password[16] = {};
+  strncpy((char *)password, "fancypants", 16);
+
+  std::vector<std::vector<int>> bmcs(bmc_threads == 0 ? 1 : bmc_threads);
+  for (size_t i = 0; i < PORTS; i++) {
+    const int fd = bindLoopback(FIRST_PORT + i);
+    if (fd < 0) {
+      return 1;
+    }
+    bmcs[i % bmcs.size()].push_back(fd);
+  }
+  for (auto &fds : bmcs) {
+    std::thread(fakeBMC, fds, password, 0).detach();
+  }
+
+  for (size_t shards = 1; shards <= max_shards; shards *= 2) {
+    IPMI::ShardedClientManager manager(shards);
+    manager.setMaxActive(max_active);
+    char host[32];
+    for (size_t i = 0; i < hosts; i++) {
+      snprintf(host, sizeof(host), "127.0.0.1:%zu", FIRST_PORT + i % PORTS);
+      manager.add(host, password);
+    }
+
+    const double start = now();
+    manager.chassisControl(IPMI::ChassisControlCommand::PowerCycle);
+    const double elapsed = now() - start;
+    fprintf(stderr,
+            "%zu shards, %zu hosts, %zu at a time per shard: %zu ok, "
+            "%zu failed in %.3fs, %.0f handshakes+commands/sec\n",
+            shards, hosts, max_active, manager.succeededCount(),
+            manager.failedCount(), elapsed, hosts / elapsed);
+  }
+  return 0;
+}
@@ -0,0 +1,121 @@
+/*
+    Copyright Jordan Sissel, 2018
+    This file is part of jordansissel/ipmi.
+
+    jordansissel/ipmi is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    jordansissel/ipmi is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with jordansissel/ipmi.  If not, see <http://www.gnu.org/licenses/>.
+  */
+#include "bench/fake_bmc.h"
+#include "client_manager.h"
+
+#include <atomic>
+#include <thread>
+
+// Checks the submission queue under contention and measures it: several
+// producer threads each submit a numbered run of tasks to one ClientManager,
+// whose poll loop runs them on the main thread. Every task must run exactly
+// once, and each producer's tasks in the order it submitted them. A producer
+// that finds the queue full yields and retries.
+//
+// Exits with 1 if a task went missing, ran twice or ran out of order.
+
+int main(int argc, char **argv) {
+  const size_t producers = argc > 1 && atoi(argv[1]) > 0 ? atoi(argv[1]) : 4;
+  const size_t per_producer = argc > 2 ? atoi(argv[2]) : 250000;
+  const size_t total = producers * per_producer;
+
+  struct mg_mgr mgr;
+  mg_mgr_init(&mgr, NULL);
+  IPMI::ClientManager manager(&mgr);
+
+  // Written by the polling thread only.
+  std::vector<uint8_t> runs(total);
+  std::vector<size_t> next(producers);
+  size_t delivered = 0, reordered = 0;
+  std::atomic<uint64_t> retries{0};
+
+  const double start = now();
+  std::vector<std::thread> threads;
+  for (size_t p = 0; p < producers; p++) {
+    threads.emplace_back([&, p] {
+      for (size_t i = 0; i < per_producer; i++) {
+        const IPMI::SubmissionQueue::Task task = [&, p, i] {
+          runs[p * per_producer + i]++;
+          if (next[p] != i) {
+            reordered++;
+          }
+          next[p] = i + 1;
+          delivered++;
+        };
+        while (manager.submit(task) == IPMI::Status::Failure) {
+          retries++;
+          std::this_thread::yield();
+        }
+      }
+    });
+  }
+  // Stops early if something was lost, since the count then never arrives.
+  double last = now();
+  size_t seen = 0;
+  while (delivered < total && now() - last < 5) {
+    manager.poll(1000);
+    if (delivered != seen) {
+      seen = delivered;
+      last = now();
+    }
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+  const double elapsed = now() - start;
+  // Anything submitted after the loop gave up.
+  manager.poll(0);
+
+  // One submission into a loop already waiting: the wakeup, not the poll
+  // timeout, should end the wait.
+  double woken = -1;
+  std::thread late([&] {
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    const double submitted = now();
+    manager.submit([&woken, submitted] { woken = now() - submitted; });
+  });
+  manager.poll(1000);
+  late.join();
+  // Without a wakeup, the task ran on the fallback drain after the timeout.
+  const bool slept = woken < 0 || woken > 0.5;
+  manager.poll(0);
+
+  size_t missing = 0, duplicated = 0;
+  for (uint8_t count : runs) {
+    if (count == 0) {
+      missing++;
+    } else if (count > 1) {
+      duplicated++;
+    }
+  }
+  fprintf(stderr,
+          "%zu producers, %zu tasks in %.3fs: %.0f submissions/sec, "
+          "%llu full-queue retries, idle wakeup in %.0fus\n",
+          producers, total, elapsed, total / elapsed,
+          (unsigned long long)retries.load(), woken * 1e6);
+  mg_mgr_free(&mgr);
+
+  if (missing > 0 || duplicated > 0 || reordered > 0 || slept) {
+    fprintf(stderr,
+            "FAILED: %zu missing, %zu run more than once, %zu out of order%s\n",
+            missing, duplicated, reordered,
+            slept ? ", idle loop not woken" : "");
+    return 1;
+  }
+  return 0;
+}
@@ -16,6 +16,7 @@
     along with jordansissel/ipmi.  If not, see <http://www.gnu.org/licenses/>.
   */
 #include "client.h"
+#include "metrics.h"
 
 #if CS_PLATFORM == CS_P_UNIX
 #include <stdlib.h> // for random()
@@ -28,63 +29,561 @@ uint32_t random() { return (uint32_t)mgos_rand_range(0, INT_MAX); }
 #endif
 
 namespace IPMI {
-static char unknown_buf[50];
-static const char *stateToString(const ClientState s) {
-  switch (s) {
+// Retransmission timeouts, in seconds. Until the first round trip is measured
+// the RTO is 1 second, as RFC 6298 suggests. The floor keeps a fast BMC's
+// scheduling jitter from causing spurious retransmits.
+static const double INITIAL_RTO = 1.0;
+static const double MIN_RTO = 0.1;
+static const double MAX_RTO = 4.0;
+
+RttEstimator::RttEstimator() : rto(INITIAL_RTO) {}
+
+void RttEstimator::sample(double rtt) {
+  if (samples == 0) {
+    srtt = rtt;
+    rttvar = rtt / 2;
+  } else {
+    const double error = srtt > rtt ? srtt - rtt : rtt - srtt;
+    rttvar = 0.75 * rttvar + 0.25 * error;
+    srtt = 0.875 * srtt + 0.125 * rtt;
+  }
+  samples++;
+
+  rto = srtt + 4 * rttvar;
+  if (rto < MIN_RTO) {
+    rto = MIN_RTO;
+  } else if (rto > MAX_RTO) {
+    rto = MAX_RTO;
+  }
+}
+
+void RttEstimator::backoff() {
+  rto = rto * 2 > MAX_RTO ? MAX_RTO : rto * 2;
+}
+
+// Packet metadata for Send and Receive trace events: the session ID in the
+// header, and the IPMB command, or for RMCP+ 0x100 plus the payload type.
+static uint32_t headerSessionId(const uint8_t *packet, size_t length) {
+  uint32_t id = 0;
+  if (length >= RMCP_SIZE + 1 && packet[RMCP_SIZE] != AUTH_TYPE_NONE &&
+      packet[RMCP_SIZE] != AUTH_TYPE_MD5) {
+    if (length >= RMCP_SIZE + 6) {
+      memcpy(&id, packet + RMCP_SIZE + 2, 4);
+    }
+  } else if (length >= RMCP_SIZE + 9) {
+    memcpy(&id, packet + RMCP_SIZE + 5, 4);
+  }
+  return id;
+}
+
+static uint32_t packetKind(const uint8_t *packet, size_t length) {
+  uint8_t command;
+  if (messageCommand(packet, length, command)) {
+    return command;
+  }
+  return length >= RMCP_SIZE + 2 ? 0x100 | (packet[RMCP_SIZE + 1] & 0x3f) : 0;
+}
+
+void Client::setState(ClientState next) {
+  ipmi_trace(IPMI_TRACE_INFO, State, this, (uint32_t)state, (uint32_t)next, 0);
+  if (next == ClientState::SessionReady) {
+    Metrics::count(Counter::SessionsOpened);
+  }
+  state = next;
+}
+
+Status Client::send(PendingRequest request) {
+  // Unanswered requests go back in the queue when a session is lost, so
+  // count them against its capacity too.
+  insist_return(requestQueue.size() + in_flight_count < REQUEST_QUEUE_SIZE,
+                Status::Failure, "Request queue full (%zu queued, %d sent)",
+                requestQueue.size(), in_flight_count);
+  requestQueue.push_back(std::move(request));
+
+  if (!connected()) {
+    return Status::Success;
+  }
+  if (state == ClientState::Initial) {
+    begin();
+  } else if (state == ClientState::SessionReady &&
+             in_flight_count < max_in_flight) {
+    // The session is still open, so skip the handshake.
+    sendNext();
+  }
+  return Status::Success;
+}
+
+// Sends a handshake packet and keeps a copy to retransmit.
+void Client::transmit(const uint8_t *packet, size_t length) {
+  if (length > sizeof(handshake_packet)) {
+    length = 0;
+  }
+  memcpy(handshake_packet, packet, length);
+  handshake_length = length;
+  handshake_sent_at = mg_time();
+  handshake_retries = 0;
+  requests++;
+
+  output(packet, length);
+  armTimer(rtt.timeout());
+}
+
+void Client::output(const uint8_t *packet, size_t length) {
+  ipmi_trace(IPMI_TRACE_DEBUG, Send, this, length,
+             headerSessionId(packet, length), packetKind(packet, length));
+  Metrics::count(Counter::PacketsSent);
+  Metrics::count(Counter::BytesSent, length);
+  if (transport != nullptr) {
+    transport->send(packet, length);
+  } else {
+    mg_send(connection, packet, length);
+  }
+}
+
+void Client::armTimer(double seconds) { setTimer(mg_time() + seconds); }
+
+void Client::setTimer(double at) {
+  if (wheel != nullptr) {
+    wheel->schedule(&timer, at);
+  } else if (connection != NULL) {
+    mg_set_timer(connection, at);
+  }
+}
+
+void Client::stopTimer() {
+  if (wheel != nullptr) {
+    wheel->cancel(&timer);
+  } else if (connection != NULL) {
+    mg_set_timer(connection, 0);
+  }
+}
+
+void Client::timerFired(void *client) {
+  static_cast<Client *>(client)->timerExpired();
+}
+
+// Sends queued commands until max_in_flight requests are outstanding, then
+// sets the timer for the earliest response deadline, or for the next
+// keepalive if nothing is outstanding.
+void Client::sendNext() {
+  while (!requestQueue.empty() && in_flight_count < max_in_flight) {
+    const uint8_t rq_seq = allocate(requestQueue.front().kind);
+    inFlight[rq_seq].pending = requestQueue.pop_front();
+    sendRequest(rq_seq);
+  }
+  rearm();
+}
+
+// Sends every request whose deadline has passed again, with the same rqSeq
+// so that whichever reply arrives first completes it. Returns false if one of
+// them has no retries left.
+bool Client::retransmitExpired() {
+  const double now = mg_time();
+  bool expired = false;
+  for (uint8_t rq_seq = 0; rq_seq < RQ_SEQ_COUNT; rq_seq++) {
+    InFlight &request = inFlight[rq_seq];
+    if (!request.used || request.deadline > now) {
+      continue;
+    }
+    if (request.retries >= max_retries) {
+      return false;
+    }
+    if (!expired) {
+      // Back off once per timer, however many requests it caught.
+      rtt.backoff();
+      expired = true;
+    }
+
+    request.retries++;
+    request.deadline = now + rtt.timeout();
+    retransmits++;
+    Metrics::count(Counter::Retransmits);
+    sendRequest(rq_seq);
+  }
+  return true;
+}
+
+// Encodes and sends the request in slot `rq_seq`. Retransmissions are built
+// again rather than resent as they were: each needs the next session sequence
+// number to get past the BMC's replay check.
+void Client::sendRequest(uint8_t rq_seq) {
+  switch (inFlight[rq_seq].kind) {
+  case RequestKind::ChassisControl:
+    sendChassisControl(
+        static_cast<ChassisControlCommand>(inFlight[rq_seq].pending.argument),
+        rq_seq);
+    break;
+  case RequestKind::GetDeviceId:
+  case RequestKind::Keepalive:
+    sendGetDeviceId(rq_seq);
+    break;
+  case RequestKind::Custom:
+    sendCustom(rq_seq);
+    break;
+  case RequestKind::CloseSession:
+    sendCloseSession(rq_seq);
+    break;
+  }
+}
+
+uint32_t Client::sessionId() const {
+  switch (state) {
   case ClientState::Initial:
-    return "Initial";
   case ClientState::NeedChannelAuthenticationCapabilities:
-    return "NeedChannelAuthenticationCapabilities";
   case ClientState::NeedSessionChallenge:
-    return "NeedSessionChallenge";
-  case ClientState::NeedActivateSession:
-    return "NeedActivateSession";
-  case ClientState::NeedSetSessionPrivilegeLevel:
-    return "NeedSetSessionPrivilegeLevel";
-  case ClientState::SessionReady:
-    return "SessionReady";
-  case ClientState::NeedChassisControlResponse:
-    return "NeedChassisControlResponse";
+    return 0;
+  default:
+#if IPMI_LANPLUS
+    // RMCP+ replies are addressed to the console's session ID, which the
+    // handshake replies carry in their payload instead.
+    if (lanplus) {
+      return lanplus->consoleId();
+    }
+#endif
+    return session_id;
   }
+}
 
-  sprintf(unknown_buf, "Unknown state: %d", (int)s);
-  return unknown_buf;
+ClientStatistics Client::statistics() const {
+  ClientStatistics stats;
+  stats.srtt = rtt.smoothed();
+  stats.rttvar = rtt.variance();
+  stats.rto = rtt.timeout();
+  stats.rtt_samples = rtt.sampleCount();
+  stats.requests = requests;
+  stats.retransmits = retransmits;
+  stats.timeouts = timeouts;
+  return stats;
 }
 
-void Client::send(ChassisControlCommand command) {
-  printf("send() state = %s\n", stateToString(state));
-  requestQueue.push_back(command);
+// Claims a free rqSeq for a request about to be sent. Sequence numbers are
+// handed out in rotation, so a late reply to a finished request is unlikely
+// to match a new one. Callers keep in_flight_count below RQ_SEQ_COUNT.
+uint8_t Client::allocate(RequestKind kind) {
+  while (inFlight[next_rq_seq].used) {
+    next_rq_seq = (next_rq_seq + 1) % RQ_SEQ_COUNT;
+  }
+  const uint8_t rq_seq = next_rq_seq;
+  next_rq_seq = (rq_seq + 1) % RQ_SEQ_COUNT;
 
-  if (state == ClientState::Initial && connection != NULL) {
-    begin();
+  InFlight &request = inFlight[rq_seq];
+  request.used = true;
+  request.kind = kind;
+  switch (kind) {
+  case RequestKind::ChassisControl:
+    request.netFn = ChassisControl::Command::responseNetFn;
+    request.command = ChassisControl::Command::command;
+    break;
+  case RequestKind::GetDeviceId:
+  case RequestKind::Keepalive:
+    request.netFn = GetDeviceId::Command::responseNetFn;
+    request.command = GetDeviceId::Command::command;
+    break;
+  case RequestKind::Custom:
+    // Set by sendCustom().
+    break;
+  case RequestKind::CloseSession:
+    request.netFn = CloseSession::Command::responseNetFn;
+    request.command = CloseSession::Command::command;
+    break;
+  }
+  request.sent_at = mg_time();
+  request.deadline = request.sent_at + rtt.timeout();
+  request.retries = 0;
+  in_flight_count++;
+  requests++;
+  return rq_seq;
+}
+
+void Client::release(uint8_t rq_seq) {
+  inFlight[rq_seq].used = false;
+  inFlight[rq_seq].pending.done = nullptr;
+  inFlight[rq_seq].pending.device_id_done = nullptr;
+  inFlight[rq_seq].pending.close_done = nullptr;
+  inFlight[rq_seq].pending.custom = nullptr;
+  in_flight_count--;
+}
+
+// Puts unanswered reads back at the front of the queue, in the order they
+// were sent, so that the next session sends them again. Anything else may
+// have run, perhaps with only its reply lost, so it goes to `unknown` instead,
+// for failUnknown() once the client's state is settled.
+void Client::requeueInFlight(RingQueue<PendingRequest, RQ_SEQ_COUNT> &unknown) {
+  // Newest first, each pushed in front of the one sent after it. send() keeps
+  // room for all of them.
+  for (uint8_t i = 1; i <= RQ_SEQ_COUNT && in_flight_count > 0; i++) {
+    const uint8_t rq_seq = (next_rq_seq + RQ_SEQ_COUNT - i) % RQ_SEQ_COUNT;
+    InFlight &request = inFlight[rq_seq];
+    if (!request.used) {
+      continue;
+    }
+    if (request.kind == RequestKind::Keepalive) {
+      // Nobody waits for it.
+    } else if (request.kind == RequestKind::GetDeviceId ||
+               (request.kind == RequestKind::Custom &&
+                request.pending.custom->idempotent())) {
+      requestQueue.push_front(std::move(request.pending));
+    } else {
+      unknown.push_front(std::move(request.pending));
+    }
+    release(rq_seq);
+  }
+}
+
+void Client::failUnknown(RingQueue<PendingRequest, RQ_SEQ_COUNT> &unknown) {
+  while (!unknown.empty()) {
+    PendingRequest pending = unknown.pop_front();
+    ipmi_log(IPMI_TRACE_WARN,
+             "Session lost with a command outstanding; its outcome is "
+             "unknown\n");
+    fail(pending, true);
+  }
+}
+
+void Client::rearm() {
+  if (in_flight_count == 0) {
+    armTimer(keepalive_interval);
+    return;
+  }
+
+  double earliest = 0;
+  for (const auto &request : inFlight) {
+    if (request.used && (earliest == 0 || request.deadline < earliest)) {
+      earliest = request.deadline;
+    }
+  }
+  setTimer(earliest);
+}
+
+void Client::giveUp() {
+  ipmi_trace(IPMI_TRACE_ERROR, GiveUp, this, (uint32_t)state, failures, 0);
+  Metrics::count(Counter::GiveUps);
+  ipmi_log(IPMI_TRACE_ERROR,
+           "IPMI failed to many times. Giving up. (Failures: %d)\n", failures);
+  failures = 0;
+
+  // No session could be made or kept, so nothing queued can be sent. Fail all
+  // of it; commands queued from the callbacks start a fresh attempt.
+  RingQueue<PendingRequest, RQ_SEQ_COUNT> unknown;
+  requeueInFlight(unknown);
+  setState(ClientState::Initial);
+  stopTimer();
+  RingQueue<PendingRequest, REQUEST_QUEUE_SIZE> failed;
+  while (!requestQueue.empty()) {
+    failed.push_back(requestQueue.pop_front());
+  }
+  failUnknown(unknown);
+  while (!failed.empty()) {
+    PendingRequest pending = failed.pop_front();
+    fail(pending);
   }
 }
 
-void Client::chassisControl(ChassisControlCommand command) {
-  printf("State: %s\n", stateToString(state));
-  send(command);
+// Tells the request's caller that it went unanswered.
+void Client::fail(PendingRequest &pending, bool outcome_unknown) {
+  if (pending.kind == RequestKind::Custom) {
+    pending.custom->complete(Status::Failure, PacketView(nullptr, 0),
+                             outcome_unknown);
+  } else if (pending.kind == RequestKind::GetDeviceId) {
+    if (pending.device_id_done) {
+      DeviceIdResult result;
+      result.outcome_unknown = outcome_unknown;
+      pending.device_id_done(result);
+    }
+  } else if (pending.kind == RequestKind::CloseSession) {
+    if (pending.close_done) {
+      CloseSessionResult result;
+      result.outcome_unknown = outcome_unknown;
+      pending.close_done(result);
+    }
+  } else if (pending.done) {
+    ChassisControlResult result;
+    result.command = static_cast<ChassisControlCommand>(pending.argument);
+    result.outcome_unknown = outcome_unknown;
+    pending.done(result);
+  }
 }
 
+Status Client::chassisControl(ChassisControlCommand command,
+                              ChassisControlCompletion done) {
+  PendingRequest request;
+  request.kind = RequestKind::ChassisControl;
+  request.argument = static_cast<uint8_t>(command);
+  request.done = std::move(done);
+  return send(std::move(request));
+}
+
+Status Client::getDeviceId(DeviceIdCompletion done) {
+  PendingRequest request;
+  request.kind = RequestKind::GetDeviceId;
+  request.device_id_done = std::move(done);
+  return send(std::move(request));
+}
+
+Status Client::closeSession(CloseSessionCompletion done) {
+  if (state == ClientState::Initial) {
+    return Status::Failure;
+  }
+  PendingRequest request;
+  request.kind = RequestKind::CloseSession;
+  request.close_done = std::move(done);
+  return send(std::move(request));
+}
+
+Status Client::request(CustomRequest &request) {
+  PendingRequest pending;
+  pending.kind = RequestKind::Custom;
+  pending.custom = &request;
+  return send(std::move(pending));
+}
+
+// A CustomRequest for request(netFn, command, data, done): it holds a copy
+// of the data and turns the response into a CustomResult. It deletes itself
+// once complete.
+class ClosureRequest : public CustomRequest {
+  NetworkFunction network_function;
+  uint8_t number;
+  uint8_t bytes[CUSTOM_REQUEST_SIZE];
+  size_t size;
+  CustomCompletion done;
+
+public:
+  ClosureRequest(NetworkFunction netFn, uint8_t command, const uint8_t *data,
+                 size_t size, CustomCompletion done)
+      : network_function(netFn), number(command), size(size),
+        done(std::move(done)) {
+    memcpy(bytes, data, size);
+  }
+
+  NetworkFunction netFn() const override { return network_function; }
+  uint8_t command() const override { return number; }
+  size_t write(uint8_t *out) const override {
+    memcpy(out, bytes, size);
+    return size;
+  }
+
+  void complete(Status status, PacketView response,
+                bool outcome_unknown) override {
+    CustomResult result;
+    result.outcome_unknown = outcome_unknown;
+    // openMessage() bounds the message, so this holds; checked all the same,
+    // as the BMC chooses the length.
+    static_assert(CUSTOM_RESPONSE_SIZE + messageLength(1) >=
+                      MAX_OPENED_MESSAGE_SIZE,
+                  "CustomResult must hold the largest opened message");
+    if (status == Status::Success &&
+        response.remaining() >= 1 + CHECKSUM_SIZE &&
+        response.remaining() - 1 - CHECKSUM_SIZE <= CUSTOM_RESPONSE_SIZE) {
+      result.answered = true;
+      result.completion_code = response[0];
+      result.status =
+          result.completion_code == 0 ? Status::Success : Status::Failure;
+      result.size = response.remaining() - 1 - CHECKSUM_SIZE;
+      memcpy(result.data, response.peek() + 1, result.size);
+    }
+    const CustomCompletion done = std::move(this->done);
+    delete this;
+    if (done) {
+      done(result);
+    }
+  }
+};
+
+Status Client::request(NetworkFunction netFn, uint8_t command,
+                       const uint8_t *data, size_t size,
+                       CustomCompletion done) {
+  insist_return(size <= CUSTOM_REQUEST_SIZE, Status::Failure,
+                "Request data of %zu bytes, more than %zu", size,
+                CUSTOM_REQUEST_SIZE);
+  ClosureRequest *closure =
+      new ClosureRequest(netFn, command, data, size, std::move(done));
+  if (request(*closure) == Status::Failure) {
+    delete closure;
+    return Status::Failure;
+  }
+  return Status::Success;
+}
+
+#if IPMI_FUTURES
+std::future<ChassisControlResult>
+Client::chassisControlFuture(ChassisControlCommand command) {
+  ChassisControlResult refused;
+  refused.command = command;
+  return resultFuture(
+      [this, command](ChassisControlCompletion done) {
+        return chassisControl(command, std::move(done));
+      },
+      refused);
+}
+
+std::future<DeviceIdResult> Client::getDeviceIdFuture() {
+  return resultFuture(
+      [this](DeviceIdCompletion done) { return getDeviceId(std::move(done)); },
+      DeviceIdResult());
+}
+
+std::future<CustomResult> Client::requestFuture(NetworkFunction netFn,
+                                                uint8_t command,
+                                                const uint8_t *data,
+                                                size_t size) {
+  return resultFuture(
+      [this, netFn, command, data, size](CustomCompletion done) {
+        return request(netFn, command, data, size, std::move(done));
+      },
+      CustomResult());
+}
+#endif
+
 void Client::begin() {
-  state = ClientState::NeedChannelAuthenticationCapabilities;
-  printf("Begin... %s\n", stateToString(state));
+  // Anything still outstanding belonged to the old session.
+  RingQueue<PendingRequest, RQ_SEQ_COUNT> unknown;
+  requeueInFlight(unknown);
+  setState(ClientState::NeedChannelAuthenticationCapabilities);
 
   // Send the ChannelAuthenticationCapabilities packet
-  IPMI::getChannelAuthenticationCapabilities(buffer);
-  mg_send(connection, buffer.buf, buffer.len);
-  mbuf_remove(&buffer, buffer.len);
+  uint8_t packet[MAX_PACKET_SIZE];
+  size_t length =
+      IPMI::getChannelAuthenticationCapabilities(packet, sizeof(packet));
+#if IPMI_LANPLUS
+  if (lanplus) {
+    // Ask for the IPMI 2.0 extended data on the current channel
+    length = IPMI::encode<GetChannelAuthenticationCapabilities::Command>(
+        packet, sizeof(packet),
+        GetChannelAuthenticationCapabilities::Request(0x8e));
+  }
+#endif
+  transmit(packet, length);
+  // Last, as the callbacks may queue more.
+  failUnknown(unknown);
 }
 
-void Client::receivePacket(struct mbuf payload) {
-  IPMI::RMCP rmcp;
-  IPMI::IPMB ipmb;
-  IPMI::Session session;
-  printf("receivePacket() state = %s\n", stateToString(state));
+#if IPMI_LANPLUS
+void Client::useLanplus(const Lanplus::CipherSuite &suite) {
+  lanplus.reset(
+      new Lanplus::Session(password, sizeof(password), "root", suite));
+}
+#endif
+
+void Client::receivePacket(struct mbuf buf) {
+  PacketView payload(buf);
+  ipmi_trace(IPMI_TRACE_DEBUG, Receive, this, buf.len,
+             headerSessionId((const uint8_t *)buf.buf, buf.len),
+             packetKind((const uint8_t *)buf.buf, buf.len));
+  Metrics::count(Counter::PacketsReceived);
+  Metrics::count(Counter::BytesReceived, buf.len);
+
+  // Handshake replies are timed here, before the next packet is sent.
+  const ClientState stage = state;
+  const bool handshake =
+      state != ClientState::Initial && state != ClientState::SessionReady;
+  const bool retried = handshake_retries > 0;
+  const double sent_at = handshake_sent_at;
 
   Status status = Status::Success;
   switch (state) {
   case ClientState::Initial:
-    printf("Invalid state? Received a packet when state=Initial?");
+    ipmi_log(IPMI_TRACE_WARN,
+             "Invalid state? Received a packet when state=Initial?\n");
     break;
   case ClientState::NeedChannelAuthenticationCapabilities:
     status = receiveChannelAuthenticationCapabilities(payload);
@@ -95,29 +594,105 @@ void Client::receivePacket(struct mbuf payload) {
   case ClientState::NeedActivateSession:
     status = receiveActivateSession(payload);
     break;
+#if IPMI_LANPLUS
+  case ClientState::NeedOpenSession:
+    status = receiveOpenSession(payload);
+    break;
+  case ClientState::NeedRAKP2:
+    status = receiveRAKP2(payload);
+    break;
+  case ClientState::NeedRAKP4:
+    status = receiveRAKP4(payload);
+    break;
+#else
+  case ClientState::NeedOpenSession:
+  case ClientState::NeedRAKP2:
+  case ClientState::NeedRAKP4:
+    break;
+#endif
   case ClientState::NeedSetSessionPrivilegeLevel:
     status = receiveSetSessionPrivilegeLevel(payload);
     break;
   case ClientState::SessionReady:
-    // what now?
-    // After: Pop any command waiting in the queue and send it.
+    status = receiveResponse(payload);
     break;
-  case ClientState::NeedChassisControlResponse:
-    status = receiveChassisControl(payload);
   }
 
+  if (handshake && status == Status::Success) {
+    const double elapsed = mg_time() - sent_at;
+    Metrics::observeStage((uint8_t)stage, elapsed, metrics_host);
+    if (stage_observer) {
+      stage_observer(stage, elapsed);
+    }
+    if (!retried) {
+      rtt.sample(elapsed);
+    }
+  }
   if (status == Status::Failure) {
+    Metrics::count(Counter::DecodeFailures);
+  }
+
+  // A bad packet is dropped and the request stays outstanding; the timer
+  // decides when to give up waiting for a good one. Within the session a bad
+  // packet may not even belong to a request, so it counts for nothing.
+  if (status == Status::Failure && state != ClientState::SessionReady) {
     if (failures < max_failures) {
-      printf("IPMI request failed. Will retry.\n");
+      ipmi_trace(IPMI_TRACE_WARN, Retry, this, (uint32_t)state, failures, 0);
       failures++;
     } else {
-      printf("IPMI failed to many times. Giving up. (Failures: %d)\n",
-             failures);
+      giveUp();
     }
   }
 }
 
-Status Client::receiveChannelAuthenticationCapabilities(struct mbuf payload) {
+void Client::timerExpired() {
+  ipmi_trace(IPMI_TRACE_INFO, Timeout, this, (uint32_t)state, 0, 0);
+  if (state == ClientState::Initial || !connected()) {
+    return;
+  }
+
+  if (state == ClientState::SessionReady) {
+    if (in_flight_count == 0) {
+      sendRequest(allocate(RequestKind::Keepalive));
+      rearm();
+      return;
+    }
+    if (retransmitExpired()) {
+      rearm();
+      return;
+    }
+  } else if (handshake_retries < max_retries) {
+    // The handshake packet or its reply was probably lost.
+    handshake_retries++;
+    retransmits++;
+    Metrics::count(Counter::Retransmits);
+    rtt.backoff();
+    if (state == ClientState::NeedSetSessionPrivilegeLevel) {
+      // Sent within the session, so like any request there it needs the next
+      // sequence number to get past the BMC's replay check.
+      handshake_length =
+          encodeSetSessionPrivilege(handshake_packet, sizeof(handshake_packet));
+    }
+    output(handshake_packet, handshake_length);
+    armTimer(rtt.timeout());
+    return;
+  }
+
+  // Still no reply. Within a session this is how BMCs reject it: packets for
+  // a session they have closed are dropped. Either way, start over with a new
+  // session, keeping the queued commands.
+  timeouts++;
+  Metrics::count(Counter::Timeouts);
+  if (failures < max_failures) {
+    failures++;
+    begin();
+  } else {
+    giveUp();
+  }
+}
+
+Status
+Client::receiveChannelAuthenticationCapabilities(PacketView payload) {
   IPMI::RMCP rmcp;
   IPMI::IPMB ipmb;
   IPMI::Session session;
@@ -131,25 +706,55 @@ Status Client::receiveChannelAuthenticationCapabilities(struct mbuf payload) {
   // If all is good, set state NeedSessionChallenge and send a
   // GetSessionChallenge request
   if (response.completion_code != 0) {
-    printf("IPMI abort: ChannelAuthenticationCapabilities request failed.\n");
+    ipmi_trace(IPMI_TRACE_ERROR, Abort, this,
+               (uint32_t)TraceAbort::ChannelAuthenticationCapabilities, 0, 0);
+    ipmi_log(IPMI_TRACE_ERROR,
+             "IPMI abort: ChannelAuthenticationCapabilities request failed.\n");
     return Status::Failure;
   }
 
+#if IPMI_LANPLUS
+  if (lanplus) {
+    if (!response.hasIPMI20()) {
+      ipmi_trace(IPMI_TRACE_ERROR, Abort, this, (uint32_t)TraceAbort::NoIPMI20,
+                 0, 0);
+      ipmi_log(IPMI_TRACE_ERROR,
+               "IPMI abort: Remote claims no support for IPMI 2.0. Cannot "
+               "continue.\n");
+      return Status::Failure;
+    }
+
+    setState(ClientState::NeedOpenSession);
+
+    uint8_t packet[Lanplus::MAX_PACKET_SIZE];
+    size_t length = lanplus->openSession(packet, sizeof(packet));
+    if (length == 0) {
+      return Status::Failure;
+    }
+    transmit(packet, length);
+    return Status::Success;
+  }
+#endif
+
   if (!response.hasMD5()) {
-    printf("IPMI abort: Remote claims no support for MD5 authcode. Cannot "
-           "continue.\n");
+    ipmi_trace(IPMI_TRACE_ERROR, Abort, this, (uint32_t)TraceAbort::NoMD5, 0,
+               0);
+    ipmi_log(IPMI_TRACE_ERROR,
+             "IPMI abort: Remote claims no support for MD5 authcode. Cannot "
+             "continue.\n");
     return Status::Failure;
   }
 
-  state = ClientState::NeedSessionChallenge;
+  unauthenticated = response.perMessageAuthDisabled();
+  setState(ClientState::NeedSessionChallenge);
 
-  IPMI::getSessionChallenge(buffer);
-  mg_send(connection, buffer.buf, buffer.len);
-  mbuf_remove(&buffer, buffer.len);
+  uint8_t packet[MAX_PACKET_SIZE];
+  size_t length = IPMI::getSessionChallenge(packet, sizeof(packet));
+  transmit(packet, length);
   return Status::Success;
 }
 
-Status Client::receiveSessionChallenge(struct mbuf payload) {
+Status Client::receiveSessionChallenge(PacketView payload) {
   IPMI::RMCP rmcp;
   IPMI::IPMB ipmb;
   IPMI::Session session;
@@ -163,17 +768,19 @@ Status Client::receiveSessionChallenge(struct mbuf payload) {
   session_id = response.session_id;
 
   sequence = (uint32_t)random();
+  ipmi_trace(IPMI_TRACE_DEBUG, Session, this, session_id, sequence, 0);
 
-  state = ClientState::NeedActivateSession;
+  setState(ClientState::NeedActivateSession);
 
-  IPMI::activateSession(buffer, password, sequence, session_id,
-                        response.challenge);
-  mg_send(connection, buffer.buf, buffer.len);
-  mbuf_remove(&buffer, buffer.len);
+  uint8_t packet[MAX_PACKET_SIZE];
+  size_t length = IPMI::activateSession(packet, sizeof(packet), password,
+                                        sequence, session_id,
+                                        response.challenge);
+  transmit(packet, length);
   return Status::Success;
 }
 
-Status Client::receiveActivateSession(struct mbuf payload) {
+Status Client::receiveActivateSession(PacketView payload) {
   IPMI::RMCP rmcp;
   IPMI::IPMB ipmb;
   IPMI::Session session;
@@ -187,58 +794,458 @@ Status Client::receiveActivateSession(struct mbuf payload) {
   session_id = response.session;
 
   sequence_out = response.sequence;
+  auth = AuthCode(password, session_id);
 
-  state = ClientState::NeedSetSessionPrivilegeLevel;
+  setState(ClientState::NeedSetSessionPrivilegeLevel);
 
-  IPMI::setSessionPrivilege(buffer, session_id, sequence_out, password,
-                            IPMI::AuthenticationCapability::Administrator);
-  mg_hexdumpf(stdout, buffer.buf, buffer.len);
-  mg_send(connection, buffer.buf, buffer.len);
-  mbuf_remove(&buffer, buffer.len);
+  chassisControlPacket = PacketTemplate::chassisControl(session_id);
 
-  sequence_out++;
+  sendSetSessionPrivilege();
   return Status::Success;
 }
 
-Status Client::receiveSetSessionPrivilegeLevel(struct mbuf payload) {
-  IPMI::RMCP rmcp;
+#if IPMI_LANPLUS
+Status Client::receiveOpenSession(PacketView payload) {
+  if (lanplus->receiveOpenSession(payload) == Status::Failure) {
+    return Status::Failure;
+  }
+
+  setState(ClientState::NeedRAKP2);
+
+  uint8_t packet[Lanplus::MAX_PACKET_SIZE];
+  size_t length = lanplus->rakp1(packet, sizeof(packet));
+  transmit(packet, length);
+  return Status::Success;
+}
+
+Status Client::receiveRAKP2(PacketView payload) {
+  if (lanplus->receiveRAKP2(payload) == Status::Failure) {
+    return Status::Failure;
+  }
+
+  setState(ClientState::NeedRAKP4);
+
+  uint8_t packet[Lanplus::MAX_PACKET_SIZE];
+  size_t length = lanplus->rakp3(packet, sizeof(packet));
+  transmit(packet, length);
+  return Status::Success;
+}
+
+Status Client::receiveRAKP4(PacketView payload) {
+  if (lanplus->receiveRAKP4(payload) == Status::Failure) {
+    return Status::Failure;
+  }
+
+  setState(ClientState::NeedSetSessionPrivilegeLevel);
+  sendSetSessionPrivilege();
+  return Status::Success;
+}
+#endif
+
+// Encodes SetSessionPrivilege with the next session sequence number.
+size_t Client::encodeSetSessionPrivilege(uint8_t *out, size_t size) {
+  const auto privilege = IPMI::AuthenticationCapability::Administrator;
+#if IPMI_LANPLUS
+  if (lanplus) {
+    return Lanplus::encode<SetSessionPrivilege::Command>(
+        out, size, *lanplus, SetSessionPrivilege::Request((uint8_t)privilege));
+  }
+#endif
+
+  auto packet = PacketTemplate::setSessionPrivilege(session_id);
+  packet.patch(sequence_out, DEFAULT_RQ_SEQ, (uint8_t)privilege, auth);
+  sequence_out++;
+  if (packet.size() > size) {
+    return 0;
+  }
+  memcpy(out, packet.data(), packet.size());
+  return packet.size();
+}
+
+void Client::sendSetSessionPrivilege() {
+  uint8_t packet[sizeof(handshake_packet)];
+  transmit(packet, encodeSetSessionPrivilege(packet, sizeof(packet)));
+}
+
+// Requests within the session are sent with output() directly: their
+// deadlines are tracked per request and the timer is set by rearm().
+void Client::sendChassisControl(ChassisControlCommand command,
+                                uint8_t rq_seq) {
+#if IPMI_LANPLUS
+  if (lanplus) {
+    uint8_t packet[Lanplus::MAX_PACKET_SIZE];
+    size_t length = Lanplus::encode<ChassisControl::Command>(
+        packet, sizeof(packet), *lanplus, rq_seq,
+        ChassisControl::Request(command));
+    output(packet, length);
+    return;
+  }
+#endif
+
+  chassisControlPacket.patch(sequence_out, rq_seq, (uint8_t)command, auth);
+  sequence_out++;
+  output(chassisControlPacket.data(), chassisControlPacket.size());
+}
+
+// Decodes a response received within the session, whichever kind it is.
+template <class C>
+Status Client::decodeInSession(PacketView &payload,
+                               typename C::Response &response) {
   IPMI::IPMB ipmb;
+#if IPMI_LANPLUS
+  if (lanplus) {
+    return Lanplus::decode<C>(payload, *lanplus, ipmb, response);
+  }
+#endif
+
+  IPMI::RMCP rmcp;
   IPMI::Session session;
+  return IPMI::decode<C>(payload, auth, rmcp, ipmb, session, response);
+}
+
+Status Client::receiveSetSessionPrivilegeLevel(PacketView payload) {
   IPMI::SetSessionPrivilege::Response response;
 
-  auto status = IPMI::decode(payload, password, rmcp, ipmb, session, response);
+  auto status =
+      decodeInSession<SetSessionPrivilege::Command>(payload, response);
   if (status == Status::Failure) {
     return status;
   }
 
   // XXX: Verify the response has the requested privilege level
 
-  state = ClientState::SessionReady;
+  failures = 0;
+  setState(ClientState::SessionReady);
+  sendNext();
+  return Status::Success;
+}
+
+// Checks a packet received within the session and points `message` at its
+// IPMB message. RMCP+ payloads are opened into `buffer` first.
+Status Client::openMessage(PacketView &payload, uint8_t *buffer, size_t size,
+                           PacketView &message) {
+#if IPMI_LANPLUS
+  if (lanplus) {
+    size_t length;
+    if (lanplus->open(payload, buffer, size, length) == Status::Failure) {
+      return Status::Failure;
+    }
+    message = PacketView(buffer, length);
+    return Status::Success;
+  }
+#endif
 
-  // Send Chassis Control?
-  auto command = requestQueue.front();
-  requestQueue.pop_front();
-  IPMI::chassisControl(buffer, session_id, sequence_out, password, command);
+  IPMI::RMCP rmcp;
+  IPMI::Session session;
+  if (rmcp.read(payload) == Status::Failure ||
+      session.read(payload) == Status::Failure ||
+      session.verify(payload, auth, unauthenticated) == Status::Failure) {
+    return Status::Failure;
+  }
+  // Only the length the header gives, whatever follows in the datagram.
+  insist_return(payload.remaining() >= session.getLength(), Status::Failure,
+                "Session header claims %d bytes of payload, but only %zd "
+                "bytes remain",
+                session.getLength(), payload.remaining());
+  message = PacketView(payload.peek(), session.getLength());
+  return Status::Success;
+}
+
+// Decodes the data of a response whose IPMB header has already been read.
+template <class C>
+static Status decodeData(PacketView &message, const IPMB &ipmb,
+                         typename C::Response &response) {
+  if (decodeResponse<C>(message, ipmb, response) == Status::Failure) {
+    return Status::Failure;
+  }
+  insist_return(
+      message.remaining() == 0, Status::Failure,
+      "Buffer length should be empty if decoding is correct, but has %zd bytes",
+      message.remaining());
+  return Status::Success;
+}
+
+// Matches a response within the session to its request by rqSeq, network
+// function and command, so responses may arrive in any order.
+Status Client::receiveResponse(PacketView payload) {
+#if IPMI_LANPLUS
+  uint8_t buffer[Lanplus::MAX_MESSAGE_SIZE];
+#else
+  // Unused: IPMI 1.5 messages are read where they were received.
+  uint8_t buffer[1];
+#endif
+  PacketView message(nullptr, 0);
+  IPMI::IPMB ipmb;
+  if (openMessage(payload, buffer, sizeof(buffer), message) ==
+          Status::Failure ||
+      ipmb.read(message) == Status::Failure) {
+    return Status::Failure;
+  }
+
+  InFlight &request = inFlight[ipmb.getSequence()];
+  insist_return(request.used &&
+                    request.netFn == ipmb.getNetworkFunction() &&
+                    request.command == ipmb.command,
+                Status::Failure,
+                "No request outstanding for command %02x with rqSeq %d",
+                ipmb.command, ipmb.getSequence());
+
+  // Only a request sent once gives an unambiguous round trip.
+  const bool retried = request.retries > 0;
+  const double sent_at = request.sent_at;
+
+  // A response that fails to decode leaves its request outstanding, to be
+  // retried if no good one arrives.
+  Status status = Status::Failure;
+  CommandMetric metric = CommandMetric::Keepalive;
+  switch (request.kind) {
+  case RequestKind::ChassisControl:
+    metric = CommandMetric::ChassisControl;
+    status = receiveChassisControl(message, ipmb, request);
+    break;
+  case RequestKind::GetDeviceId:
+    metric = CommandMetric::GetDeviceId;
+    status = receiveGetDeviceId(message, ipmb, request);
+    break;
+  case RequestKind::Keepalive:
+    status = receiveGetDeviceId(message, ipmb, request);
+    break;
+  case RequestKind::Custom:
+    metric = CommandMetric::Custom;
+    status = receiveCustom(message, ipmb, request);
+    break;
+  case RequestKind::CloseSession:
+    metric = CommandMetric::CloseSession;
+    status = receiveCloseSession(message, ipmb, request);
+    break;
+  }
+  if (status == Status::Failure) {
+    return status;
+  }
+  const double elapsed = mg_time() - sent_at;
+  Metrics::observeCommand(metric, elapsed, metrics_host);
+  if (!retried) {
+    rtt.sample(elapsed);
+  }
+
+  // Unless the session was just closed.
+  if (state == ClientState::SessionReady) {
+    sendNext();
+  }
+  return Status::Success;
+}
+
+Status Client::receiveChassisControl(PacketView &message, const IPMB &ipmb,
+                                     InFlight &request) {
+  IPMI::ChassisControl::Response response;
+  if (decodeData<ChassisControl::Command>(message, ipmb, response) ==
+      Status::Failure) {
+    return Status::Failure;
+  }
+
+  // A non-zero completion code is still an answer: the BMC refused the
+  // command, and sending it again will not change that.
+  if (response.completion_code != 0) {
+    ipmi_trace(IPMI_TRACE_WARN, Refused, this, request.pending.argument,
+               response.completion_code, 0);
+  }
+
+  // Release the request before the callback, which may send more.
+  const PendingRequest pending = std::move(request.pending);
+  release(ipmb.getSequence());
+  failures = 0;
+  if (pending.done) {
+    ChassisControlResult result;
+    result.command = static_cast<ChassisControlCommand>(pending.argument);
+    result.status =
+        response.completion_code == 0 ? Status::Success : Status::Failure;
+    result.answered = true;
+    result.completion_code = response.completion_code;
+    result.response = response;
+    pending.done(result);
+  }
+  return Status::Success;
+}
+
+// Keepalives and reads are the same packet.
+void Client::sendGetDeviceId(uint8_t rq_seq) {
+#if IPMI_LANPLUS
+  if (lanplus) {
+    uint8_t packet[Lanplus::MAX_PACKET_SIZE];
+    size_t length = Lanplus::encode<GetDeviceId::Command>(
+        packet, sizeof(packet), *lanplus, rq_seq, GetDeviceId::Request());
+    output(packet, length);
+    return;
+  }
+#endif
+
+  uint8_t packet[MAX_PACKET_SIZE];
+  size_t length = IPMI::encode<GetDeviceId::Command>(
+      packet, sizeof(packet), session_id, sequence_out, rq_seq, auth,
+      GetDeviceId::Request());
+  sequence_out++;
+  output(packet, length);
+}
+
+Status Client::receiveGetDeviceId(PacketView &message, const IPMB &ipmb,
+                                  InFlight &request) {
+  DeviceIdResult result;
+  if (decodeData<GetDeviceId::Command>(message, ipmb, result.response) ==
+      Status::Failure) {
+    return Status::Failure;
+  }
+
+  const DeviceIdCompletion done = std::move(request.pending.device_id_done);
+  release(ipmb.getSequence());
+  failures = 0;
+  if (done) {
+    result.status = Status::Success;
+    result.answered = true;
+    done(result);
+  }
+  return Status::Success;
+}
+
+// The data of a CustomRequest, for writePacket().
+struct CustomData {
+  uint8_t bytes[CUSTOM_REQUEST_SIZE];
+  size_t size;
+
+  uint8_t length() const { return messageLength(size); }
+  void write(PacketWriter &out) const { out.put(bytes, size); }
+};
+
+void Client::sendCustom(uint8_t rq_seq) {
+  InFlight &request = inFlight[rq_seq];
+  const CustomRequest &custom = *request.pending.custom;
+  request.netFn = (NetworkFunction)((uint8_t)custom.netFn() + 1);
+  request.command = custom.command();
+
+  CustomData data;
+  data.size = custom.write(data.bytes);
+  const IPMB ipmb(custom.netFn(), rq_seq, custom.command());
+#if IPMI_LANPLUS
+  if (lanplus) {
+    uint8_t message[IPMB_SIZE + CUSTOM_REQUEST_SIZE + CHECKSUM_SIZE];
+    PacketWriter writer(message, sizeof(message));
+    ipmb.write(writer);
+    data.write(writer);
+    writer.put((uint8_t)-sum(message + 3, writer.position() - 3));
+    uint8_t packet[Lanplus::MAX_PACKET_SIZE];
+    output(packet, lanplus->seal(packet, sizeof(packet), message,
+                                 writer.position()));
+    return;
+  }
+#endif
+
+  uint8_t packet[MAX_PACKET_SIZE];
+  const size_t length =
+      writePacket(packet, sizeof(packet), AUTH_TYPE_MD5, session_id,
+                  sequence_out, ipmb, data);
+  if (length != 0) {
+    authenticate(packet, length, auth, session_id, sequence_out);
+  }
   sequence_out++;
-  mg_send(connection, buffer.buf, buffer.len);
-  mbuf_remove(&buffer, buffer.len);
+  output(packet, length);
+}
 
-  state = ClientState::NeedChassisControlResponse;
+Status Client::receiveCustom(PacketView &message, const IPMB &ipmb,
+                             InFlight &request) {
+  CustomRequest *custom = request.pending.custom;
+  release(ipmb.getSequence());
+  failures = 0;
+  custom->complete(Status::Success, message, false);
   return Status::Success;
 }
 
-Status Client::receiveChassisControl(struct mbuf payload) {
-  printf("Received ChassisControl response\n");
-  mg_hexdumpf(stdout, payload.buf, payload.len);
+void Client::sendCloseSession(uint8_t rq_seq) {
+#if IPMI_LANPLUS
+  if (lanplus) {
+    uint8_t packet[Lanplus::MAX_PACKET_SIZE];
+    size_t length = Lanplus::encode<CloseSession::Command>(
+        packet, sizeof(packet), *lanplus, rq_seq,
+        CloseSession::Request(lanplus->bmcId()));
+    output(packet, length);
+    return;
+  }
+#endif
+
+  uint8_t packet[MAX_PACKET_SIZE];
+  size_t length = IPMI::encode<CloseSession::Command>(
+      packet, sizeof(packet), session_id, sequence_out, rq_seq, auth,
+      CloseSession::Request(session_id));
+  sequence_out++;
+  output(packet, length);
+}
+
+Status Client::receiveCloseSession(PacketView &message, const IPMB &ipmb,
+                                   InFlight &request) {
+  CloseSessionResult result;
+  if (decodeData<CloseSession::Command>(message, ipmb, result.response) ==
+      Status::Failure) {
+    return Status::Failure;
+  }
+
+  const CloseSessionCompletion done = std::move(request.pending.close_done);
+  release(ipmb.getSequence());
+  failures = 0;
+  // 0x87, an invalid session ID, means the BMC had closed it already.
+  result.completion_code = result.response.completion_code;
+  result.answered = true;
+  result.status =
+      result.completion_code == 0 || result.completion_code == 0x87
+          ? Status::Success
+          : Status::Failure;
+
+  RingQueue<PendingRequest, RQ_SEQ_COUNT> unknown;
+  if (result.status == Status::Success) {
+    // Whatever was sent after the close went to a session that is gone.
+    requeueInFlight(unknown);
+    setState(ClientState::Initial);
+    stopTimer();
+  }
+  if (done) {
+    done(result);
+  }
+  failUnknown(unknown);
+  if (state == ClientState::Initial && !requestQueue.empty() && connected()) {
+    begin();
+  }
   return Status::Success;
 }
 
+// A new connection to the same BMC keeps the session: BMCs identify it by
+// session id, not by the UDP socket it arrives on.
 void Client::setConnection(mg_connection *c) {
-  state = ClientState::Initial;
+  if (c != connection) {
+    ipmi_trace(IPMI_TRACE_INFO, Connect, this, 0, 0, 0);
+  }
   connection = c;
 
-  if (requestQueue.size() > 0) {
+  if (state == ClientState::Initial && requestQueue.size() > 0) {
     begin();
   }
 }
+
+void Client::setTransport(Transport *t) {
+  transport = t;
+  if (transport == nullptr) {
+    stopTimer();
+    return;
+  }
+
+  if (state == ClientState::Initial && requestQueue.size() > 0) {
+    begin();
+  }
+}
+
+void Client::connectionClosed(mg_connection *c) {
+  if (connection != c) {
+    return;
+  }
+  ipmi_trace(IPMI_TRACE_INFO, Close, this, 0, 0, 0);
+  // The connection's own timer went with it.
+  stopTimer();
+  connection = NULL;
+}
 }; // namespace IPMI
\ No newline at end of file
@@ -17,7 +17,38 @@
   */
 #pragma once
 #include "ipmi.h"
-#include <list>
+#include "lanplus.h"
+#include "ring_queue.h"
+#include "timing_wheel.h"
+#include "trace.h"
+#include <functional>
+#include <memory>
+#include <vector>
+
+// std::future completions need thread support, which the Mongoose OS build
+// does without.
+#ifndef IPMI_FUTURES
+#if CS_PLATFORM == CS_P_UNIX || CS_PLATFORM == CS_P_WINDOWS
+#define IPMI_FUTURES 1
+#else
+#define IPMI_FUTURES 0
+#endif
+#endif
+#if IPMI_FUTURES
+#include <future>
+#endif
+
+// co_await completions, for code built as C++20 or later.
+#ifndef IPMI_COROUTINES
+#if defined(__cpp_impl_coroutine) && __cpp_impl_coroutine >= 201902L
+#define IPMI_COROUTINES 1
+#else
+#define IPMI_COROUTINES 0
+#endif
+#endif
+#if IPMI_COROUTINES
+#include <coroutine>
+#endif
 
 namespace IPMI {
 enum class ClientState {
@@ -25,46 +56,490 @@ enum class ClientState {
   NeedChannelAuthenticationCapabilities,
   NeedSessionChallenge,
   NeedActivateSession,
+  NeedOpenSession,
+  NeedRAKP2,
+  NeedRAKP4,
   NeedSetSessionPrivilegeLevel,
-  SessionReady,
-  NeedChassisControlResponse
+  // The session is open. Requests are tracked individually from here on.
+  SessionReady
+};
+
+inline const char *stateName(ClientState state) {
+  switch (state) {
+  case ClientState::Initial:
+    return "Initial";
+  case ClientState::NeedChannelAuthenticationCapabilities:
+    return "NeedChannelAuthenticationCapabilities";
+  case ClientState::NeedSessionChallenge:
+    return "NeedSessionChallenge";
+  case ClientState::NeedActivateSession:
+    return "NeedActivateSession";
+  case ClientState::NeedOpenSession:
+    return "NeedOpenSession";
+  case ClientState::NeedRAKP2:
+    return "NeedRAKP2";
+  case ClientState::NeedRAKP4:
+    return "NeedRAKP4";
+  case ClientState::NeedSetSessionPrivilegeLevel:
+    return "NeedSetSessionPrivilegeLevel";
+  case ClientState::SessionReady:
+    return "SessionReady";
+  }
+  return "Unknown";
+}
+
+// Jacobson/Karels round trip estimator (RFC 6298), kept per BMC, which sets
+// the retransmission timeout. Round trips are only sampled from requests that
+// were sent once (Karn's algorithm), and every timeout doubles the RTO until
+// the next sample.
+class RttEstimator {
+  double srtt = 0;
+  double rttvar = 0;
+  double rto;
+  uint32_t samples = 0;
+
+public:
+  RttEstimator();
+  void sample(double rtt);
+  void backoff();
+
+  double smoothed() const { return srtt; }
+  double variance() const { return rttvar; }
+  double timeout() const { return rto; }
+  uint32_t sampleCount() const { return samples; }
+};
+
+// Round trip estimate and retry counts for one BMC.
+struct ClientStatistics {
+  // Seconds. srtt and rttvar are 0 until the first sample.
+  double srtt;
+  double rttvar;
+  double rto;
+  uint32_t rtt_samples;
+  // Packets sent for the first time, and sent again after a timeout.
+  uint32_t requests;
+  uint32_t retransmits;
+  // Requests that went unanswered after every retry.
+  uint32_t timeouts;
+};
+
+// How a request ended. `status` is Success only when the BMC answered with
+// completion code 0. When it refused the command, `completion_code` says why;
+// when the client gave up first, `answered` is false. `outcome_unknown` is
+// then true if the command had been sent and its session was lost before an
+// answer came: it may or may not have run. Only reads are sent again in a
+// new session, as running anything else twice could power cycle a machine
+// twice.
+template <class C> struct Result {
+  Status status = Status::Failure;
+  bool answered = false;
+  bool outcome_unknown = false;
+  uint8_t completion_code = 0;
+  typename C::Response response;
+};
+
+struct ChassisControlResult : Result<ChassisControl::Command> {
+  ChassisControlCommand command;
+};
+
+struct DeviceIdResult : Result<GetDeviceId::Command> {};
+
+struct CloseSessionResult : Result<CloseSession::Command> {};
+
+// The largest IPMB message Client::openMessage() returns: an RMCP+ one once
+// decrypted, or an IPMI 1.5 one, whose length the session header gives in
+// one byte.
+#if IPMI_LANPLUS
+static const size_t MAX_OPENED_MESSAGE_SIZE = Lanplus::MAX_MESSAGE_SIZE;
+#else
+static const size_t MAX_OPENED_MESSAGE_SIZE = 0xff;
+#endif
+
+// The most response data a CustomResult holds: whatever follows the
+// completion code in the largest message.
+static const size_t CUSTOM_RESPONSE_SIZE =
+    MAX_OPENED_MESSAGE_SIZE - messageLength(1);
+
+// How a request sent with Client::request(netFn, command, data, done)
+// ended, as Result does for the commands Client knows.
+struct CustomResult {
+  Status status = Status::Failure;
+  bool answered = false;
+  bool outcome_unknown = false;
+  uint8_t completion_code = 0;
+  // The response data after the completion code, without the checksum.
+  uint8_t data[CUSTOM_RESPONSE_SIZE];
+  size_t size = 0;
+};
+
+// Called once for every queued request, on the event loop.
+template <class R> using Completion = std::function<void(const R &)>;
+typedef Completion<ChassisControlResult> ChassisControlCompletion;
+typedef Completion<DeviceIdResult> DeviceIdCompletion;
+typedef Completion<CloseSessionResult> CloseSessionCompletion;
+typedef Completion<CustomResult> CustomCompletion;
+// Called as each handshake stage ends, with how long it took; see
+// Metrics::observeStage().
+typedef std::function<void(ClientState stage, double seconds)> StageObserver;
+
+// The most request data a CustomRequest may write.
+static const size_t CUSTOM_REQUEST_SIZE = 16;
+
+// A request for a command Client has no method of its own for, such as the
+// SDR reads. Its owner writes the data and reads the response; the client
+// sends it within the session, retries it and matches its response like any
+// other. The owner keeps it alive until complete() is called, which happens
+// once per Client::request().
+class CustomRequest {
+public:
+  virtual ~CustomRequest() {}
+  virtual NetworkFunction netFn() const = 0;
+  virtual uint8_t command() const = 0;
+  // Writes the data that follows the IPMB header into `out`, at most
+  // CUSTOM_REQUEST_SIZE bytes, and returns its length.
+  virtual size_t write(uint8_t *out) const = 0;
+  // Whether the request may be sent again in a new session when the one it
+  // was sent in is lost, as reads may.
+  virtual bool idempotent() const { return false; }
+  // With Success, `response` is the response data as Response::read() takes
+  // it, completion code first and checksum last, whatever the completion
+  // code. With Failure the client gave up, and `response` is empty;
+  // `outcome_unknown` is as in Result.
+  virtual void complete(Status status, PacketView response,
+                        bool outcome_unknown) = 0;
+};
+
+#if IPMI_FUTURES
+// Starts a request with `start`, which takes a Completion<R> and returns
+// whether the request was queued, and returns a future for its result. A
+// request that is not queued gives `refused`.
+template <class R, class Start>
+std::future<R> resultFuture(Start start, const R &refused) {
+  // std::function needs a copyable target, so share the promise.
+  std::shared_ptr<std::promise<R>> promise(new std::promise<R>());
+  std::future<R> future = promise->get_future();
+  if (start(Completion<R>([promise](const R &result) {
+        promise->set_value(result);
+      })) == Status::Failure) {
+    promise->set_value(refused);
+  }
+  return future;
+}
+#endif
+
+// What `co_await` on a request gives. Declared whatever the language version,
+// so that Client reads the same in every translation unit, and defined below
+// where coroutines are available.
+template <class R> class Awaiter;
+
+// Carries a client's packets in place of a mongoose connection. Whoever owns
+// it hands replies to Client::receivePacket().
+class Transport {
+public:
+  virtual ~Transport() {}
+  virtual void send(const uint8_t *packet, size_t length) = 0;
 };
 
+// Requests a client holds for a BMC, queued and in flight together. Queuing
+// more fails; see Client::chassisControl(). Requests in flight go back in the
+// queue when a session is lost, which is why they count too.
+static const size_t REQUEST_QUEUE_SIZE = 32;
+static_assert(REQUEST_QUEUE_SIZE <= RQ_SEQ_COUNT,
+              "Every request in flight needs its own rqSeq");
+
 class Client {
 private:
+  // What a request is, which decides how to encode it and how to decode its
+  // response.
+  enum class RequestKind {
+    ChassisControl,
+    GetDeviceId,
+    Keepalive,
+    Custom,
+    CloseSession
+  };
+
+  // A request waiting to be sent, or outstanding. `argument` is the request's
+  // parameter for kinds that take one, such as the chassis control command.
+  // Only the completion matching `kind` is set.
+  struct PendingRequest {
+    RequestKind kind = RequestKind::ChassisControl;
+    uint8_t argument = 0;
+    ChassisControlCompletion done;
+    DeviceIdCompletion device_id_done;
+    CloseSessionCompletion close_done;
+    CustomRequest *custom = nullptr;
+  };
+
+  // A request sent within the session and not yet answered. Slots are indexed
+  // by the request's rqSeq; a response matches only if its network function
+  // and command match too.
+  struct InFlight {
+    bool used = false;
+    RequestKind kind;
+    NetworkFunction netFn;
+    uint8_t command;
+    double sent_at;
+    double deadline;
+    uint8_t retries;
+    PendingRequest pending;
+  };
+
   ClientState state = ClientState::Initial;
-  std::list<ChassisControlCommand> requestQueue{};
-  struct mbuf buffer;
+  RingQueue<PendingRequest, REQUEST_QUEUE_SIZE> requestQueue;
+
+  InFlight inFlight[RQ_SEQ_COUNT];
+  uint8_t in_flight_count = 0;
+  uint8_t next_rq_seq = 0;
+  // How many requests may be outstanding at once. BMCs process requests in
+  // order, so a small window hides the round trip without queueing much on
+  // the BMC.
+  uint8_t max_in_flight = 4;
 
   uint8_t password[16];
   uint32_t session_id;
   uint32_t sequence;
   uint32_t sequence_out;
+  // Built once the session is active, then reused for every packet.
+  AuthCode auth;
+  // Whether the BMC said it may send packets without an authcode within the
+  // session.
+  bool unauthenticated = false;
+  PacketTemplate chassisControlPacket;
   uint8_t failures = 0;
   uint8_t max_failures = 3;
 
-  mg_connection *connection;
+  // BMCs close a session after it has been idle for a while; IPMI 1.5 says 60
+  // seconds by default. An idle session gets a Get Device ID this often.
+  double keepalive_interval = 30;
+
+  // Each packet is sent up to 1 + max_retries times, each time waiting one
+  // RTO, before the request (or the session) is given up on.
+  RttEstimator rtt;
+  uint8_t max_retries = 3;
+  uint32_t requests = 0;
+  uint32_t retransmits = 0;
+  uint32_t timeouts = 0;
+
+  // The last handshake packet, kept to be sent again unchanged: RAKP
+  // messages carry fresh random numbers, so they cannot be rebuilt.
+#if IPMI_LANPLUS
+  uint8_t handshake_packet[Lanplus::MAX_PACKET_SIZE];
+#else
+  uint8_t handshake_packet[MAX_PACKET_SIZE];
+#endif
+  size_t handshake_length = 0;
+  double handshake_sent_at = 0;
+  uint8_t handshake_retries = 0;
+
+  mg_connection *connection = nullptr;
+  Transport *transport = nullptr;
+  // Without a wheel the timer is the connection's MG_EV_TIMER.
+  TimingWheel *wheel = nullptr;
+  Timer timer{&Client::timerFired, this};
+  StageObserver stage_observer;
+  // A Metrics::watchHost() index, or -1.
+  int metrics_host = -1;
+
+#if IPMI_LANPLUS
+  // Set by useLanplus(). When present, the session is opened with RAKP and
+  // every packet goes through it instead of the IPMI 1.5 authcode path.
+  std::unique_ptr<Lanplus::Session> lanplus;
+#endif
 
-  void send(ChassisControlCommand);
-  Status receiveChannelAuthenticationCapabilities(struct mbuf payload);
-  Status receiveSessionChallenge(struct mbuf payload);
-  Status receiveActivateSession(struct mbuf payload);
-  Status receiveSetSessionPrivilegeLevel(struct mbuf payload);
-  Status receiveChassisControl(struct mbuf payload);
+  Status send(PendingRequest request);
+  void transmit(const uint8_t *packet, size_t length);
+  void output(const uint8_t *packet, size_t length);
+  bool connected() const { return connection != NULL || transport != nullptr; }
+  void armTimer(double seconds);
+  void setTimer(double at);
+  void stopTimer();
+  static void timerFired(void *client);
+  void sendNext();
+  void sendGetDeviceId(uint8_t rq_seq);
+  void sendCustom(uint8_t rq_seq);
+  void sendCloseSession(uint8_t rq_seq);
+  void fail(PendingRequest &pending, bool outcome_unknown = false);
+  void sendRequest(uint8_t rq_seq);
+  bool retransmitExpired();
+  uint8_t allocate(RequestKind kind);
+  void release(uint8_t rq_seq);
+  void requeueInFlight(RingQueue<PendingRequest, RQ_SEQ_COUNT> &unknown);
+  void failUnknown(RingQueue<PendingRequest, RQ_SEQ_COUNT> &unknown);
+  void rearm();
+  void giveUp();
+  size_t encodeSetSessionPrivilege(uint8_t *out, size_t size);
+  void sendSetSessionPrivilege();
+  void sendChassisControl(ChassisControlCommand command, uint8_t rq_seq);
+  template <class C>
+  Status decodeInSession(PacketView &payload, typename C::Response &response);
+  Status receiveChannelAuthenticationCapabilities(PacketView payload);
+  Status receiveSessionChallenge(PacketView payload);
+  Status receiveActivateSession(PacketView payload);
+#if IPMI_LANPLUS
+  Status receiveOpenSession(PacketView payload);
+  Status receiveRAKP2(PacketView payload);
+  Status receiveRAKP4(PacketView payload);
+#endif
+  Status receiveSetSessionPrivilegeLevel(PacketView payload);
+  Status openMessage(PacketView &payload, uint8_t *buffer, size_t size,
+                     PacketView &message);
+  Status receiveResponse(PacketView payload);
+  Status receiveChassisControl(PacketView &message, const IPMB &ipmb,
+                               InFlight &request);
+  Status receiveGetDeviceId(PacketView &message, const IPMB &ipmb,
+                            InFlight &request);
+  Status receiveCustom(PacketView &message, const IPMB &ipmb,
+                       InFlight &request);
+  Status receiveCloseSession(PacketView &message, const IPMB &ipmb,
+                             InFlight &request);
   void begin();
+  void setState(ClientState next);
 
 public:
   Client(uint8_t password[16]) : state{ClientState::Initial} {
-    printf("Init: %d\n", (int)state);
     memcpy(this->password, password, 16);
-    mbuf_init(&buffer, 30);
   }
+  ~Client() { stopTimer(); }
 
-  ~Client() { mbuf_free(&buffer); }
   ClientState getState() { return state; }
-  void chassisControl(ChassisControlCommand command);
+  // The session ID in the header of the BMC's replies to this client, or 0
+  // while they carry none (early in the handshake).
+  uint32_t sessionId() const;
+#if IPMI_LANPLUS
+  // Talk IPMI 2.0 RMCP+ with the given cipher suite. Call before the first
+  // request.
+  void useLanplus(const Lanplus::CipherSuite &suite);
+#endif
+  // Queues `command`. Fails, without calling `done`, when REQUEST_QUEUE_SIZE
+  // requests are already queued or in flight.
+  Status chassisControl(ChassisControlCommand command,
+                        ChassisControlCompletion done = nullptr);
+  // Queues a Get Device ID, the one read every BMC answers. Fails like
+  // chassisControl().
+  Status getDeviceId(DeviceIdCompletion done = nullptr);
+  // Queues `request`. Fails like chassisControl(), without calling it.
+  Status request(CustomRequest &request);
+  // Queues the `size` bytes of `data` as a request for `command`, copying
+  // them, and delivers the response to `done`. At most CUSTOM_REQUEST_SIZE
+  // bytes. Fails like chassisControl().
+  Status request(NetworkFunction netFn, uint8_t command, const uint8_t *data,
+                 size_t size, CustomCompletion done = nullptr);
+  // Queues a Close Session, behind whatever is queued already, so that the
+  // BMC can free the session rather than hold it until it times out. Once
+  // it is answered the client is back to Initial, and requests queued after
+  // it open a new session. Fails, without calling `done`, when no session is
+  // open or opening.
+  Status closeSession(CloseSessionCompletion done = nullptr);
+#if IPMI_FUTURES
+  // Like the callback forms, with the result delivered through a future. The
+  // client is not thread safe: call these on the event loop thread, and wait
+  // on the future from another, never from the one polling.
+  std::future<ChassisControlResult>
+  chassisControlFuture(ChassisControlCommand command);
+  std::future<DeviceIdResult> getDeviceIdFuture();
+  std::future<CustomResult> requestFuture(NetworkFunction netFn,
+                                          uint8_t command,
+                                          const uint8_t *data, size_t size);
+#endif
+  // `co_await client.awaitChassisControl(command)` suspends the coroutine
+  // until the result is in; it resumes on the event loop. Defined only when
+  // built with coroutine support.
+  Awaiter<ChassisControlResult>
+  awaitChassisControl(ChassisControlCommand command);
+  Awaiter<DeviceIdResult> awaitDeviceId();
+  Awaiter<CustomResult> awaitRequest(NetworkFunction netFn, uint8_t command,
+                                     const uint8_t *data, size_t size);
   void receivePacket(struct mbuf buf);
+  // Called on the connection's MG_EV_TIMER, or by the timing wheel.
+  void timerExpired();
+  // Schedule timers on `wheel` instead of the connection. Many clients can
+  // share one wheel; call before the first request.
+  void setTimingWheel(TimingWheel *wheel) { this->wheel = wheel; }
+  void setKeepaliveInterval(double seconds) { keepalive_interval = seconds; }
+  void setStageObserver(StageObserver observer) {
+    stage_observer = std::move(observer);
+  }
+  // Also record this client's round trips under the host that
+  // Metrics::watchHost() returned `index` for; -1 stops.
+  void setMetricsHost(int index) { metrics_host = index; }
+  void setMaxRetries(uint8_t count) { max_retries = count; }
+  ClientStatistics statistics() const;
+  // 1 sends one request at a time. A client holds at most
+  // REQUEST_QUEUE_SIZE requests, queued and in flight together, so larger
+  // counts are clamped to that.
+  void setMaxInFlight(uint8_t count) {
+    if (count == 0) {
+      count = 1;
+    } else if (count > REQUEST_QUEUE_SIZE) {
+      count = REQUEST_QUEUE_SIZE;
+    }
+    max_in_flight = count;
+  }
 
   void setConnection(mg_connection *);
+  // Send through `transport` instead of a connection, or stop sending if it
+  // is null. Timers then need a timing wheel.
+  void setTransport(Transport *transport);
+  // Called on MG_EV_CLOSE, so that nothing is sent on a freed connection.
+  void connectionClosed(mg_connection *);
 };
+
+#if IPMI_COROUTINES
+// Defined here rather than in client.cpp, which builds as C++11. The awaiter
+// lives in the suspended coroutine's frame, so the completion can write the
+// result into it.
+template <class R> class Awaiter {
+  std::function<Status(Completion<R>)> start;
+  R result;
+
+public:
+  // `start` queues the request with the completion it is given. A request
+  // it cannot queue gives `refused` without suspending.
+  Awaiter(std::function<Status(Completion<R>)> start, const R &refused)
+      : start(std::move(start)), result(refused) {}
+
+  bool await_ready() const noexcept { return false; }
+
+  bool await_suspend(std::coroutine_handle<> waiting) {
+    return start([this, waiting](const R &done) {
+             result = done;
+             waiting.resume();
+           }) == Status::Success;
+  }
+
+  R await_resume() const { return result; }
+};
+
+inline Awaiter<ChassisControlResult>
+Client::awaitChassisControl(ChassisControlCommand command) {
+  ChassisControlResult refused;
+  refused.command = command;
+  return Awaiter<ChassisControlResult>(
+      [this, command](ChassisControlCompletion done) {
+        return chassisControl(command, std::move(done));
+      },
+      refused);
+}
+
+inline Awaiter<DeviceIdResult> Client::awaitDeviceId() {
+  return Awaiter<DeviceIdResult>(
+      [this](DeviceIdCompletion done) { return getDeviceId(std::move(done)); },
+      DeviceIdResult());
+}
+
+inline Awaiter<CustomResult> Client::awaitRequest(NetworkFunction netFn,
+                                                  uint8_t command,
+                                                  const uint8_t *data,
+                                                  size_t size) {
+  // Queued when the coroutine suspends, so keep a copy of the data.
+  std::vector<uint8_t> bytes(data, data + size);
+  return Awaiter<CustomResult>(
+      [this, netFn, command, bytes](CustomCompletion done) {
+        return request(netFn, command, bytes.data(), bytes.size(),
+                       std::move(done));
+      },
+      CustomResult());
+}
+#endif
 }; // namespace IPMI
\ No newline at end of file
@@ -0,0 +1,144 @@
+/*
+    Copyright Jordan Sissel, 2018
+    This file is part of jordansissel/ipmi.
+
+    jordansissel/ipmi is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    jordansissel/ipmi is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with jordansissel/ipmi.  If not, see <http://www.gnu.org/licenses/>.
+  */
+#include "client_manager.h"
+#include "ipmi_mongoose.h"
+#include "metrics.h"
+
+namespace IPMI {
+void ClientManager::add(const char *host, uint8_t password[16]) {
+  std::unique_ptr<Host> entry(new Host());
+  entry->address = host;
+  entry->client.reset(new Client(password));
+  entry->client->setTimingWheel(&wheel);
+  entry->client->setMetricsHost(Metrics::hostIndex(host));
+#if IPMI_LANPLUS
+  if (lanplus) {
+    entry->client->useLanplus(suite);
+  }
+#endif
+  hosts.push_back(std::move(entry));
+}
+
+void ClientManager::chassisControl(ChassisControlCommand command,
+                                   Report report) {
+  this->command = command;
+  this->report = report;
+  next = 0;
+  active = 0;
+  succeeded = 0;
+  failed = 0;
+  startNext();
+}
+
+void ClientManager::poll(int milliseconds) {
+  const int next = wheel.millisecondsUntilNext();
+  if (next >= 0 && next < milliseconds) {
+    milliseconds = next;
+  }
+  mg_mgr_poll(mgr, milliseconds);
+  // The wakeup has normally drained the queue already; this catches
+  // submissions on a platform without a socket pair.
+  submissions.drain();
+  wheel.advance(mg_time());
+}
+
+// Connects hosts until max_active are in progress or none are left. Hosts
+// that fail straight away are finished here rather than by a nested call, so
+// a run of unreachable hosts doesn't deepen the stack.
+void ClientManager::startNext() {
+  while (active < max_active && next < hosts.size()) {
+    Host &host = *hosts[next++];
+    if (connect(host) == Status::Failure) {
+      finish(host, Status::Failure);
+      continue;
+    }
+
+    Host *target = &host;
+    const Status queued = host.client->chassisControl(
+        command, [this, target](const ChassisControlResult &result) {
+          close(*target, result.status);
+        });
+    if (queued == Status::Failure) {
+      finish(host, Status::Failure);
+      continue;
+    }
+    active++;
+  }
+}
+
+Status ClientManager::connect(Host &host) {
+  std::string address = "udp://" + host.address;
+  // Add the IPMI port unless one is given. IPv6 addresses need brackets.
+  const size_t colon = host.address.rfind(':');
+  if (colon == std::string::npos || host.address.back() == ']') {
+    address += ":623";
+  }
+
+#if CS_PLATFORM == CS_P_UNIX || CS_PLATFORM == CS_P_WINDOWS
+  struct mg_connect_opts opts = {};
+  opts.user_data = host.client.get();
+  host.connection = mg_connect_opt(mgr, address.c_str(),
+                                   ipmi_client_connection_handler, opts);
+#else
+  // Mongoose OS has a different mg_connect and mg_connect_opt signature
+  host.connection = mg_connect(mgr, address.c_str(),
+                               ipmi_client_connection_handler,
+                               host.client.get());
+#endif
+  insist_return(host.connection != NULL, Status::Failure,
+                "Failed to connect to %s", address.c_str());
+  host.client->setConnection(host.connection);
+  return Status::Success;
+}
+
+// BMCs have only a few session slots, so free this one now rather than leave
+// it to the BMC's inactivity timeout. A host whose close fails is counted as
+// failed, since its slot stays taken.
+void ClientManager::close(Host &host, Status status) {
+  Host *target = &host;
+  const Status queued = host.client->closeSession(
+      [this, target, status](const CloseSessionResult &closed) {
+        active--;
+        finish(*target, closed.status == Status::Success ? status
+                                                         : Status::Failure);
+        startNext();
+      });
+  if (queued == Status::Failure) {
+    // No session was opened, or it has been lost already.
+    active--;
+    finish(host, status);
+    startNext();
+  }
+}
+
+void ClientManager::finish(Host &host, Status status) {
+  if (host.connection != NULL) {
+    host.connection->flags |= MG_F_SEND_AND_CLOSE;
+    host.connection = NULL;
+  }
+
+  if (status == Status::Success) {
+    succeeded++;
+  } else {
+    failed++;
+  }
+  if (report) {
+    report(host.address.c_str(), status);
+  }
+}
+}; // namespace IPMI
@@ -0,0 +1,109 @@
+/*
+    Copyright Jordan Sissel, 2018
+    This file is part of jordansissel/ipmi.
+
+    jordansissel/ipmi is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    jordansissel/ipmi is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with jordansissel/ipmi.  If not, see <http://www.gnu.org/licenses/>.
+  */
+#pragma once
+#include "client.h"
+#include "submission_queue.h"
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace IPMI {
+// Runs one Client per BMC on a shared mg_mgr. A run sends the same command to
+// every host, with at most max_active of them connected at a time, and
+// reports each host as it finishes.
+//
+// Each active host holds one UDP socket, so keep max_active well below the
+// process's file descriptor limit (and below FD_SETSIZE where mongoose uses
+// select()).
+class ClientManager {
+public:
+  // Called once per host and run, with the host as passed to add().
+  typedef std::function<void(const char *host, Status)> Report;
+
+private:
+  struct Host {
+    std::string address;
+    std::unique_ptr<Client> client;
+    mg_connection *connection = nullptr;
+  };
+
+  struct mg_mgr *mgr;
+  // Declared before hosts, whose clients cancel their timers on destruction.
+  TimingWheel wheel;
+  SubmissionQueue submissions;
+  // Hosts are held by pointer so completions can refer to them while the
+  // vector grows.
+  std::vector<std::unique_ptr<Host>> hosts;
+  size_t max_active = 256;
+#if IPMI_LANPLUS
+  bool lanplus = false;
+  Lanplus::CipherSuite suite;
+#endif
+
+  ChassisControlCommand command;
+  Report report;
+  size_t next = 0;
+  size_t active = 0;
+  size_t succeeded = 0;
+  size_t failed = 0;
+
+  void startNext();
+  Status connect(Host &host);
+  void close(Host &host, Status status);
+  void finish(Host &host, Status status);
+
+public:
+  ClientManager(struct mg_mgr *mgr)
+      : mgr(mgr), wheel(mg_time()), submissions(mgr) {}
+
+  // `host` is an address, optionally with a port; the port defaults to 623.
+  // If Metrics::watchHost(host) was called first, its latencies are labelled
+  // with it on /metrics.
+  void add(const char *host, uint8_t password[16]);
+  size_t size() const { return hosts.size(); }
+  // The client for the index'th host added, for its statistics().
+  const Client &client(size_t index) const { return *hosts[index]->client; }
+
+  void setMaxActive(size_t count) { max_active = count == 0 ? 1 : count; }
+#if IPMI_LANPLUS
+  // Open RMCP+ sessions with the given suite on hosts added after this call.
+  void useLanplus(const Lanplus::CipherSuite &suite) {
+    lanplus = true;
+    this->suite = suite;
+  }
+#endif
+
+  // Starts sending `command` to every host. Call poll() until done() before
+  // starting another run.
+  void chassisControl(ChassisControlCommand command, Report report = nullptr);
+  // Thread safe. Runs `task` on the thread calling poll(), which wakes at
+  // once. This is how other threads start runs, or reach the clients, without
+  // locking. Fails when the submission queue is full.
+  Status submit(SubmissionQueue::Task task) {
+    return submissions.submit(std::move(task));
+  }
+  // Polls the mg_mgr for at most `milliseconds`, waking early for the next
+  // client timer or a submission, then runs the timers that are due. The
+  // clients' timers all live on one wheel, so this costs the same for ten
+  // hosts or ten thousand.
+  void poll(int milliseconds);
+  bool done() const { return succeeded + failed == hosts.size(); }
+  size_t succeededCount() const { return succeeded; }
+  size_t failedCount() const { return failed; }
+};
+}; // namespace IPMI
@@ -17,515 +17,917 @@
   */
 #include "ipmi.h"
 #include "insist.h"
+#include "metrics.h"
 #include "mongoose.h"
 #include <stdint.h>
 
 namespace IPMI {
-void RMCP::write(struct mbuf &out) const {
-  mbuf_append(&out, &version, 1);
-  mbuf_append(&out, &reserved, 1);
-  mbuf_append(&out, &sequence, 1);
-  mbuf_append(&out, &message_class, 1);
+uint8_t sum(const uint8_t *bytes, size_t length) {
+  // Add eight bytes at a time as four 16-bit lanes of byte pairs. Each lane
+  // grows by at most 2 * 255 per word, so fold the lanes together before 128
+  // words could carry one lane into the next.
+  const uint64_t low_bytes = 0x00ff00ff00ff00ffULL;
+  uint32_t total = 0;
+  while (length >= 8) {
+    uint64_t lanes = 0;
+    for (size_t words = 0; words < 128 && length >= 8; words++) {
+      uint64_t word;
+      memcpy(&word, bytes, 8);
+      lanes += (word & low_bytes) + ((word >> 8) & low_bytes);
+      bytes += 8;
+      length -= 8;
+    }
+    total += (uint32_t)((lanes & 0xffff) + ((lanes >> 16) & 0xffff) +
+                        ((lanes >> 32) & 0xffff) + (lanes >> 48));
+  }
+
+  while (length > 0) {
+    total += *bytes++;
+    length--;
+  }
+  return (uint8_t)total;
+}
+
+bool messageCommand(const uint8_t *packet, size_t length, uint8_t &command) {
+  if (length < RMCP_SIZE + 1 || (packet[RMCP_SIZE] != AUTH_TYPE_NONE &&
+                                 packet[RMCP_SIZE] != AUTH_TYPE_MD5)) {
+    return false;
+  }
+  // Auth type, sequence, session ID, authcode if any, message length.
+  const size_t header =
+      1 + 4 + 4 + (packet[RMCP_SIZE] == AUTH_TYPE_NONE ? 0 : 16) + 1;
+  const size_t offset = RMCP_SIZE + header + 5;
+  if (length <= offset) {
+    return false;
+  }
+  command = packet[offset];
+  return true;
+}
+
+static const uint8_t NO_PASSWORD[16] = {};
+
+AuthCode::AuthCode() : AuthCode(NO_PASSWORD, 0) {}
+
+AuthCode::AuthCode(const uint8_t password[16], uint32_t session_id)
+    : session_id(session_id) {
+  memcpy(this->password, password, 16);
+  cs_md5_init(&prefix);
+  cs_md5_update(&prefix, password, 16);
+  cs_md5_update(&prefix, (const uint8_t *)&session_id, 4);
+}
+
+void AuthCode::compute(uint32_t session_id, uint32_t sequence,
+                       const uint8_t *data, size_t length,
+                       uint8_t out[16]) const {
+  cs_md5_ctx md5;
+  if (session_id == this->session_id) {
+    md5 = prefix;
+  } else {
+    cs_md5_init(&md5);
+    cs_md5_update(&md5, password, 16);
+    cs_md5_update(&md5, (const uint8_t *)&session_id, 4);
+  }
+  cs_md5_update(&md5, data, length);
+  cs_md5_update(&md5, (const uint8_t *)&sequence, 4);
+  cs_md5_update(&md5, password, 16);
+  cs_md5_final(out, &md5);
+}
+
+bool AuthCode::verify(uint32_t session_id, uint32_t sequence,
+                      const uint8_t *data, size_t length,
+                      const uint8_t code[16]) const {
+  uint8_t expected[16];
+  compute(session_id, sequence, data, length, expected);
+
+  // Compare every byte so the time taken does not depend on where the first
+  // mismatch is.
+  uint8_t difference = 0;
+  for (size_t i = 0; i < 16; i++) {
+    difference |= expected[i] ^ code[i];
+  }
+  return difference == 0;
+}
+
+void RMCP::write(PacketWriter &out) const {
+  out.put(version);
+  out.put(reserved);
+  out.put(sequence);
+  out.put(message_class);
 }
 
-Status RMCP::read(struct mbuf &in) {
-  insist_return(in.len >= 4, Status::Failure,
+Status RMCP::read(PacketView &in) {
+  insist_return(in.remaining() >= 4, Status::Failure,
                 "Need at least 4 bytes for RMCP header, but have %zd bytes.",
-                in.len);
+                in.remaining());
 
-  version = in.buf[0];
-  reserved = in.buf[1];
-  sequence = in.buf[2];
-  message_class = in.buf[3];
-  mbuf_remove(&in, 4);
+  version = in[0];
+  reserved = in[1];
+  sequence = in[2];
+  message_class = in[3];
+  in.skip(4);
 
   return Status::Success;
 }
 
-void Session::write(struct mbuf &out) const {
-  mbuf_append(&out, &auth_type, 1);
-  mbuf_append(&out, &sequence, 4);
-  mbuf_append(&out, &id, 4);
+void Session::write(PacketWriter &out) const {
+  out.put(auth_type);
+  out.put(&sequence, 4);
+  out.put(&id, 4);
 
   // Per spec, the authcode is only sent if auth_type != 0.
   if (auth_type != 0x00) {
-    mbuf_append(&out, auth_code, 16);
+    out.put(auth_code, 16);
   }
 
-  mbuf_append(&out, &length, 1);
+  out.put(length);
 }
 
-Status Session::read(struct mbuf &in) {
-  insist_return(in.len >= 10, Status::Failure,
+Status Session::read(PacketView &in) {
+  insist_return(in.remaining() >= 10, Status::Failure,
                 "Need at least 10 bytes for Session header, but have %zd bytes",
-                in.len);
-  auth_type = in.buf[0];
+                in.remaining());
+  auth_type = in[0];
 
-  memcpy(&sequence, in.buf + 1, 4);
-  memcpy(&id, in.buf + 5, 4);
+  memcpy(&sequence, in.peek() + 1, 4);
+  memcpy(&id, in.peek() + 5, 4);
 
   if (auth_type > 0) {
     insist_return(
-        in.len >= 26, Status::Failure,
+        in.remaining() >= 26, Status::Failure,
         "Need at least 26 bytes for Session header when auth_type>0, but "
         "have %zd bytes",
-        in.len);
-    memcpy(&auth_code, in.buf + 9, 16);
-    length = in.buf[9 + 16];
-    mbuf_remove(&in, 26);
+        in.remaining());
+    memcpy(&auth_code, in.peek() + 9, 16);
+    length = in[9 + 16];
+    in.skip(26);
   } else {
     memset(&auth_code, 0, 16);
-    length = in.buf[9];
-    mbuf_remove(&in, 10);
+    length = in[9];
+    in.skip(10);
   }
 
   // printf("[%s] length %zd\n", auth_type > 0 ? "auth" : "none", length);
   return Status::Success;
 }
 
-void IPMB::write(struct mbuf &out) const {
-  mbuf_append(&out, &target, 1);
+Status Session::verify(const PacketView &message, const AuthCode &auth,
+                       bool unauthenticated) const {
+  if (auth_type == 0x00 && unauthenticated) {
+    return Status::Success;
+  }
+
+  insist_return(auth_type == AUTH_TYPE_MD5, Status::Failure,
+                "Packet has auth type %d, but the session uses MD5",
+                auth_type);
+  insist_return(message.remaining() >= length, Status::Failure,
+                "Session header claims %d bytes of payload, but only %zd "
+                "bytes remain",
+                length, message.remaining());
+  insist_return(
+      auth.verify(id, sequence, message.peek(), length, auth_code),
+      Status::Failure, "Authcode mismatch on receiving packet");
+  return Status::Success;
+}
+
+void IPMB::write(PacketWriter &out) const {
+  out.put(target);
   uint8_t scratch = (netFn << 2) | targetLun;
-  mbuf_append(&out, &scratch, 1);
+  out.put(scratch);
 
   // Compute checksum
-  uint8_t checksum = -(target + scratch);
-  mbuf_append(&out, &checksum, 1);
+  out.put((uint8_t)-(target + scratch));
 
-  mbuf_append(&out, &source, 1);
+  out.put(source);
   scratch = (sequence << 2) | sourceLun;
-  mbuf_append(&out, &scratch, 1);
-  mbuf_append(&out, &command, 1);
+  out.put(scratch);
+  out.put(command);
 }
 
-Status IPMB::read(struct mbuf &in) {
-  insist_return(in.len >= 7, Status::Failure,
+Status IPMB::read(PacketView &in) {
+  insist_return(in.remaining() >= 7, Status::Failure,
                 "Need at least 7 bytes for IPMB header, but have %zd bytes",
-                in.len);
-
-  target = in.buf[0];
-  netFn = in.buf[1] >> 2;
-  targetLun = in.buf[1] & 3;
-  checksum = in.buf[2];
-
-  source = in.buf[3];
-  sequence = in.buf[4] >> 2;
-  sourceLun = in.buf[4] & 3;
-  command = in.buf[5];
-  mbuf_remove(&in, 6);
+                in.remaining());
+
+  // Both checksums are checked here, in the same pass that parses the
+  // message: the header checksum covers bytes 0-2, and the trailing checksum
+  // covers everything from the requester address to the end of the packet.
+  const bool header_valid = sum(in.peek(), 3) == 0;
+  const bool message_valid = sum(in.peek() + 3, in.remaining() - 3) == 0;
+  if (!header_valid || !message_valid) {
+    Metrics::count(Counter::ChecksumFailures);
+  }
+  insist_return(header_valid, Status::Failure,
+                "IPMB header checksum failed on receiving packet");
+  insist_return(message_valid, Status::Failure,
+                "Checksum failed on receiving packet");
+
+  target = in[0];
+  netFn = in[1] >> 2;
+  targetLun = in[1] & 3;
+  checksum = in[2];
+
+  source = in[3];
+  sequence = in[4] >> 2;
+  sourceLun = in[4] & 3;
+  command = in[5];
+  in.skip(6);
   return Status::Success;
 }
 
+IPMB IPMB::response() const {
+  IPMB response;
+  response.target = source;
+  response.targetLun = sourceLun;
+  response.netFn = netFn + 1;
+  response.checksum = -(source + (response.netFn << 2) + sourceLun);
+  response.source = target;
+  response.sourceLun = targetLun;
+  response.sequence = sequence;
+  response.command = command;
+  return response;
+}
+
 namespace GetChannelAuthenticationCapabilities {
 
-void Request::write(struct mbuf &out) const {
-  mbuf_append(&out, &channel, 1);
-  mbuf_append(&out, &privileges, 1);
+void Request::write(PacketWriter &out) const {
+  out.put(channel);
+  out.put(privileges);
 }
 
-Status Request::read(struct mbuf &in) {
+Status Request::read(PacketView &in) {
   insist_return(
-      in.len >= 2, Status::Failure,
+      in.remaining() >= 2, Status::Failure,
       "Need at least 2 bytes for GetChannelAuthenticationCapabities Request "
       "header, but have %zd bytes",
-      in.len);
+      in.remaining());
 
-  channel = in.buf[0];
-  privileges = in.buf[1];
+  channel = in[0];
+  privileges = in[1];
 
-  mbuf_remove(&in, 2);
+  in.skip(2);
   return Status::Success;
 }
 
-void Response::write(struct mbuf &out) const {
-  insist(false, "Not implemented.");
+void Response::write(PacketWriter &out) const {
+  out.put(completion_code);
+  out.put(channel);
+  out.put(auth_type1);
+  out.put(auth_type2);
+  out.put(extended_capabilities);
+  out.put(oem1);
+  out.put(oem2);
+  out.put(oem3);
+  out.put(oem_aux);
 }
 
-Status Response::read(struct mbuf &in) {
+Status Response::read(PacketView &in) {
   insist_return(
-      in.len >= 9, Status::Failure,
+      in.remaining() >= 9, Status::Failure,
       "Need at least 9 bytes for GetChannelAuthenticationCapabities Request "
       "header, but have %zd bytes",
-      in.len);
-
-  completion_code = in.buf[0];
-  channel = in.buf[1];
-  auth_type1 = in.buf[2];
-  auth_type2 = in.buf[3];
-  reserved = in.buf[4];
-  oem1 = in.buf[5];
-  oem2 = in.buf[6];
-  oem3 = in.buf[7];
-  oem_aux = in.buf[8];
-
+      in.remaining());
+
+  completion_code = in[0];
+  channel = in[1];
+  auth_type1 = in[2];
+  auth_type2 = in[3];
+  extended_capabilities = in[4];
+  oem1 = in[5];
+  oem2 = in[6];
+  oem3 = in[7];
+  oem_aux = in[8];
+
+  // Which authentication types are usable is up to the caller: IPMI 1.5
+  // sessions need MD5 and lanplus sessions need IPMI 2.0.
   insist_return(completion_code == 0, Status::Failure,
                 "GetChannelAuthenticationRequest failed");
-  insist_return(hasMD5(), Status::Failure,
-                "MD5 is not supported by the remote IPMI "
-                "device, but is required by this "
-                "implementation.");
-  mbuf_remove(&in, 9);
+  in.skip(9);
   return Status::Success;
 }
 
 }; // namespace GetChannelAuthenticationCapabilities
 
 namespace GetSessionChallenge {
-void Request::write(struct mbuf &out) const {
-  mbuf_append(&out, &auth_type, 1);
-  mbuf_append(&out, &user, 16);
+void Request::write(PacketWriter &out) const {
+  out.put(auth_type);
+  out.put(&user, 16);
 }
 
-Status Request::read(struct mbuf &in) {
+Status Request::read(PacketView &in) {
   insist_return(
-      in.len >= 17, Status::Failure,
+      in.remaining() >= 17, Status::Failure,
       "Need at least 17 bytes for SessionChallenge request, but have %zd "
       "bytes.",
-      in.len);
+      in.remaining());
 
-  auth_type = in.buf[0];
-  memcpy(user, in.buf + 1, 16);
-  mbuf_remove(&in, 17);
+  auth_type = in[0];
+  memcpy(user, in.peek() + 1, 16);
+  in.skip(17);
   return Status::Success;
 }
 
-void Response::write(struct mbuf &out) const {
-  mbuf_append(&out, &session_id, 4);
-  mbuf_append(&out, challenge, 16);
+void Response::write(PacketWriter &out) const {
+  out.put(completion_code);
+  out.put(&session_id, 4);
+  out.put(&challenge, 16);
 }
 
-Status Response::read(struct mbuf &in) {
+Status Response::read(PacketView &in) {
   insist_return(
-      in.len >= 21, Status::Failure,
+      in.remaining() >= 21, Status::Failure,
       "Need at least 21 bytes for SessionChallenge response, but have %zd "
       "bytes.",
-      in.len);
+      in.remaining());
 
-  uint8_t completion_code = in.buf[0];
+  completion_code = in[0];
   insist_return(completion_code == 0, Status::Failure,
                 "GetChannelAuthenticationRequest failed");
 
-  memcpy(&session_id, in.buf + 1, 4);
+  memcpy(&session_id, in.peek() + 1, 4);
 
-  memcpy(&challenge, in.buf + 5, 16);
-  printf("Challenge: ");
-  mg_hexdumpf(stdout, challenge, 16);
+  memcpy(&challenge, in.peek() + 5, 16);
 
-  mbuf_remove(&in, 21);
+  in.skip(21);
   return Status::Success;
 }
 } // namespace GetSessionChallenge
 
 namespace ActivateSession {
-Status Request::read(struct mbuf &in) { insist(false, "Not implemented"); }
+Status Request::read(PacketView &in) {
+  insist_return(
+      in.remaining() >= 22, Status::Failure,
+      "Need at least 22 bytes for ActivateSession request, but have %zd.",
+      in.remaining());
+  auth_type = in[0];
+  privilege = in[1];
+  memcpy(challenge, in.peek() + 2, 16);
+  memcpy(&sequence, in.peek() + 18, 4);
+  in.skip(22);
+  return Status::Success;
+}
 
-void Request::write(struct mbuf &out) const {
-  mbuf_append(&out, &auth_type, 1);
-  mbuf_append(&out, &privilege, 1);
-  mbuf_append(&out, &challenge, 16);
-  mbuf_append(&out, &sequence, 4);
+void Request::write(PacketWriter &out) const {
+  out.put(auth_type);
+  out.put(privilege);
+  out.put(&challenge, 16);
+  out.put(&sequence, 4);
 }
 
-Status Response::read(struct mbuf &in) {
-  uint8_t completion_code = in.buf[0];
+Status Response::read(PacketView &in) {
+  insist_return(
+      in.remaining() >= 11, Status::Failure,
+      "Need at least 11 bytes for ActivateSession response, but have %zd.",
+      in.remaining());
+  completion_code = in[0];
   insist_return(completion_code == 0, Status::Failure,
                 "ActivateSession request failed");
 
-  auth_type = in.buf[1];
+  auth_type = in[1];
 
-  memcpy(&session, in.buf + 2, 4);
+  memcpy(&session, in.peek() + 2, 4);
 
-  memcpy(&sequence, in.buf + 6, 4);
-  // mg_hexdumpf(stdout, in.buf + 6, 4);
+  memcpy(&sequence, in.peek() + 6, 4);
+  // mg_hexdumpf(stdout, in.peek() + 6, 4);
 
-  privilege = in.buf[10];
-  mbuf_remove(&in, 11);
+  privilege = in[10];
+  in.skip(11);
   return Status::Success;
 }
 
-void Response::write(struct mbuf &out) const {}
+void Response::write(PacketWriter &out) const {
+  out.put(completion_code);
+  out.put(auth_type);
+  out.put(&session, 4);
+  out.put(&sequence, 4);
+  out.put(privilege);
+}
 
 } // namespace ActivateSession
 
 namespace SetSessionPrivilege {
-Status Request::read(struct mbuf &in) { insist(false, "Not implemented"); }
-void Request::write(struct mbuf &out) const {
-  mbuf_append(&out, &privilege, 1);
+Status Request::read(PacketView &in) {
+  insist_return(
+      in.remaining() >= 1, Status::Failure,
+      "Need at least 1 byte for SetSessionPrivilege request, but have %zd.",
+      in.remaining());
+  privilege = in[0];
+  in.skip(1);
+  return Status::Success;
 }
-Status Response::read(struct mbuf &in) {
+void Request::write(PacketWriter &out) const {
+  out.put(privilege);
+}
+Status Response::read(PacketView &in) {
   insist_return(
-      in.len >= 2, Status::Failure,
+      in.remaining() >= 2, Status::Failure,
       "Need at least 2 bytes for SetSessionPrivilege response, but have %zd.",
-      in.len);
-  uint8_t completion_code = in.buf[0];
+      in.remaining());
+  completion_code = in[0];
   insist_return(completion_code == 0, Status::Failure,
                 "SetSessionPrivilege request failed");
 
-  privilege = in.buf[1];
-  mbuf_remove(&in, 2);
+  privilege = in[1];
+  in.skip(2);
   return Status::Success;
 }
-void Response::write(struct mbuf &out) const {}
+void Response::write(PacketWriter &out) const {
+  out.put(completion_code);
+  out.put(privilege);
+}
 } // namespace SetSessionPrivilege
 
 namespace ChassisControl {
-Status Request::read(struct mbuf &in) { insist(false, "Not implemented"); }
-void Request::write(struct mbuf &out) const { mbuf_append(&out, &command, 1); }
-Status Response::read(struct mbuf &in) {
+Status Request::read(PacketView &in) {
+  insist_return(
+      in.remaining() >= 1, Status::Failure,
+      "Need at least 1 byte for ChassisControl request, but have %zd.",
+      in.remaining());
+  command = in[0];
+  in.skip(1);
+  return Status::Success;
+}
+void Request::write(PacketWriter &out) const { out.put(command); }
+Status Response::read(PacketView &in) {
   insist_return(
-      in.len >= 1, Status::Failure,
+      in.remaining() >= 1, Status::Failure,
       "Need at least 1 bytes for ChassisControl response, but have %zd.",
-      in.len);
-  uint8_t completion_code = in.buf[0];
-  insist_return(completion_code == 0, Status::Failure,
-                "ChassisControl request failed");
-  mbuf_remove(&in, 1);
+      in.remaining());
+  // Reported rather than rejected: the caller decides what a refusal means.
+  completion_code = in[0];
+  in.skip(1);
   return Status::Success;
 }
-void Response::write(struct mbuf &out) const {}
+void Response::write(PacketWriter &out) const { out.put(completion_code); }
 } // namespace ChassisControl
 
-void getChannelAuthenticationCapabilities(struct mbuf &buf) {
-  RMCP rmcp = {};
-  IPMB ipmb = {NetworkFunction::AppRequest, 0x01, 0x38};
-  GetChannelAuthenticationCapabilities::Request request = {};
-  Session session = {0x00, 0x00000000, 0x00000000, request.length()};
-
-  rmcp.write(buf);
-  session.write(buf);
-  ipmb.write(buf);
-  request.write(buf);
-
-  // compute trailing checksum
-  uint8_t checksum = 0;
-  for (size_t i = 17; i < buf.len; i++) {
-    checksum += buf.buf[i];
+namespace GetDeviceId {
+Status Request::read(PacketView &in) { return Status::Success; }
+void Request::write(PacketWriter &out) const {}
+
+Status Response::read(PacketView &in) {
+  insist_return(
+      in.remaining() >= 1, Status::Failure,
+      "Need at least 1 byte for GetDeviceId response, but have %zd.",
+      in.remaining());
+  completion_code = in[0];
+  insist_return(completion_code == 0, Status::Failure,
+                "GetDeviceId request failed");
+  insist_return(
+      in.remaining() >= DATA_SIZE, Status::Failure,
+      "Need at least %d bytes for GetDeviceId response, but have %zd.",
+      DATA_SIZE, in.remaining());
+
+  device_id = in[1];
+  device_revision = in[2];
+  firmware_major = in[3];
+  firmware_minor = in[4];
+  ipmi_version = in[5];
+  additional_support = in[6];
+  memcpy(manufacturer_id, in.peek() + 7, 3);
+  memcpy(product_id, in.peek() + 10, 2);
+  in.skip(DATA_SIZE);
+
+  // Skip the auxiliary firmware revision, if present, but not the checksum.
+  if (in.remaining() == 4 + CHECKSUM_SIZE) {
+    in.skip(4);
   }
-  checksum = -checksum;
-  mbuf_append(&buf, &checksum, 1);
+  return Status::Success;
 }
 
-Status decode(struct mbuf &buf, RMCP &rmcp, IPMB &ipmb, Session &session,
-              GetChannelAuthenticationCapabilities::Response &response) {
+void Response::write(PacketWriter &out) const {
+  out.put(completion_code);
+  out.put(device_id);
+  out.put(device_revision);
+  out.put(firmware_major);
+  out.put(firmware_minor);
+  out.put(ipmi_version);
+  out.put(additional_support);
+  out.put(manufacturer_id, 3);
+  out.put(product_id, 2);
+}
+} // namespace GetDeviceId
 
-  // Sum of all bytes 17..end should equal 0 (checksum is negative of sum)
-  uint8_t value = 0;
-  for (size_t i = 17; i < buf.len; i++) {
-    value += (uint8_t)buf.buf[i];
-  }
-  insist_return(value == 0, Status::Failure,
-                "Checksum failed on receiving packet");
+namespace CloseSession {
+Status Request::read(PacketView &in) {
+  insist_return(
+      in.remaining() >= DATA_SIZE, Status::Failure,
+      "Need at least %d bytes for CloseSession request, but have %zd.",
+      DATA_SIZE, in.remaining());
+  memcpy(&session_id, in.peek(), 4);
+  in.skip(DATA_SIZE);
+  return Status::Success;
+}
+void Request::write(PacketWriter &out) const { out.put(&session_id, 4); }
+Status Response::read(PacketView &in) {
+  insist_return(
+      in.remaining() >= 1, Status::Failure,
+      "Need at least 1 byte for CloseSession response, but have %zd.",
+      in.remaining());
+  // Reported rather than rejected, like ChassisControl.
+  completion_code = in[0];
+  in.skip(1);
+  return Status::Success;
+}
+void Response::write(PacketWriter &out) const { out.put(completion_code); }
+} // namespace CloseSession
+
+namespace GetSdrRepositoryInfo {
+void Response::write(PacketWriter &out) const {
+  out.put(completion_code);
+  out.put(version);
+  out.put(&record_count, 2);
+  out.put(&free_space, 2);
+  out.put(&last_addition, 4);
+  out.put(&last_erase, 4);
+  out.put(operations);
+}
 
-  rmcp.read(buf);
-  session.read(buf);
+Status Response::read(PacketView &in) {
+  insist_return(
+      in.remaining() >= 1, Status::Failure,
+      "Need at least 1 byte for GetSdrRepositoryInfo response, but have %zd.",
+      in.remaining());
+  completion_code = in[0];
+  insist_return(completion_code == 0, Status::Failure,
+                "GetSdrRepositoryInfo request failed");
+  insist_return(
+      in.remaining() >= DATA_SIZE, Status::Failure,
+      "Need at least %d bytes for GetSdrRepositoryInfo response, but have "
+      "%zd.",
+      DATA_SIZE, in.remaining());
+
+  version = in[1];
+  memcpy(&record_count, in.peek() + 2, 2);
+  memcpy(&free_space, in.peek() + 4, 2);
+  memcpy(&last_addition, in.peek() + 6, 4);
+  memcpy(&last_erase, in.peek() + 10, 4);
+  operations = in[14];
+  in.skip(DATA_SIZE);
+  return Status::Success;
+}
+} // namespace GetSdrRepositoryInfo
 
-  ipmb.read(buf);
-  printf("Command: %02x\n", ipmb.command);
-  response.read(buf);
+namespace ReserveSdrRepository {
+void Response::write(PacketWriter &out) const {
+  out.put(completion_code);
+  out.put(&reservation, 2);
+}
 
-  mbuf_remove(&buf, 1); // remove last byte (the checksum)
+Status Response::read(PacketView &in) {
+  insist_return(
+      in.remaining() >= 1, Status::Failure,
+      "Need at least 1 byte for ReserveSdrRepository response, but have %zd.",
+      in.remaining());
+  completion_code = in[0];
+  insist_return(completion_code == 0, Status::Failure,
+                "ReserveSdrRepository request failed");
+  insist_return(
+      in.remaining() >= DATA_SIZE, Status::Failure,
+      "Need at least %d bytes for ReserveSdrRepository response, but have "
+      "%zd.",
+      DATA_SIZE, in.remaining());
+
+  memcpy(&reservation, in.peek() + 1, 2);
+  in.skip(DATA_SIZE);
   return Status::Success;
 }
+} // namespace ReserveSdrRepository
+
+namespace GetSdr {
+void Request::write(PacketWriter &out) const {
+  out.put(&reservation, 2);
+  out.put(&record, 2);
+  out.put(offset);
+  out.put(count);
+}
 
-void getSessionChallenge(struct mbuf &buf) {
-  RMCP rmcp = {};
-  IPMB ipmb = {NetworkFunction::AppRequest, 0x01, 0x39 /* SessionChallenge */};
-  GetSessionChallenge::Request request = {};
-  Session session = {0x00, 0x00000000, 0x00000000, request.length()};
-
-  rmcp.write(buf);
-  session.write(buf);
-  ipmb.write(buf);
-  request.write(buf);
-
-  // compute trailing checksum
-  uint8_t checksum = 0;
-  for (size_t i = 17; i < buf.len; i++) {
-    checksum += buf.buf[i];
+Status Request::read(PacketView &in) {
+  insist_return(in.remaining() >= 6, Status::Failure,
+                "Need at least 6 bytes for GetSdr request, but have %zd.",
+                in.remaining());
+  memcpy(&reservation, in.peek(), 2);
+  memcpy(&record, in.peek() + 2, 2);
+  offset = in[4];
+  count = in[5];
+  in.skip(6);
+  return Status::Success;
+}
+
+void Response::write(PacketWriter &out) const {
+  out.put(completion_code);
+  if (completion_code == 0) {
+    out.put(&next_record, 2);
+    out.put(data, size);
   }
-  checksum = -checksum;
-  mbuf_append(&buf, &checksum, 1);
 }
 
-Status decode(struct mbuf &buf, RMCP &rmcp, IPMB &ipmb, Session &session,
-              GetSessionChallenge::Response &response) {
-  // Sum of all bytes 17..end should equal 0 (checksum is negative of sum)
-  uint8_t value = 0;
-  for (size_t i = 17; i < buf.len; i++) {
-    value += (uint8_t)buf.buf[i];
+// The record data runs up to the trailing checksum.
+Status Response::read(PacketView &in) {
+  insist_return(
+      in.remaining() >= 1 + CHECKSUM_SIZE, Status::Failure,
+      "Need at least 2 bytes for GetSdr response, but have %zd.",
+      in.remaining());
+  completion_code = in[0];
+  size = 0;
+  if (completion_code != 0) {
+    in.skip(in.remaining() - CHECKSUM_SIZE);
+    return Status::Success;
   }
-  insist_return(value == 0, Status::Failure,
-                "Checksum failed on receiving packet");
+  insist_return(
+      in.remaining() >= 3 + CHECKSUM_SIZE, Status::Failure,
+      "Need at least 4 bytes for GetSdr response, but have %zd.",
+      in.remaining());
+  const size_t available = in.remaining() - 3 - CHECKSUM_SIZE;
+  insist_return(available <= MAX_READ, Status::Failure,
+                "GetSdr response carries %zd bytes, more than the %d asked "
+                "for at most",
+                available, MAX_READ);
+
+  memcpy(&next_record, in.peek() + 1, 2);
+  size = available;
+  memcpy(data, in.peek() + 3, size);
+  in.skip(3 + size);
+  return Status::Success;
+}
+} // namespace GetSdr
 
-  rmcp.read(buf);
-  session.read(buf);
+// Compile-time twin of sum(), for checking the prebuilt packets below.
+constexpr uint8_t staticSum(const uint8_t *bytes, size_t length) {
+  return length == 0 ? 0
+                     : (uint8_t)(bytes[0] + staticSum(bytes + 1, length - 1));
+}
 
-  ipmb.read(buf);
-  printf("Command: %02x\n", ipmb.command);
-  response.read(buf);
+// Get Channel Authentication Capabilities and Get Session Challenge are sent
+// before there is a session, so their bytes never change. They are kept here
+// fully built, checksums included, and copied out as-is.
+static constexpr uint8_t channelAuthenticationCapabilitiesPacket[] = {
+    0x06, 0x00, 0xff, 0x07, /* RMCP */
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, /* Session, no auth */
+    0x09,                   /* payload length */
+    0x20, 0x06 << 2, 0xc8,  /* BMC, App request, header checksum */
+    0x81, 0x01 << 2, 0x38,  /* remote console, rqSeq 1, command */
+    0x0e,                   /* Use current channel */
+    0x04,                   /* Request Administrator privileges */
+    0x31,                   /* checksum */
+};
+static_assert(staticSum(channelAuthenticationCapabilitiesPacket + 14, 3) == 0,
+              "IPMB header checksum");
+static_assert(
+    staticSum(channelAuthenticationCapabilitiesPacket + 17,
+              sizeof(channelAuthenticationCapabilitiesPacket) - 17) == 0,
+    "IPMB trailing checksum");
+
+static constexpr uint8_t sessionChallengePacket[] = {
+    0x06, 0x00, 0xff, 0x07, /* RMCP */
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, /* Session, no auth */
+    0x18,                   /* payload length */
+    0x20, 0x06 << 2, 0xc8,  /* BMC, App request, header checksum */
+    0x81, 0x01 << 2, 0x39,  /* remote console, rqSeq 1, command */
+    0x02,                   /* MD5 */
+    'r',  'o',  'o',  't',  0x00, 0x00, 0x00, 0x00, /* user name */
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x7c, /* checksum */
+};
+static_assert(staticSum(sessionChallengePacket + 14, 3) == 0,
+              "IPMB header checksum");
+static_assert(staticSum(sessionChallengePacket + 17,
+                        sizeof(sessionChallengePacket) - 17) == 0,
+              "IPMB trailing checksum");
+
+// The prebuilt packets must match what encode<>() would produce.
+static_assert(sizeof(channelAuthenticationCapabilitiesPacket) ==
+                  RMCP_SIZE + SESSION_SIZE +
+                      GetChannelAuthenticationCapabilities::Request::length(),
+              "Get Channel Authentication Capabilities packet length");
+static_assert(sizeof(sessionChallengePacket) ==
+                  RMCP_SIZE + SESSION_SIZE +
+                      GetSessionChallenge::Request::length(),
+              "Get Session Challenge packet length");
+static_assert(RMCP_SIZE + SESSION_SIZE + AUTHCODE_SIZE +
+                      ActivateSession::Request::length() <=
+                  MAX_PACKET_SIZE,
+              "MAX_PACKET_SIZE is too small for Activate Session");
+
+void authenticate(uint8_t *packet, size_t length, const AuthCode &auth,
+                  uint32_t session_id, uint32_t sequence) {
+  const size_t offset = RMCP_SIZE + SESSION_SIZE + AUTHCODE_SIZE;
+
+  // The authcode sits between the session id and the payload length byte.
+  auth.compute(session_id, sequence, packet + offset, length - offset,
+               packet + offset - (AUTHCODE_SIZE + 1));
+}
 
-  mbuf_remove(&buf, 1); // remove last byte (the checksum)
-  return Status::Success;
+size_t getChannelAuthenticationCapabilities(uint8_t *out, size_t size) {
+  const size_t length = sizeof(channelAuthenticationCapabilitiesPacket);
+  if (length > size) {
+    return 0;
+  }
+  memcpy(out, channelAuthenticationCapabilitiesPacket, length);
+  return length;
 }
 
-void activateSession(struct mbuf &buf, uint8_t password[16], uint32_t sequence,
-                     uint32_t session_id, uint8_t challenge[16]) {
-  RMCP rmcp = {};
-  IPMB ipmb = {NetworkFunction::AppRequest, 0x01, 0x3A /* Activate Session */};
-  const ActivateSession::Request request(sequence, challenge);
-  Session session = {0x02, 0x00000000, session_id, request.length()};
-
-  rmcp.write(buf);
-  session.write(buf);
-  size_t offset = buf.len;
-  ipmb.write(buf);
-  request.write(buf);
-
-  // compute trailing checksum
-  uint8_t checksum = 0;
-  for (size_t i = 17 + 16; i < buf.len; i++) {
-    checksum += buf.buf[i];
+void getChannelAuthenticationCapabilities(struct mbuf &buf) {
+  mbuf_append(&buf, channelAuthenticationCapabilitiesPacket,
+              sizeof(channelAuthenticationCapabilitiesPacket));
+}
+
+Status decode(PacketView &packet, RMCP &rmcp, IPMB &ipmb, Session &session,
+              GetChannelAuthenticationCapabilities::Response &response) {
+  return decode<GetChannelAuthenticationCapabilities::Command>(
+      packet, rmcp, ipmb, session, response);
+}
+
+Status decode(struct mbuf &buf, RMCP &rmcp, IPMB &ipmb, Session &session,
+              GetChannelAuthenticationCapabilities::Response &response) {
+  PacketView packet(buf);
+  Status status = decode(packet, rmcp, ipmb, session, response);
+  mbuf_remove(&buf, packet.position());
+  return status;
+}
+
+size_t getSessionChallenge(uint8_t *out, size_t size) {
+  const size_t length = sizeof(sessionChallengePacket);
+  if (length > size) {
+    return 0;
   }
-  checksum = -checksum;
-  mbuf_append(&buf, &checksum, 1);
+  memcpy(out, sessionChallengePacket, length);
+  return length;
+}
 
-  // Compute auth code: MD5(password + sequence + data + password)
-  printf("Session: %08x\n", session_id);
-  printf("Sequence: %08x\n", sequence);
+void getSessionChallenge(struct mbuf &buf) {
+  mbuf_append(&buf, sessionChallengePacket, sizeof(sessionChallengePacket));
+}
 
-  uint32_t scratch = 0; // Sequence number is 0 until after this message
-  const uint8_t *msgs[] = {password, (uint8_t *)&session_id,
-                           (uint8_t *)(buf.buf + offset), (uint8_t *)&scratch,
-                           password};
-  const size_t msg_lens[] = {16, 4, buf.len - offset, 4, 16};
-  uint8_t authcode[16];
-  mg_hash_md5_v(5, msgs, msg_lens, authcode);
+Status decode(PacketView &packet, RMCP &rmcp, IPMB &ipmb, Session &session,
+              GetSessionChallenge::Response &response) {
+  return decode<GetSessionChallenge::Command>(packet, rmcp, ipmb, session,
+                                              response);
+}
 
-  printf("Auth code: ");
-  // mg_hexdumpf(stdout, authcode, 16);
-  memcpy(buf.buf + offset - (16 + 1), authcode, 16);
+Status decode(struct mbuf &buf, RMCP &rmcp, IPMB &ipmb, Session &session,
+              GetSessionChallenge::Response &response) {
+  PacketView packet(buf);
+  Status status = decode(packet, rmcp, ipmb, session, response);
+  mbuf_remove(&buf, packet.position());
+  return status;
 }
 
-Status decode(struct mbuf &buf, const uint8_t password[16], RMCP &rmcp,
+size_t activateSession(uint8_t *out, size_t size, uint8_t password[16],
+                       uint32_t sequence, uint32_t session_id,
+                       uint8_t challenge[16]) {
+  // Sequence number is 0 until after this message
+  return encode<ActivateSession::Command>(
+      out, size, session_id, 0, AuthCode(password, session_id),
+      ActivateSession::Request(sequence, challenge));
+}
+
+void activateSession(struct mbuf &buf, uint8_t password[16], uint32_t sequence,
+                     uint32_t session_id, uint8_t challenge[16]) {
+  uint8_t packet[MAX_PACKET_SIZE];
+  mbuf_append(&buf, packet,
+              activateSession(packet, sizeof(packet), password, sequence,
+                              session_id, challenge));
+}
+
+Status decode(PacketView &packet, const AuthCode &auth, RMCP &rmcp,
               IPMB &ipmb, Session &session,
               ActivateSession::Response &response) {
-  rmcp.read(buf);
-  session.read(buf);
+  return decode<ActivateSession::Command>(packet, auth, rmcp, ipmb, session,
+                                          response);
+}
 
-  // Sum of all bytes 17..end should equal 0 (checksum is negative of sum)
-  uint8_t value = 0;
-  for (size_t i = 0; i < buf.len; i++) {
-    value += (uint8_t)buf.buf[i];
-  }
-  insist(value == 0, "Checksum failed on receiving packet");
+Status decode(PacketView &packet, const uint8_t password[16], RMCP &rmcp,
+              IPMB &ipmb, Session &session,
+              ActivateSession::Response &response) {
+  return decode(packet, AuthCode(password, 0), rmcp, ipmb, session, response);
+}
 
-  ipmb.read(buf);
-  printf("Command: %02x\n", ipmb.command);
-  response.read(buf);
+Status decode(struct mbuf &buf, const uint8_t password[16], RMCP &rmcp,
+              IPMB &ipmb, Session &session,
+              ActivateSession::Response &response) {
+  PacketView packet(buf);
+  Status status = decode(packet, password, rmcp, ipmb, session, response);
+  mbuf_remove(&buf, packet.position());
+  return status;
+}
 
-  mbuf_remove(&buf, 1); // remove last byte (the checksum)
-  insist_return(
-      buf.len == 0, Status::Failure,
-      "Buffer length should be empty if decoding is correct, but has %zd bytes",
-      buf.len);
-  return Status::Success;
+size_t setSessionPrivilege(uint8_t *out, size_t size, uint32_t session_id,
+                           uint32_t sequence, uint8_t password[16],
+                           IPMI::AuthenticationCapability privilege) {
+  return encode<SetSessionPrivilege::Command>(
+      out, size, session_id, sequence, AuthCode(password, session_id),
+      SetSessionPrivilege::Request((uint8_t)privilege));
 }
 
 void setSessionPrivilege(struct mbuf &buf, uint32_t session_id,
                          uint32_t sequence, uint8_t password[16],
                          IPMI::AuthenticationCapability privilege) {
-  RMCP rmcp = {};
-  IPMB ipmb = {NetworkFunction::AppRequest, 0x01,
-               0x3B /* Set Session Privilege*/};
-  const SetSessionPrivilege::Request request((uint8_t)privilege);
-  Session session = {0x02, sequence, session_id, request.length()};
-
-  rmcp.write(buf);
-  session.write(buf);
-  size_t offset = buf.len;
-  ipmb.write(buf);
-  request.write(buf);
-
-  // compute trailing checksum
-  uint8_t checksum = 0;
-  for (size_t i = 17 + 16; i < buf.len; i++) {
-    checksum += buf.buf[i];
-  }
-  checksum = -checksum;
-  mbuf_append(&buf, &checksum, 1);
-
-  // Compute auth code: MD5(password + sequence + data + password)
-  printf("Session: %08x\n", session_id);
-  printf("Sequence: %08x\n", sequence);
-  const uint8_t *msgs[] = {password, (uint8_t *)&session_id,
-                           (uint8_t *)(buf.buf + offset), (uint8_t *)&sequence,
-                           password};
-  const size_t msg_lens[] = {16, 4, buf.len - offset, 4, 16};
-  uint8_t authcode[16];
-  mg_hash_md5_v(5, msgs, msg_lens, authcode);
-  // printf("Auth code: ");
-  // mg_hexdumpf(stdout, authcode, 16);
-  memcpy(buf.buf + offset - (16 + 1), authcode, 16);
+  uint8_t packet[MAX_PACKET_SIZE];
+  mbuf_append(&buf, packet,
+              setSessionPrivilege(packet, sizeof(packet), session_id,
+                                  sequence, password, privilege));
 }
 
-Status decode(struct mbuf &buf, const uint8_t password[16], RMCP &rmcp,
+Status decode(PacketView &packet, const AuthCode &auth, RMCP &rmcp,
               IPMB &ipmb, Session &session,
               SetSessionPrivilege::Response &response) {
-  rmcp.read(buf);
-  session.read(buf);
+  return decode<SetSessionPrivilege::Command>(packet, auth, rmcp, ipmb,
+                                              session, response);
+}
 
-  // Verify checksum
-  uint8_t value = 0;
-  for (size_t i = 0; i < buf.len; i++) {
-    value += (uint8_t)buf.buf[i];
-  }
-  insist(value == 0, "Checksum failed on receiving packet");
+Status decode(PacketView &packet, const uint8_t password[16], RMCP &rmcp,
+              IPMB &ipmb, Session &session,
+              SetSessionPrivilege::Response &response) {
+  return decode(packet, AuthCode(password, 0), rmcp, ipmb, session, response);
+}
 
-  ipmb.read(buf);
-  // printf("Command: %02x\n", ipmb.command);
-  response.read(buf);
+Status decode(struct mbuf &buf, const uint8_t password[16], RMCP &rmcp,
+              IPMB &ipmb, Session &session,
+              SetSessionPrivilege::Response &response) {
+  PacketView packet(buf);
+  Status status = decode(packet, password, rmcp, ipmb, session, response);
+  mbuf_remove(&buf, packet.position());
+  return status;
+}
 
-  mbuf_remove(&buf, 1); // remove last byte (the checksum)
-  insist_return(
-      buf.len == 0, Status::Failure,
-      "Buffer length should be empty if decoding is correct, but has %zd bytes",
-      buf.len);
-  return Status::Success;
+size_t chassisControl(uint8_t *out, size_t size, uint32_t session_id,
+                      uint32_t sequence, uint8_t password[16],
+                      ChassisControlCommand command) {
+  return encode<ChassisControl::Command>(out, size, session_id, sequence,
+                                         AuthCode(password, session_id),
+                                         ChassisControl::Request(command));
 }
 
 void chassisControl(struct mbuf &buf, uint32_t session_id, uint32_t sequence,
                     uint8_t password[16], ChassisControlCommand command) {
-  RMCP rmcp = {};
-  IPMB ipmb = {NetworkFunction::ChassisRequest, 0x01,
-               0x02 /* Chassis Control */};
-  const ChassisControl::Request request(command);
-  Session session = {0x02, sequence, session_id, request.length()};
-
-  rmcp.write(buf);
-  session.write(buf);
-  size_t offset = buf.len;
-  ipmb.write(buf);
-  request.write(buf);
-
-  // compute trailing checksum
-  uint8_t checksum = 0;
-  for (size_t i = 17 + 16; i < buf.len; i++) {
-    checksum += buf.buf[i];
-  }
-  checksum = -checksum;
-  mbuf_append(&buf, &checksum, 1);
-
-  // Compute auth code: MD5(password + sequence + data + password)
-  // printf("Session: %08x\n", session_id);
-  // printf("Sequence: %08x\n", sequence);
-  const uint8_t *msgs[] = {password, (uint8_t *)&session_id,
-                           (uint8_t *)(buf.buf + offset), (uint8_t *)&sequence,
-                           password};
-  const size_t msg_lens[] = {16, 4, buf.len - offset, 4, 16};
-  uint8_t authcode[16];
-  mg_hash_md5_v(5, msgs, msg_lens, authcode);
-  // printf("Auth code: ");
-  // mg_hexdumpf(stdout, authcode, 16);
-  memcpy(buf.buf + offset - (16 + 1), authcode, 16);
-}
-} // namespace IPMI
\ No newline at end of file
+  uint8_t packet[MAX_PACKET_SIZE];
+  mbuf_append(&buf, packet,
+              chassisControl(packet, sizeof(packet), session_id, sequence,
+                             password, command));
+}
+
+Status decode(PacketView &packet, const AuthCode &auth, RMCP &rmcp,
+              IPMB &ipmb, Session &session,
+              ChassisControl::Response &response) {
+  return decode<ChassisControl::Command>(packet, auth, rmcp, ipmb, session,
+                                         response);
+}
+
+Status decode(PacketView &packet, const uint8_t password[16], RMCP &rmcp,
+              IPMB &ipmb, Session &session,
+              ChassisControl::Response &response) {
+  return decode(packet, AuthCode(password, 0), rmcp, ipmb, session, response);
+}
+
+Status decode(struct mbuf &buf, const uint8_t password[16], RMCP &rmcp,
+              IPMB &ipmb, Session &session,
+              ChassisControl::Response &response) {
+  PacketView packet(buf);
+  Status status = decode(packet, password, rmcp, ipmb, session, response);
+  mbuf_remove(&buf, packet.position());
+  return status;
+}
+// The one request data byte that differs between sends of a template.
+static const size_t TEMPLATE_DATA_OFFSET =
+    RMCP_SIZE + SESSION_SIZE + AUTHCODE_SIZE + IPMB_SIZE;
+// The IPMB rqSeq/rqLUN byte.
+static const size_t TEMPLATE_RQ_SEQ_OFFSET = TEMPLATE_DATA_OFFSET - 2;
+static_assert(SetSessionPrivilege::Request::DATA_SIZE == 1 &&
+                  ChassisControl::Request::DATA_SIZE == 1,
+              "PacketTemplate patches a single request data byte");
+
+PacketTemplate PacketTemplate::setSessionPrivilege(uint32_t session_id) {
+  PacketTemplate t;
+  t.length = encodePacket<SetSessionPrivilege::Command>(
+      t.packet, sizeof(t.packet), AUTH_TYPE_MD5, session_id, 0, DEFAULT_RQ_SEQ,
+      SetSessionPrivilege::Request(
+          (uint8_t)AuthenticationCapability::Administrator));
+  return t;
+}
+
+PacketTemplate PacketTemplate::chassisControl(uint32_t session_id) {
+  PacketTemplate t;
+  t.length = encodePacket<ChassisControl::Command>(
+      t.packet, sizeof(t.packet), AUTH_TYPE_MD5, session_id, 0, DEFAULT_RQ_SEQ,
+      ChassisControl::Request(ChassisControlCommand::PowerDown));
+  return t;
+}
+
+void PacketTemplate::patch(uint32_t sequence, uint8_t rq_seq, uint8_t data,
+                           const AuthCode &auth) {
+  memcpy(packet + RMCP_SIZE + 1, &sequence, 4);
+
+  // The trailing checksum is the negated byte sum, so it moves by the
+  // difference between the old and new bytes it covers. rqLUN stays 0.
+  const uint8_t rq_seq_byte = (uint8_t)(rq_seq << 2);
+  packet[length - 1] -=
+      (uint8_t)(data - packet[TEMPLATE_DATA_OFFSET] + rq_seq_byte -
+                packet[TEMPLATE_RQ_SEQ_OFFSET]);
+  packet[TEMPLATE_DATA_OFFSET] = data;
+  packet[TEMPLATE_RQ_SEQ_OFFSET] = rq_seq_byte;
+
+  uint32_t session_id;
+  memcpy(&session_id, packet + RMCP_SIZE + 5, 4);
+  authenticate(packet, length, auth, session_id, sequence);
+}
+} // namespace IPMI
@@ -16,6 +16,7 @@
     along with jordansissel/ipmi.  If not, see <http://www.gnu.org/licenses/>.
   */
 #pragma once
+#include "insist.h"
 #include "mongoose.h" // for struct mbuf
 #include <stdint.h>
 
@@ -60,18 +61,104 @@ enum class ChassisControlCommand {
   SoftShutdown = 5
 };
 
-class Serializable {
+// Sums `length` bytes modulo 256, a word at a time. IPMB checksums are the
+// negation of this sum, so a region that ends in its checksum sums to zero.
+uint8_t sum(const uint8_t *bytes, size_t length);
+
+// A read-only cursor over a received datagram. Decoders walk it forward with
+// an offset instead of removing bytes from the front of an mbuf, so decoding
+// a packet never copies or modifies the underlying bytes.
+class PacketView {
+  const uint8_t *data;
+  size_t size;
+  size_t offset;
+
 public:
-  virtual void write(struct mbuf &out) const = 0;
-  virtual Status read(struct mbuf &out) = 0;
+  PacketView(const uint8_t *data, size_t size)
+      : data(data), size(size), offset(0) {}
+  PacketView(const struct mbuf &buf)
+      : data((const uint8_t *)buf.buf), size(buf.len), offset(0) {}
+
+  // Bytes left to decode.
+  size_t remaining() const { return size - offset; }
+  // Bytes decoded so far.
+  size_t position() const { return offset; }
+  const uint8_t *peek() const { return data + offset; }
+  uint8_t operator[](size_t i) const { return data[offset + i]; }
+  void skip(size_t n) { offset += n; }
 };
 
-class Command : public Serializable {
+// A write cursor over a caller-provided buffer. Encoders know the final
+// packet length before they start, so they check it once against the buffer
+// size and then write headers, payload and checksums straight into place.
+class PacketWriter {
+  uint8_t *data;
+  size_t size;
+  size_t offset;
+
 public:
-  virtual uint8_t length() const = 0;
+  PacketWriter(uint8_t *data, size_t size)
+      : data(data), size(size), offset(0) {}
+
+  // Bytes left in the buffer.
+  size_t remaining() const { return size - offset; }
+  // Bytes written so far.
+  size_t position() const { return offset; }
+  void put(uint8_t value) { data[offset++] = value; }
+  void put(const void *value, size_t length) {
+    memcpy(data + offset, value, length);
+    offset += length;
+  }
 };
 
-class RMCP : public Serializable {
+const uint8_t RMCP_SIZE = 4;
+const uint8_t SESSION_SIZE = 10;
+const uint8_t AUTHCODE_SIZE = 16;
+const uint8_t IPMB_SIZE = 6;
+const uint8_t CHECKSUM_SIZE = 1;
+
+const uint8_t AUTH_TYPE_NONE = 0x00;
+const uint8_t AUTH_TYPE_MD5 = 0x02;
+
+// The IPMB command of an IPMI 1.5 packet, request or response: both have it
+// sixth. Returns false for anything else, RMCP+ packets included.
+bool messageCommand(const uint8_t *packet, size_t length, uint8_t &command);
+
+// Large enough for any packet built by this library. The biggest is
+// ActivateSession: 4 (rmcp) + 26 (session) + 29 (ipmb + request + checksum);
+// ipmi.cpp checks this at compile time.
+const size_t MAX_PACKET_SIZE = 64;
+// Large enough for any IPMI 1.5 packet received. Replies can outgrow
+// anything built here, a Get SDR response most of all, but the session
+// header gives the message length in one byte.
+const size_t MAX_RESPONSE_SIZE =
+    RMCP_SIZE + SESSION_SIZE + AUTHCODE_SIZE + 0xff;
+
+// Computes and checks session authcodes:
+//   MD5(password + session id + data + sequence + password)
+// The password and session id prefix is the same for every packet in a
+// session, so it is fed to MD5 once and the resulting context is copied for
+// each packet.
+class AuthCode {
+  uint8_t password[16];
+  uint32_t session_id;
+  cs_md5_ctx prefix;
+
+public:
+  AuthCode();
+  AuthCode(const uint8_t password[16], uint32_t session_id);
+
+  uint32_t session() const { return session_id; }
+
+  // A session id other than session() works too, but without the cached
+  // prefix.
+  void compute(uint32_t session_id, uint32_t sequence, const uint8_t *data,
+               size_t length, uint8_t out[16]) const;
+  bool verify(uint32_t session_id, uint32_t sequence, const uint8_t *data,
+              size_t length, const uint8_t code[16]) const;
+};
+
+class RMCP {
   uint8_t version;       /* Per spec: 0x06, RMCP / ASF 2.0 */
   uint8_t reserved;      /* reserved by spec */
   uint8_t sequence;      /* rmcp sequence number */
@@ -81,11 +168,11 @@ public:
   RMCP()
       : version(RMCP_VERSION_1_0), reserved(0x00), sequence(0xff),
         message_class(0x07) {}
-  void write(struct mbuf &out) const;
-  Status read(struct mbuf &in);
+  void write(PacketWriter &out) const;
+  Status read(PacketView &in);
 };
 
-class Session : public Serializable {
+class Session {
   uint8_t auth_type;
   uint32_t sequence;
   uint32_t id;
@@ -96,13 +183,34 @@ public:
   Session(){};
   Session(uint8_t auth_type, uint32_t sequence, uint32_t id, uint8_t length)
       : auth_type(auth_type), sequence(sequence), id(id), length(length) {}
-  void write(struct mbuf &out) const;
-  Status read(struct mbuf &in);
+  // Size of this header on the wire. The authcode is only present when
+  // auth_type != 0.
+  uint8_t size() const {
+    return auth_type != 0x00 ? SESSION_SIZE + AUTHCODE_SIZE : SESSION_SIZE;
+  }
+  uint8_t getAuthType() const { return auth_type; }
+  uint32_t getSequence() const { return sequence; }
+  uint32_t getId() const { return id; }
+  uint8_t getLength() const { return length; }
+  void write(PacketWriter &out) const;
+  Status read(PacketView &in);
+
+  // Checks the authcode of a received packet against `message`, which must be
+  // positioned at the IPMB message that follows this header. Sessions only
+  // negotiate MD5, so any other auth type fails, except that packets sent
+  // without authentication pass when `unauthenticated` allows them.
+  Status verify(const PacketView &message, const AuthCode &auth,
+                bool unauthenticated = false) const;
 };
 
-const uint8_t IPMB_SIZE = 6;
-const uint8_t CHECKSUM_SIZE = 1;
-class IPMB : public Serializable {
+// The IPMB rqSeq field is 6 bits wide, so a session can tell at most this many
+// outstanding requests apart.
+constexpr uint8_t RQ_SEQ_COUNT = 64;
+// The rqSeq of requests that are never outstanding alongside another, such as
+// those of the session handshake.
+constexpr uint8_t DEFAULT_RQ_SEQ = 0x01;
+
+class IPMB {
   uint8_t target;
   uint8_t targetLun : 2;
   uint8_t netFn : 6;
@@ -119,12 +227,57 @@ public:
       : target(0x20), targetLun(0x0), netFn((uint8_t)netFn),
         checksum(-(0x20 + (uint8_t)netFn)), source(0x81), sourceLun(0x0),
         sequence(sequence), command(command) {}
-  void write(struct mbuf &out) const;
-  Status read(struct mbuf &in);
+  NetworkFunction getNetworkFunction() const { return (NetworkFunction)netFn; }
+  // Responses echo the rqSeq of their request.
+  uint8_t getSequence() const { return sequence; }
+  // The header of the response to this request: the addresses and LUNs
+  // swapped and the network function one higher.
+  IPMB response() const;
+  void write(PacketWriter &out) const;
+  Status read(PacketView &in);
+};
+
+// Compile-time description of one IPMI command: its network function, its
+// command number and the classes holding its request and response data. Each
+// command namespace below declares one as `Command`. The encode<>() and
+// decode<>() templates are instantiated from it, so field reads and writes are
+// direct calls and every length is a constant.
+//
+// Adding a command means writing its Request and Response classes, each with
+// a DATA_SIZE and read()/write(), and one typedef.
+template <NetworkFunction NetFn, uint8_t Number, class RequestType,
+          class ResponseType>
+struct CommandDescriptor {
+  typedef RequestType Request;
+  typedef ResponseType Response;
+
+  static constexpr NetworkFunction netFn = NetFn;
+  // Every response network function is the request's plus one.
+  static constexpr NetworkFunction responseNetFn =
+      (NetworkFunction)((uint8_t)NetFn + 1);
+  static constexpr uint8_t command = Number;
 };
 
+template <NetworkFunction NetFn, uint8_t Number, class RequestType,
+          class ResponseType>
+constexpr NetworkFunction
+    CommandDescriptor<NetFn, Number, RequestType, ResponseType>::netFn;
+template <NetworkFunction NetFn, uint8_t Number, class RequestType,
+          class ResponseType>
+constexpr NetworkFunction
+    CommandDescriptor<NetFn, Number, RequestType, ResponseType>::responseNetFn;
+template <NetworkFunction NetFn, uint8_t Number, class RequestType,
+          class ResponseType>
+constexpr uint8_t
+    CommandDescriptor<NetFn, Number, RequestType, ResponseType>::command;
+
+// IPMB message length for a request or response carrying `data_size` bytes.
+constexpr uint8_t messageLength(uint8_t data_size) {
+  return IPMB_SIZE + data_size + CHECKSUM_SIZE;
+}
+
 namespace GetChannelAuthenticationCapabilities {
-class Request : public Command {
+class Request {
   uint8_t channel;
   uint8_t privileges;
 
@@ -132,16 +285,21 @@ public:
   Request()
       : channel(0x0e),
         privileges((uint8_t)AuthenticationCapability::Administrator) {}
-  void write(struct mbuf &out) const;
-  Status read(struct mbuf &in);
-  uint8_t length() const { return IPMB_SIZE + 2 + CHECKSUM_SIZE; }
+  // Set bit 7 of the channel to ask for the IPMI 2.0 extended data.
+  Request(uint8_t channel)
+      : channel(channel),
+        privileges((uint8_t)AuthenticationCapability::Administrator) {}
+  static constexpr uint8_t DATA_SIZE = 2;
+  static constexpr uint8_t length() { return messageLength(DATA_SIZE); }
+  void write(PacketWriter &out) const;
+  Status read(PacketView &in);
 };
 
-class Response : public Command {
+class Response {
   uint8_t channel;
   uint8_t auth_type1;
   uint8_t auth_type2;
-  uint8_t reserved;
+  uint8_t extended_capabilities;
   uint8_t oem1;
   uint8_t oem2;
   uint8_t oem3;
@@ -150,44 +308,66 @@ class Response : public Command {
 public:
   uint8_t completion_code;
   Response() {}
+  Response(uint8_t channel, uint8_t auth_types, uint8_t extended_capabilities)
+      : channel(channel), auth_type1(auth_types), auth_type2(0),
+        extended_capabilities(extended_capabilities), oem1(0), oem2(0),
+        oem3(0), oem_aux(0), completion_code(0) {}
 
   bool hasMD5() { return auth_type1 & (1 << 2); }
+  // The BMC may leave the authcode out of packets once a session is active.
+  bool perMessageAuthDisabled() { return auth_type2 & (1 << 4); }
+  // RMCP+ (lanplus) sessions are available.
+  bool hasIPMI20() {
+    return (auth_type1 & (1 << 7)) && (extended_capabilities & (1 << 1));
+  }
 
-  void write(struct mbuf &out) const;
-  Status read(struct mbuf &in);
-  uint8_t length() const { return 9; };
+  static constexpr uint8_t DATA_SIZE = 9;
+  static constexpr uint8_t length() { return messageLength(DATA_SIZE); }
+  void write(PacketWriter &out) const;
+  Status read(PacketView &in);
 };
+
+typedef CommandDescriptor<NetworkFunction::AppRequest, 0x38, Request, Response>
+    Command;
 } // namespace GetChannelAuthenticationCapabilities
 
 namespace GetSessionChallenge {
-class Request : public Command {
+class Request {
   uint8_t auth_type;
   uint8_t user[16];
 
 public:
   Request() : auth_type(0x02 /* MD5 */), user("root\0\0\0\0\0\0\0\0\0\0\0") {}
 
-  void write(struct mbuf &out) const;
-  Status read(struct mbuf &in);
-  uint8_t length() const {
-    return 24 /* 6 (ipmb) + 17 (payload) + 1 (checksum) */;
-  }
+  uint8_t getAuthType() const { return auth_type; }
+  // The user name, NUL padded to 16 bytes.
+  const uint8_t *getUser() const { return user; }
+
+  static constexpr uint8_t DATA_SIZE = 17;
+  static constexpr uint8_t length() { return messageLength(DATA_SIZE); }
+  void write(PacketWriter &out) const;
+  Status read(PacketView &in);
 };
 
-class Response : public Command {
+class Response {
 public:
+  uint8_t completion_code = 0;
   uint32_t session_id;
   uint8_t challenge[16];
   Response() {}
 
-  void write(struct mbuf &out) const;
-  Status read(struct mbuf &in);
-  uint8_t length() const { return 20; }
+  static constexpr uint8_t DATA_SIZE = 21;
+  static constexpr uint8_t length() { return messageLength(DATA_SIZE); }
+  void write(PacketWriter &out) const;
+  Status read(PacketView &in);
 };
+
+typedef CommandDescriptor<NetworkFunction::AppRequest, 0x39, Request, Response>
+    Command;
 } // namespace GetSessionChallenge
 
 namespace ActivateSession {
-class Request : public Command {
+class Request {
   uint8_t auth_type;
   uint8_t privilege;
   uint8_t challenge[16];
@@ -201,89 +381,552 @@ public:
     memcpy(this->challenge, challenge, 16);
   }
 
-  void write(struct mbuf &out) const;
-  Status read(struct mbuf &in);
-  uint8_t length() const { return 29; }
+  uint8_t getAuthType() const { return auth_type; }
+  uint8_t getPrivilege() const { return privilege; }
+  const uint8_t *getChallenge() const { return challenge; }
+  // The sequence number the BMC starts its own session messages at.
+  uint32_t getSequence() const { return sequence; }
+
+  static constexpr uint8_t DATA_SIZE = 22;
+  static constexpr uint8_t length() { return messageLength(DATA_SIZE); }
+  void write(PacketWriter &out) const;
+  Status read(PacketView &in);
 };
-class Response : public Command {
+class Response {
   uint8_t auth_type;
   uint8_t privilege;
 
 public:
+  uint8_t completion_code = 0;
   uint32_t session;
   uint32_t sequence;
-  void write(struct mbuf &out) const;
-  Status read(struct mbuf &in);
-  uint8_t length() const { return 10; }
+  Response() {}
+  Response(uint32_t session, uint32_t sequence)
+      : auth_type(AUTH_TYPE_MD5), privilege(0x04 /* Administrator */),
+        session(session), sequence(sequence) {}
+  static constexpr uint8_t DATA_SIZE = 11;
+  static constexpr uint8_t length() { return messageLength(DATA_SIZE); }
+  void write(PacketWriter &out) const;
+  Status read(PacketView &in);
 };
 
+typedef CommandDescriptor<NetworkFunction::AppRequest, 0x3A, Request, Response>
+    Command;
 } // namespace ActivateSession
 
 namespace SetSessionPrivilege {
-class Request : public Command {
+class Request {
   uint8_t privilege;
 
 public:
   Request(){};
   Request(uint8_t privilege) : privilege(privilege) {}
 
-  void write(struct mbuf &out) const;
-  Status read(struct mbuf &in);
-  uint8_t length() const { return 8; }
+  // 0 asks for the current privilege level without changing it.
+  uint8_t getPrivilege() const { return privilege; }
+
+  static constexpr uint8_t DATA_SIZE = 1;
+  static constexpr uint8_t length() { return messageLength(DATA_SIZE); }
+  void write(PacketWriter &out) const;
+  Status read(PacketView &in);
 };
-class Response : public Command {
+class Response {
   uint8_t privilege;
 
 public:
+  uint8_t completion_code = 0;
   Response(){};
   Response(uint8_t privilege) : privilege(privilege) {}
-  void write(struct mbuf &out) const;
-  Status read(struct mbuf &in);
-  uint8_t length() const { return 8; }
+  static constexpr uint8_t DATA_SIZE = 2;
+  static constexpr uint8_t length() { return messageLength(DATA_SIZE); }
+  void write(PacketWriter &out) const;
+  Status read(PacketView &in);
 };
+
+typedef CommandDescriptor<NetworkFunction::AppRequest, 0x3B, Request, Response>
+    Command;
 } // namespace SetSessionPrivilege
 
 namespace ChassisControl {
-class Request : Command {
+class Request {
   uint8_t command;
 
 public:
   Request() {}
   Request(ChassisControlCommand command) : command((uint8_t)command) {}
-  void write(struct mbuf &out) const;
-  Status read(struct mbuf &in);
-  uint8_t length() const { return 8; }
+
+  uint8_t getCommand() const { return command; }
+  static constexpr uint8_t DATA_SIZE = 1;
+  static constexpr uint8_t length() { return messageLength(DATA_SIZE); }
+  void write(PacketWriter &out) const;
+  Status read(PacketView &in);
 };
-class Response : Command {
+class Response {
 public:
+  uint8_t completion_code;
+
   Response() {}
-  void write(struct mbuf &out) const;
-  Status read(struct mbuf &in);
-  uint8_t length() const { return 7; }
+  Response(uint8_t completion_code) : completion_code(completion_code) {}
+  static constexpr uint8_t DATA_SIZE = 1;
+  static constexpr uint8_t length() { return messageLength(DATA_SIZE); }
+  void write(PacketWriter &out) const;
+  Status read(PacketView &in);
 };
+
+typedef CommandDescriptor<NetworkFunction::ChassisRequest, 0x02, Request,
+                          Response>
+    Command;
 } // namespace ChassisControl
 
+// Cheap and always permitted, so it doubles as a session keepalive.
+namespace GetDeviceId {
+class Request {
+public:
+  Request() {}
+  static constexpr uint8_t DATA_SIZE = 0;
+  static constexpr uint8_t length() { return messageLength(DATA_SIZE); }
+  void write(PacketWriter &out) const;
+  Status read(PacketView &in);
+};
+class Response {
+public:
+  uint8_t completion_code;
+  uint8_t device_id;
+  uint8_t device_revision;
+  uint8_t firmware_major;
+  uint8_t firmware_minor;
+  uint8_t ipmi_version;
+  uint8_t additional_support;
+  uint8_t manufacturer_id[3];
+  uint8_t product_id[2];
+
+  Response() {}
+  // Without the optional 4 byte auxiliary firmware revision.
+  static constexpr uint8_t DATA_SIZE = 12;
+  static constexpr uint8_t length() { return messageLength(DATA_SIZE); }
+  void write(PacketWriter &out) const;
+  Status read(PacketView &in);
+};
+
+typedef CommandDescriptor<NetworkFunction::AppRequest, 0x01, Request, Response>
+    Command;
+} // namespace GetDeviceId
+
+// Ends a session, freeing one of the few the BMC can hold. Otherwise it
+// lingers until the BMC's inactivity timeout.
+namespace CloseSession {
+class Request {
+  uint32_t session_id;
+
+public:
+  Request() {}
+  // The BMC's ID for the session: the one in IPMI 1.5 packet headers, or the
+  // managed system session ID for RMCP+.
+  Request(uint32_t session_id) : session_id(session_id) {}
+
+  uint32_t getSessionId() const { return session_id; }
+  static constexpr uint8_t DATA_SIZE = 4;
+  static constexpr uint8_t length() { return messageLength(DATA_SIZE); }
+  void write(PacketWriter &out) const;
+  Status read(PacketView &in);
+};
+class Response {
+public:
+  uint8_t completion_code;
+
+  Response() {}
+  Response(uint8_t completion_code) : completion_code(completion_code) {}
+  static constexpr uint8_t DATA_SIZE = 1;
+  static constexpr uint8_t length() { return messageLength(DATA_SIZE); }
+  void write(PacketWriter &out) const;
+  Status read(PacketView &in);
+};
+
+typedef CommandDescriptor<NetworkFunction::AppRequest, 0x3c, Request, Response>
+    Command;
+} // namespace CloseSession
+
+// The Sensor Data Record repository, IPMI 2.0 v1.1 section 33. Records are
+// read a piece at a time with Get SDR, under a reservation that the BMC
+// cancels whenever the repository changes.
+namespace GetSdrRepositoryInfo {
+class Request {
+public:
+  Request() {}
+  static constexpr uint8_t DATA_SIZE = 0;
+  static constexpr uint8_t length() { return messageLength(DATA_SIZE); }
+  void write(PacketWriter &out) const {}
+  Status read(PacketView &in) { return Status::Success; }
+};
+class Response {
+public:
+  uint8_t completion_code = 0;
+  uint8_t version = 0x51;
+  uint16_t record_count = 0;
+  uint16_t free_space = 0;
+  // Seconds since 1970, or 0xffffffff if never.
+  uint32_t last_addition = 0;
+  uint32_t last_erase = 0;
+  uint8_t operations = 0;
+
+  Response() {}
+  static constexpr uint8_t DATA_SIZE = 15;
+  static constexpr uint8_t length() { return messageLength(DATA_SIZE); }
+  void write(PacketWriter &out) const;
+  Status read(PacketView &in);
+};
+
+typedef CommandDescriptor<NetworkFunction::StorageRequest, 0x20, Request,
+                          Response>
+    Command;
+} // namespace GetSdrRepositoryInfo
+
+namespace ReserveSdrRepository {
+class Request {
+public:
+  Request() {}
+  static constexpr uint8_t DATA_SIZE = 0;
+  static constexpr uint8_t length() { return messageLength(DATA_SIZE); }
+  void write(PacketWriter &out) const {}
+  Status read(PacketView &in) { return Status::Success; }
+};
+class Response {
+public:
+  uint8_t completion_code = 0;
+  uint16_t reservation = 0;
+
+  Response() {}
+  Response(uint16_t reservation) : reservation(reservation) {}
+  static constexpr uint8_t DATA_SIZE = 3;
+  static constexpr uint8_t length() { return messageLength(DATA_SIZE); }
+  void write(PacketWriter &out) const;
+  Status read(PacketView &in);
+};
+
+typedef CommandDescriptor<NetworkFunction::StorageRequest, 0x22, Request,
+                          Response>
+    Command;
+} // namespace ReserveSdrRepository
+
+namespace GetSdr {
+// Every record starts with this header: ID, SDR version, record type and the
+// length of what follows.
+const uint8_t HEADER_SIZE = 5;
+const uint16_t FIRST_RECORD = 0x0000;
+// The next record ID after the last record.
+const uint16_t LAST_RECORD = 0xffff;
+// The most record data asked for in one read, which is where ipmitool
+// starts too. A BMC that cannot return that much answers 0xca or 0xff, and
+// the reader asks for less.
+const uint8_t MAX_READ = 0xff;
+// The most record data an IPMI 1.5 response can carry, its message length
+// being one byte.
+const uint8_t MAX_IPMI15_READ = 0xff - messageLength(3);
+
+class Request {
+  uint16_t reservation;
+  uint16_t record;
+  uint8_t offset;
+  uint8_t count;
+
+public:
+  Request() {}
+  // `reservation` may be 0 when `offset` is 0.
+  Request(uint16_t reservation, uint16_t record, uint8_t offset,
+          uint8_t count)
+      : reservation(reservation), record(record), offset(offset),
+        count(count) {}
+
+  uint16_t getReservation() const { return reservation; }
+  uint16_t getRecord() const { return record; }
+  uint8_t getOffset() const { return offset; }
+  uint8_t getCount() const { return count; }
+
+  static constexpr uint8_t DATA_SIZE = 6;
+  static constexpr uint8_t length() { return messageLength(DATA_SIZE); }
+  void write(PacketWriter &out) const;
+  Status read(PacketView &in);
+};
+// A non-zero completion code is reported rather than rejected: 0xc5 (the
+// reservation was cancelled) and 0xca (too many bytes asked for) tell the
+// reader what to do next. Such a response carries no data.
+class Response {
+public:
+  uint8_t completion_code = 0;
+  uint16_t next_record = LAST_RECORD;
+  uint8_t size = 0;
+  uint8_t data[MAX_READ];
+
+  Response() {}
+  uint8_t length() const {
+    return messageLength(completion_code == 0 ? 3 + size : 1);
+  }
+  void write(PacketWriter &out) const;
+  Status read(PacketView &in);
+};
+
+typedef CommandDescriptor<NetworkFunction::StorageRequest, 0x23, Request,
+                          Response>
+    Command;
+} // namespace GetSdr
+
+// Fills in the authcode of an authenticated packet. The authcode covers the
+// IPMB message and uses the session id and sequence number from the session
+// header.
+void authenticate(uint8_t *packet, size_t length, const AuthCode &auth,
+                  uint32_t session_id, uint32_t sequence);
+
+// Writes a packet into `out`: RMCP header, session header, the IPMB message
+// `ipmb` carrying `data`, and the trailing checksum. Data is a Request or
+// Response class, or anything else with length() and write(). Returns the
+// packet length, or 0 if it does not fit in `size` bytes. The authcode, if
+// any, is left for authenticate().
+template <class Data>
+size_t writePacket(uint8_t *out, size_t size, uint8_t auth_type,
+                   uint32_t session_id, uint32_t sequence, const IPMB &ipmb,
+                   const Data &data) {
+  const Session session(auth_type, sequence, session_id, data.length());
+  const size_t length = RMCP_SIZE + session.size() + data.length();
+  if (length > size) {
+    return 0;
+  }
+
+  PacketWriter writer(out, size);
+  RMCP().write(writer);
+  session.write(writer);
+  const size_t offset = writer.position();
+  ipmb.write(writer);
+  data.write(writer);
+
+  // compute trailing checksum over everything after the IPMB header checksum
+  writer.put((uint8_t)-sum(out + offset + 3, writer.position() - offset - 3));
+  return writer.position();
+}
+
+// Writes a request for command C into `out`, as writePacket() does.
+template <class C>
+size_t encodePacket(uint8_t *out, size_t size, uint8_t auth_type,
+                    uint32_t session_id, uint32_t sequence, uint8_t rq_seq,
+                    const typename C::Request &request) {
+  return writePacket(out, size, auth_type, session_id, sequence,
+                     IPMB(C::netFn, rq_seq, C::command), request);
+}
+
+// Writes a request for command C outside of a session.
+template <class C>
+size_t encode(uint8_t *out, size_t size, const typename C::Request &request) {
+  return encodePacket<C>(out, size, AUTH_TYPE_NONE, 0, 0, DEFAULT_RQ_SEQ,
+                         request);
+}
+
+// Writes an MD5-authenticated request for command C with the given rqSeq.
+template <class C>
+size_t encode(uint8_t *out, size_t size, uint32_t session_id,
+              uint32_t sequence, uint8_t rq_seq, const AuthCode &auth,
+              const typename C::Request &request) {
+  const size_t length = encodePacket<C>(out, size, AUTH_TYPE_MD5, session_id,
+                                        sequence, rq_seq, request);
+  if (length != 0) {
+    authenticate(out, length, auth, session_id, sequence);
+  }
+  return length;
+}
+
+// Writes an MD5-authenticated request for command C.
+template <class C>
+size_t encode(uint8_t *out, size_t size, uint32_t session_id,
+              uint32_t sequence, const AuthCode &auth,
+              const typename C::Request &request) {
+  return encode<C>(out, size, session_id, sequence, DEFAULT_RQ_SEQ, auth,
+                   request);
+}
+
+// Writes the response to command C for the request whose IPMB header is
+// `request`, outside of a session. This and the next are the BMC's side.
+template <class C>
+size_t encodeResponse(uint8_t *out, size_t size, const IPMB &request,
+                      const typename C::Response &response) {
+  return writePacket(out, size, AUTH_TYPE_NONE, 0, 0, request.response(),
+                     response);
+}
+
+// Writes an MD5-authenticated response to command C.
+template <class C>
+size_t encodeResponse(uint8_t *out, size_t size, uint32_t session_id,
+                      uint32_t sequence, const IPMB &request,
+                      const AuthCode &auth,
+                      const typename C::Response &response) {
+  const size_t length = writePacket(out, size, AUTH_TYPE_MD5, session_id,
+                                    sequence, request.response(), response);
+  if (length != 0) {
+    authenticate(out, length, auth, session_id, sequence);
+  }
+  return length;
+}
+
+// Decodes the data of a request for command C whose IPMB header has already
+// been read into `ipmb`.
+template <class C>
+Status decodeRequest(PacketView &packet, const IPMB &ipmb,
+                     typename C::Request &request) {
+  insist_return(ipmb.getNetworkFunction() == C::netFn &&
+                    ipmb.command == C::command,
+                Status::Failure,
+                "Expected a request for command %02x, but got command %02x",
+                C::command, ipmb.command);
+  if (request.read(packet) == Status::Failure) {
+    return Status::Failure;
+  }
+
+  packet.skip(CHECKSUM_SIZE);
+  return Status::Success;
+}
+
+// Decodes the data of a response to command C whose IPMB header has already
+// been read into `ipmb`.
+template <class C>
+Status decodeResponse(PacketView &packet, const IPMB &ipmb,
+                      typename C::Response &response) {
+  insist_return(ipmb.getNetworkFunction() == C::responseNetFn &&
+                    ipmb.command == C::command,
+                Status::Failure,
+                "Expected a response to command %02x, but got command %02x",
+                C::command, ipmb.command);
+  if (response.read(packet) == Status::Failure) {
+    return Status::Failure;
+  }
+
+  packet.skip(CHECKSUM_SIZE);
+  return Status::Success;
+}
+
+// Decodes the IPMB message of a response to command C. IPMB::read checks both
+// checksums.
+template <class C>
+Status decodeMessage(PacketView &packet, IPMB &ipmb,
+                     typename C::Response &response) {
+  if (ipmb.read(packet) == Status::Failure) {
+    return Status::Failure;
+  }
+  return decodeResponse<C>(packet, ipmb, response);
+}
+
+// Decodes a response to command C sent outside of a session.
+template <class C>
+Status decode(PacketView &packet, RMCP &rmcp, IPMB &ipmb, Session &session,
+              typename C::Response &response) {
+  if (rmcp.read(packet) == Status::Failure ||
+      session.read(packet) == Status::Failure) {
+    return Status::Failure;
+  }
+  return decodeMessage<C>(packet, ipmb, response);
+}
+
+// Decodes a response to command C within a session, checking its authcode.
+template <class C>
+Status decode(PacketView &packet, const AuthCode &auth, RMCP &rmcp,
+              IPMB &ipmb, Session &session, typename C::Response &response) {
+  if (rmcp.read(packet) == Status::Failure ||
+      session.read(packet) == Status::Failure ||
+      session.verify(packet, auth) == Status::Failure ||
+      decodeMessage<C>(packet, ipmb, response) == Status::Failure) {
+    return Status::Failure;
+  }
+
+  insist_return(
+      packet.remaining() == 0, Status::Failure,
+      "Buffer length should be empty if decoding is correct, but has %zd bytes",
+      packet.remaining());
+  return Status::Success;
+}
+
+// The functions below are shorthands for the templates above.
+//
+// Each encoder has two forms. The first writes the packet into `out` without
+// allocating and returns its length, or 0 if `size` is too small; a buffer of
+// MAX_PACKET_SIZE bytes always fits. The mbuf form appends the packet to
+// `buf`, growing it at most once.
+//
+// Each decode() has two forms. The PacketView form walks the datagram in place
+// and leaves it untouched; the mbuf form is a wrapper around it that removes
+// the decoded bytes from the buffer afterwards.
+size_t getChannelAuthenticationCapabilities(uint8_t *out, size_t size);
 void getChannelAuthenticationCapabilities(struct mbuf &buf);
+Status decode(PacketView &packet, RMCP &rmcp, IPMB &ipmb, Session &session,
+              GetChannelAuthenticationCapabilities::Response &response);
 Status decode(struct mbuf &buf, RMCP &rmcp, IPMB &ipmb, Session &session,
               GetChannelAuthenticationCapabilities::Response &response);
+size_t getSessionChallenge(uint8_t *out, size_t size);
 void getSessionChallenge(struct mbuf &buf);
+Status decode(PacketView &packet, RMCP &rmcp, IPMB &ipmb, Session &session,
+              GetSessionChallenge::Response &response);
 Status decode(struct mbuf &buf, RMCP &rmcp, IPMB &ipmb, Session &session,
               GetSessionChallenge::Response &response);
 
+size_t activateSession(uint8_t *out, size_t size, uint8_t password[16],
+                       uint32_t sequence, uint32_t session_id,
+                       uint8_t challenge[16]);
 void activateSession(struct mbuf &buf, uint8_t password[16], uint32_t sequence,
                      uint32_t session_id, uint8_t challenge[16]);
+Status decode(PacketView &packet, const AuthCode &auth, RMCP &rmcp,
+              IPMB &ipmb, Session &session,
+              ActivateSession::Response &response);
+Status decode(PacketView &packet, const uint8_t password[16], RMCP &rmcp,
+              IPMB &ipmb, Session &session,
+              ActivateSession::Response &response);
 Status decode(struct mbuf &buf, const uint8_t password[16], RMCP &rmcp,
               IPMB &ipmb, Session &session,
               ActivateSession::Response &response);
 
+size_t setSessionPrivilege(uint8_t *out, size_t size, uint32_t session,
+                           uint32_t sequence, uint8_t password[16],
+                           IPMI::AuthenticationCapability privilege);
 void setSessionPrivilege(struct mbuf &buf, uint32_t session, uint32_t sequence,
                          uint8_t password[16],
                          IPMI::AuthenticationCapability privilege);
+Status decode(PacketView &packet, const AuthCode &auth, RMCP &rmcp,
+              IPMB &ipmb, Session &session,
+              SetSessionPrivilege::Response &response);
+Status decode(PacketView &packet, const uint8_t password[16], RMCP &rmcp,
+              IPMB &ipmb, Session &session,
+              SetSessionPrivilege::Response &response);
 Status decode(struct mbuf &buf, const uint8_t password[16], RMCP &rmcp,
               IPMB &ipmb, Session &session,
               SetSessionPrivilege::Response &response);
 
+size_t chassisControl(uint8_t *out, size_t size, uint32_t session,
+                      uint32_t sequence, uint8_t password[16],
+                      ChassisControlCommand command);
 void chassisControl(struct mbuf &buf, uint32_t session, uint32_t sequence,
                     uint8_t password[16], ChassisControlCommand command);
+Status decode(PacketView &packet, const AuthCode &auth, RMCP &rmcp,
+              IPMB &ipmb, Session &session,
+              ChassisControl::Response &response);
+Status decode(PacketView &packet, const uint8_t password[16], RMCP &rmcp,
+              IPMB &ipmb, Session &session,
+              ChassisControl::Response &response);
+Status decode(struct mbuf &buf, const uint8_t password[16], RMCP &rmcp,
+              IPMB &ipmb, Session &session,
+              ChassisControl::Response &response);
+
+// An authenticated request that is built once per session and then patched in
+// place for each send. Between sends only the session sequence number, the
+// rqSeq and the single request data byte change, so patching rewrites those,
+// adjusts the trailing checksum and recomputes the authcode.
+class PacketTemplate {
+  uint8_t packet[MAX_PACKET_SIZE];
+  size_t length;
+
+public:
+  PacketTemplate() : length(0) {}
+
+  static PacketTemplate setSessionPrivilege(uint32_t session_id);
+  static PacketTemplate chassisControl(uint32_t session_id);
+
+  void patch(uint32_t sequence, uint8_t rq_seq, uint8_t data,
+             const AuthCode &auth);
+  const uint8_t *data() const { return packet; }
+  size_t size() const { return length; }
+};
 
-} // namespace IPMI
\ No newline at end of file
+} // namespace IPMI
@@ -29,17 +29,18 @@ void ipmi_client_connection_handler(struct mg_connection *nc, int ev,
 #endif
   switch (ev) {
   case MG_EV_CONNECT:
-    printf("handler CONNECT(%d)\n", ev);
     client->setConnection(nc);
     break;
   case MG_EV_RECV:
-    printf("handler RECV(%d) %zd bytes\n", ev, nc->recv_mbuf.len);
     client->receivePacket(nc->recv_mbuf);
     // Remove packet from buffer after processing:
     mbuf_remove(&nc->recv_mbuf, nc->recv_mbuf.len);
     break;
-  case MG_EV_SEND:
-    printf("handler SEND(%d) %d bytes\n", ev, *(int *)ev_data);
+  case MG_EV_TIMER:
+    client->timerExpired();
+    break;
+  case MG_EV_CLOSE:
+    client->connectionClosed(nc);
     break;
   case MG_EV_POLL:
     // printf("handler POLL(%d)\n", ev);
@@ -0,0 +1,844 @@
+/*
+    Copyright Jordan Sissel, 2018
+    This file is part of jordansissel/ipmi.
+
+    jordansissel/ipmi is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    jordansissel/ipmi is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with jordansissel/ipmi.  If not, see <http://www.gnu.org/licenses/>.
+  */
+#include "lanplus.h"
+
+#if IPMI_LANPLUS
+#include "insist.h"
+#include <openssl/crypto.h>
+#include <openssl/rand.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/core_names.h>
+#include <openssl/params.h>
+#endif
+
+namespace IPMI {
+namespace Lanplus {
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+Hmac::Hmac() : mac(NULL), ctx(NULL), length(0) {}
+
+Hmac::~Hmac() {
+  EVP_MAC_CTX_free(ctx);
+  EVP_MAC_free(mac);
+}
+
+Status Hmac::init(const char *digest, const uint8_t *key, size_t key_length) {
+  if (mac == NULL) {
+    mac = EVP_MAC_fetch(NULL, "HMAC", NULL);
+    insist_return(mac != NULL, Status::Failure, "HMAC is not available");
+  }
+  if (ctx == NULL) {
+    ctx = EVP_MAC_CTX_new(mac);
+    insist_return(ctx != NULL, Status::Failure, "EVP_MAC_CTX_new() failed");
+  }
+
+  OSSL_PARAM params[] = {OSSL_PARAM_construct_utf8_string(
+                             OSSL_MAC_PARAM_DIGEST, (char *)digest, 0),
+                         OSSL_PARAM_construct_end()};
+  insist_return(EVP_MAC_init(ctx, key, key_length, params) == 1,
+                Status::Failure, "Failed to key HMAC-%s", digest);
+  length = EVP_MAC_CTX_get_mac_size(ctx);
+  return Status::Success;
+}
+
+// With no key, EVP_MAC_init() resets to the already keyed state.
+void Hmac::begin() { EVP_MAC_init(ctx, NULL, 0, NULL); }
+
+void Hmac::update(const void *data, size_t length) {
+  EVP_MAC_update(ctx, (const uint8_t *)data, length);
+}
+
+void Hmac::finish(uint8_t *out) {
+  size_t written;
+  EVP_MAC_final(ctx, out, &written, length);
+}
+#else
+Hmac::Hmac() : ctx(NULL), length(0) {}
+
+Hmac::~Hmac() { HMAC_CTX_free(ctx); }
+
+Status Hmac::init(const char *digest, const uint8_t *key, size_t key_length) {
+  const EVP_MD *md = EVP_get_digestbyname(digest);
+  insist_return(md != NULL, Status::Failure, "Unknown digest %s", digest);
+  if (ctx == NULL) {
+    ctx = HMAC_CTX_new();
+    insist_return(ctx != NULL, Status::Failure, "HMAC_CTX_new() failed");
+  }
+
+  insist_return(HMAC_Init_ex(ctx, key, (int)key_length, md, NULL) == 1,
+                Status::Failure, "Failed to key HMAC-%s", digest);
+  length = HMAC_size(ctx);
+  return Status::Success;
+}
+
+// With no key, HMAC_Init_ex() resets to the already keyed state.
+void Hmac::begin() { HMAC_Init_ex(ctx, NULL, 0, NULL, NULL); }
+
+void Hmac::update(const void *data, size_t length) {
+  HMAC_Update(ctx, (const uint8_t *)data, length);
+}
+
+void Hmac::finish(uint8_t *out) {
+  unsigned int written;
+  HMAC_Final(ctx, out, &written);
+}
+#endif
+
+AesCbc::AesCbc() : encryptor(NULL), decryptor(NULL) {}
+
+AesCbc::~AesCbc() {
+  EVP_CIPHER_CTX_free(encryptor);
+  EVP_CIPHER_CTX_free(decryptor);
+}
+
+Status AesCbc::init(const uint8_t key[16]) {
+  if (encryptor == NULL) {
+    encryptor = EVP_CIPHER_CTX_new();
+  }
+  if (decryptor == NULL) {
+    decryptor = EVP_CIPHER_CTX_new();
+  }
+  insist_return(encryptor != NULL && decryptor != NULL, Status::Failure,
+                "EVP_CIPHER_CTX_new() failed");
+
+  insist_return(
+      EVP_EncryptInit_ex(encryptor, EVP_aes_128_ecb(), NULL, key, NULL) == 1 &&
+          EVP_DecryptInit_ex(decryptor, EVP_aes_128_ecb(), NULL, key, NULL) ==
+              1,
+      Status::Failure, "Failed to key AES-128");
+  EVP_CIPHER_CTX_set_padding(encryptor, 0);
+  EVP_CIPHER_CTX_set_padding(decryptor, 0);
+  insist_return(RAND_bytes(nonce, sizeof(nonce)) == 1, Status::Failure,
+                "Failed to seed the IV nonce");
+  return Status::Success;
+}
+
+void AesCbc::nextIV(uint8_t iv[16]) {
+  uint64_t counter;
+  memcpy(&counter, nonce, sizeof(counter));
+  counter++;
+  memcpy(nonce, &counter, sizeof(counter));
+
+  int written;
+  EVP_EncryptUpdate(encryptor, iv, &written, nonce, AES_BLOCK_SIZE);
+}
+
+Status AesCbc::encrypt(const uint8_t iv[16], const uint8_t *in, size_t length,
+                       uint8_t *out) {
+  insist_return(length % AES_BLOCK_SIZE == 0, Status::Failure,
+                "%zd bytes is not a whole number of AES blocks", length);
+  const uint8_t *chain = iv;
+  for (size_t offset = 0; offset < length; offset += AES_BLOCK_SIZE) {
+    uint8_t block[AES_BLOCK_SIZE];
+    for (size_t i = 0; i < AES_BLOCK_SIZE; i++) {
+      block[i] = in[offset + i] ^ chain[i];
+    }
+    int written;
+    insist_return(EVP_EncryptUpdate(encryptor, out + offset, &written, block,
+                                    AES_BLOCK_SIZE) == 1,
+                  Status::Failure, "AES-128 encryption failed");
+    chain = out + offset;
+  }
+  return Status::Success;
+}
+
+Status AesCbc::decrypt(const uint8_t iv[16], const uint8_t *in, size_t length,
+                       uint8_t *out) {
+  insist_return(length % AES_BLOCK_SIZE == 0, Status::Failure,
+                "%zd bytes is not a whole number of AES blocks", length);
+  // Keep the previous ciphertext block, since `out` may overwrite `in`.
+  uint8_t chain[AES_BLOCK_SIZE];
+  memcpy(chain, iv, AES_BLOCK_SIZE);
+  for (size_t offset = 0; offset < length; offset += AES_BLOCK_SIZE) {
+    uint8_t cipher[AES_BLOCK_SIZE];
+    memcpy(cipher, in + offset, AES_BLOCK_SIZE);
+    int written;
+    insist_return(EVP_DecryptUpdate(decryptor, out + offset, &written, cipher,
+                                    AES_BLOCK_SIZE) == 1,
+                  Status::Failure, "AES-128 decryption failed");
+    for (size_t i = 0; i < AES_BLOCK_SIZE; i++) {
+      out[offset + i] ^= chain[i];
+    }
+    memcpy(chain, cipher, AES_BLOCK_SIZE);
+  }
+  return Status::Success;
+}
+
+void SessionHeader::write(PacketWriter &out) const {
+  out.put(auth_type);
+  out.put(payload_type);
+  out.put(&id, 4);
+  out.put(&sequence, 4);
+  out.put(&length, 2);
+}
+
+Status SessionHeader::read(PacketView &in) {
+  insist_return(
+      in.remaining() >= SESSION_SIZE, Status::Failure,
+      "Need at least %d bytes for RMCP+ session header, but have %zd bytes",
+      SESSION_SIZE, in.remaining());
+  auth_type = in[0];
+  insist_return(auth_type == AUTH_TYPE_RMCP_PLUS, Status::Failure,
+                "Expected an RMCP+ packet, but auth type is %02x", auth_type);
+
+  payload_type = in[1];
+  memcpy(&id, in.peek() + 2, 4);
+  memcpy(&sequence, in.peek() + 6, 4);
+  memcpy(&length, in.peek() + 10, 2);
+  in.skip(SESSION_SIZE);
+  return Status::Success;
+}
+
+// Each algorithm in Open Session is an 8 byte record: payload type,
+// reserved, length (always 8), the algorithm number and reserved again.
+static void writeAlgorithm(PacketWriter &out, uint8_t type, uint8_t algorithm) {
+  const uint8_t record[8] = {type, 0x00, 0x00, 0x08, algorithm, 0x00, 0x00,
+                             0x00};
+  out.put(record, sizeof(record));
+}
+
+static void writeSuite(PacketWriter &out, const CipherSuite &suite) {
+  writeAlgorithm(out, 0x00, (uint8_t)suite.authentication);
+  writeAlgorithm(out, 0x01, (uint8_t)suite.integrity);
+  writeAlgorithm(out, 0x02, (uint8_t)suite.confidentiality);
+}
+
+static Status readSuite(const PacketView &in, size_t offset,
+                        CipherSuite &suite) {
+  for (uint8_t type = 0; type < 3; type++) {
+    const size_t record = offset + 8 * type;
+    insist_return(in[record] == type && in[record + 3] == 0x08,
+                  Status::Failure, "Malformed algorithm record of type %d",
+                  type);
+  }
+  suite.authentication = (AuthenticationAlgorithm)(in[offset + 4] & 0x3f);
+  suite.integrity = (IntegrityAlgorithm)(in[offset + 12] & 0x3f);
+  suite.confidentiality = (ConfidentialityAlgorithm)(in[offset + 20] & 0x3f);
+  return Status::Success;
+}
+
+namespace OpenSession {
+void Request::write(PacketWriter &out) const {
+  out.put(tag);
+  out.put(privilege);
+  out.put(0x00);
+  out.put(0x00);
+  out.put(&console_id, 4);
+  writeSuite(out, suite);
+}
+
+Status Request::read(PacketView &in) {
+  insist_return(
+      in.remaining() >= DATA_SIZE, Status::Failure,
+      "Need at least %d bytes for Open Session request, but have %zd bytes",
+      DATA_SIZE, in.remaining());
+  tag = in[0];
+  privilege = in[1];
+  memcpy(&console_id, in.peek() + 4, 4);
+  if (readSuite(in, 8, suite) == Status::Failure) {
+    return Status::Failure;
+  }
+  in.skip(DATA_SIZE);
+  return Status::Success;
+}
+
+void Response::write(PacketWriter &out) const {
+  out.put(tag);
+  out.put(status_code);
+  out.put(privilege);
+  out.put(0x00);
+  out.put(&console_id, 4);
+  out.put(&bmc_id, 4);
+  writeSuite(out, suite);
+}
+
+Status Response::read(PacketView &in) {
+  // A BMC rejecting the request may stop after the console session id.
+  insist_return(
+      in.remaining() >= 8, Status::Failure,
+      "Need at least 8 bytes for Open Session response, but have %zd bytes",
+      in.remaining());
+  tag = in[0];
+  status_code = in[1];
+  insist_return(status_code == 0, Status::Failure,
+                "Open Session request failed with status %02x", status_code);
+
+  insist_return(
+      in.remaining() >= DATA_SIZE, Status::Failure,
+      "Need at least %d bytes for Open Session response, but have %zd bytes",
+      DATA_SIZE, in.remaining());
+  privilege = in[2];
+  memcpy(&console_id, in.peek() + 4, 4);
+  memcpy(&bmc_id, in.peek() + 8, 4);
+  if (readSuite(in, 12, suite) == Status::Failure) {
+    return Status::Failure;
+  }
+  in.skip(DATA_SIZE);
+  return Status::Success;
+}
+} // namespace OpenSession
+
+namespace RAKP {
+void Message1::write(PacketWriter &out) const {
+  out.put(tag);
+  out.put(0x00);
+  out.put(0x00);
+  out.put(0x00);
+  out.put(&bmc_id, 4);
+  out.put(console_random, 16);
+  out.put(role);
+  out.put(0x00);
+  out.put(0x00);
+  out.put(username_length);
+  out.put(username, username_length);
+}
+
+Status Message1::read(PacketView &in) {
+  insist_return(in.remaining() >= HEADER_SIZE, Status::Failure,
+                "Need at least %d bytes for RAKP 1, but have %zd bytes",
+                HEADER_SIZE, in.remaining());
+  tag = in[0];
+  memcpy(&bmc_id, in.peek() + 4, 4);
+  memcpy(console_random, in.peek() + 8, 16);
+  role = in[24];
+  username_length = in[27];
+  insist_return(username_length <= sizeof(username) &&
+                    in.remaining() >= size(),
+                Status::Failure, "Bad user name length %d in RAKP 1",
+                username_length);
+  memcpy(username, in.peek() + HEADER_SIZE, username_length);
+  in.skip(size());
+  return Status::Success;
+}
+
+void Message2::write(PacketWriter &out) const {
+  out.put(tag);
+  out.put(status_code);
+  out.put(0x00);
+  out.put(0x00);
+  out.put(&console_id, 4);
+  out.put(bmc_random, 16);
+  out.put(bmc_guid, 16);
+  out.put(authcode, authcode_length);
+}
+
+Status Message2::read(PacketView &in) {
+  insist_return(in.remaining() >= 8, Status::Failure,
+                "Need at least 8 bytes for RAKP 2, but have %zd bytes",
+                in.remaining());
+  tag = in[0];
+  status_code = in[1];
+  insist_return(status_code == 0, Status::Failure,
+                "RAKP 2 failed with status %02x", status_code);
+  memcpy(&console_id, in.peek() + 4, 4);
+
+  insist_return(in.remaining() >= HEADER_SIZE &&
+                    in.remaining() - HEADER_SIZE <= MAX_AUTHCODE_SIZE,
+                Status::Failure, "Bad RAKP 2 length %zd", in.remaining());
+  memcpy(bmc_random, in.peek() + 8, 16);
+  memcpy(bmc_guid, in.peek() + 24, 16);
+  authcode_length = in.remaining() - HEADER_SIZE;
+  memcpy(authcode, in.peek() + HEADER_SIZE, authcode_length);
+  in.skip(size());
+  return Status::Success;
+}
+
+void Message3::write(PacketWriter &out) const {
+  out.put(tag);
+  out.put(status_code);
+  out.put(0x00);
+  out.put(0x00);
+  out.put(&bmc_id, 4);
+  out.put(authcode, authcode_length);
+}
+
+Status Message3::read(PacketView &in) {
+  insist_return(in.remaining() >= HEADER_SIZE &&
+                    in.remaining() - HEADER_SIZE <= MAX_AUTHCODE_SIZE,
+                Status::Failure, "Bad RAKP 3 length %zd", in.remaining());
+  tag = in[0];
+  status_code = in[1];
+  memcpy(&bmc_id, in.peek() + 4, 4);
+  authcode_length = in.remaining() - HEADER_SIZE;
+  memcpy(authcode, in.peek() + HEADER_SIZE, authcode_length);
+  in.skip(size());
+  return Status::Success;
+}
+
+void Message4::write(PacketWriter &out) const {
+  out.put(tag);
+  out.put(status_code);
+  out.put(0x00);
+  out.put(0x00);
+  out.put(&console_id, 4);
+  out.put(integrity_check, integrity_check_length);
+}
+
+Status Message4::read(PacketView &in) {
+  insist_return(in.remaining() >= 8, Status::Failure,
+                "Need at least 8 bytes for RAKP 4, but have %zd bytes",
+                in.remaining());
+  tag = in[0];
+  status_code = in[1];
+  insist_return(status_code == 0, Status::Failure,
+                "RAKP 4 failed with status %02x", status_code);
+
+  insist_return(in.remaining() - HEADER_SIZE <= MAX_AUTHCODE_SIZE,
+                Status::Failure, "Bad RAKP 4 length %zd", in.remaining());
+  memcpy(&console_id, in.peek() + 4, 4);
+  integrity_check_length = in.remaining() - HEADER_SIZE;
+  memcpy(integrity_check, in.peek() + HEADER_SIZE, integrity_check_length);
+  in.skip(size());
+  return Status::Success;
+}
+} // namespace RAKP
+
+// Requested maximum privilege: Administrator, looked up by name only.
+static const uint8_t RAKP_ROLE =
+    0x10 | (uint8_t)AuthenticationCapability::Administrator;
+// The handshake messages carry a tag so responses can be matched to
+// requests. Only one handshake is in flight per session.
+static const uint8_t MESSAGE_TAG = 0x00;
+// Follows the integrity pad in every authenticated packet.
+static const uint8_t NEXT_HEADER = 0x07;
+
+Session::Session(const uint8_t *password, size_t password_length,
+                 const char *username, CipherSuite suite)
+    : suite(suite), role(RAKP_ROLE), console_id(0), bmc_id(0), sequence(0),
+      active(false) {
+  memset(user_key, 0, sizeof(user_key));
+  memcpy(user_key, password,
+         password_length < sizeof(user_key) ? password_length
+                                            : sizeof(user_key));
+  username_length = strnlen(username, sizeof(this->username));
+  memset(this->username, 0, sizeof(this->username));
+  memcpy(this->username, username, username_length);
+}
+
+const char *Session::authenticationDigest() const {
+  switch (suite.authentication) {
+  case AuthenticationAlgorithm::HMAC_SHA1:
+    return "SHA1";
+  case AuthenticationAlgorithm::HMAC_SHA256:
+    return "SHA256";
+  default:
+    return NULL;
+  }
+}
+
+const char *Session::integrityDigest() const {
+  switch (suite.integrity) {
+  case IntegrityAlgorithm::HMAC_SHA1_96:
+    return "SHA1";
+  case IntegrityAlgorithm::HMAC_SHA256_128:
+    return "SHA256";
+  default:
+    return NULL;
+  }
+}
+
+// The integrity trailer is a truncated HMAC keyed with K1.
+size_t Session::integrityCodeSize() const {
+  switch (suite.integrity) {
+  case IntegrityAlgorithm::HMAC_SHA1_96:
+    return 12;
+  case IntegrityAlgorithm::HMAC_SHA256_128:
+    return 16;
+  default:
+    return 0;
+  }
+}
+
+// RAKP 4 carries a truncated HMAC keyed with the SIK.
+size_t Session::rakpIntegrityCheckSize() const {
+  return suite.authentication == AuthenticationAlgorithm::HMAC_SHA256 ? 16
+                                                                      : 12;
+}
+
+size_t Session::writeHandshake(uint8_t *out, size_t size, PayloadType type,
+                               const uint8_t *payload, uint16_t length) const {
+  if ((size_t)(RMCP_SIZE + SESSION_SIZE + length) > size) {
+    return 0;
+  }
+
+  PacketWriter writer(out, size);
+  RMCP().write(writer);
+  // Outside of a session, the session id and sequence number are zero.
+  SessionHeader((uint8_t)type, 0, 0, length).write(writer);
+  writer.put(payload, length);
+  return writer.position();
+}
+
+Status Session::readHandshake(PacketView &packet, PayloadType type) const {
+  RMCP rmcp;
+  SessionHeader header;
+  if (rmcp.read(packet) == Status::Failure ||
+      header.read(packet) == Status::Failure) {
+    return Status::Failure;
+  }
+  insist_return(header.type() == type, Status::Failure,
+                "Expected payload type %02x, but got %02x", (uint8_t)type,
+                (uint8_t)header.type());
+  insist_return(header.length == packet.remaining(), Status::Failure,
+                "Session header claims %d bytes of payload, but %zd bytes "
+                "remain",
+                header.length, packet.remaining());
+  return Status::Success;
+}
+
+size_t Session::openSession(uint8_t *out, size_t size) {
+  insist_return(authenticationDigest() != NULL &&
+                    (suite.integrity == IntegrityAlgorithm::None ||
+                     integrityDigest() != NULL),
+                0, "Unsupported cipher suite");
+  insist_return(user_hmac.init(authenticationDigest(), user_key,
+                               sizeof(user_key)) == Status::Success,
+                0, "Failed to key the user HMAC");
+
+  active = false;
+  do {
+    RAND_bytes((uint8_t *)&console_id, sizeof(console_id));
+  } while (console_id == 0);
+
+  uint8_t payload[OpenSession::Request::DATA_SIZE];
+  PacketWriter writer(payload, sizeof(payload));
+  OpenSession::Request(MESSAGE_TAG, 0x00 /* highest allowed */, console_id,
+                       suite)
+      .write(writer);
+  return writeHandshake(out, size, PayloadType::OpenSessionRequest, payload,
+                        writer.position());
+}
+
+Status Session::receiveOpenSession(PacketView &packet) {
+  OpenSession::Response response;
+  if (readHandshake(packet, PayloadType::OpenSessionResponse) ==
+          Status::Failure ||
+      response.read(packet) == Status::Failure) {
+    return Status::Failure;
+  }
+
+  insist_return(response.console_id == console_id, Status::Failure,
+                "Open Session response is for session %08x, not %08x",
+                response.console_id, console_id);
+  insist_return(response.suite.authentication == suite.authentication &&
+                    response.suite.integrity == suite.integrity &&
+                    response.suite.confidentiality == suite.confidentiality,
+                Status::Failure,
+                "BMC chose different algorithms than were requested");
+  bmc_id = response.bmc_id;
+  return Status::Success;
+}
+
+size_t Session::rakp1(uint8_t *out, size_t size) {
+  RAKP::Message1 message;
+  message.tag = MESSAGE_TAG;
+  message.bmc_id = bmc_id;
+  RAND_bytes(console_random, sizeof(console_random));
+  memcpy(message.console_random, console_random, 16);
+  message.role = role;
+  message.username_length = username_length;
+  memcpy(message.username, username, username_length);
+
+  uint8_t payload[RAKP::Message1::HEADER_SIZE + sizeof(username)];
+  PacketWriter writer(payload, sizeof(payload));
+  message.write(writer);
+  return writeHandshake(out, size, PayloadType::RAKP1, payload,
+                        writer.position());
+}
+
+Status Session::receiveRAKP2(PacketView &packet) {
+  RAKP::Message2 message;
+  if (readHandshake(packet, PayloadType::RAKP2) == Status::Failure ||
+      message.read(packet) == Status::Failure) {
+    return Status::Failure;
+  }
+  insist_return(message.console_id == console_id, Status::Failure,
+                "RAKP 2 is for session %08x, not %08x", message.console_id,
+                console_id);
+  insist_return(message.authcode_length == user_hmac.size(), Status::Failure,
+                "RAKP 2 authcode is %d bytes, expected %zd",
+                message.authcode_length, user_hmac.size());
+
+  // HMAC(Kuid) over SIDm, SIDc, Rm, Rc, GUIDc, ROLEm, ULENGTHm and UNAMEm
+  uint8_t expected[RAKP::MAX_AUTHCODE_SIZE];
+  user_hmac.begin();
+  user_hmac.update(&console_id, 4);
+  user_hmac.update(&bmc_id, 4);
+  user_hmac.update(console_random, 16);
+  user_hmac.update(message.bmc_random, 16);
+  user_hmac.update(message.bmc_guid, 16);
+  user_hmac.update(&role, 1);
+  user_hmac.update(&username_length, 1);
+  user_hmac.update(username, username_length);
+  user_hmac.finish(expected);
+  insist_return(CRYPTO_memcmp(expected, message.authcode,
+                              message.authcode_length) == 0,
+                Status::Failure,
+                "RAKP 2 authcode mismatch. Is the password correct?");
+
+  memcpy(bmc_random, message.bmc_random, 16);
+  memcpy(bmc_guid, message.bmc_guid, 16);
+
+  // SIK = HMAC(Kg) over Rm, Rc, ROLEm, ULENGTHm and UNAMEm. Without a BMC
+  // key, Kg is Kuid.
+  user_hmac.begin();
+  user_hmac.update(console_random, 16);
+  user_hmac.update(bmc_random, 16);
+  user_hmac.update(&role, 1);
+  user_hmac.update(&username_length, 1);
+  user_hmac.update(username, username_length);
+  user_hmac.finish(sik);
+  return sik_hmac.init(authenticationDigest(), sik, user_hmac.size());
+}
+
+size_t Session::rakp3(uint8_t *out, size_t size) {
+  RAKP::Message3 message;
+  message.tag = MESSAGE_TAG;
+  message.status_code = 0;
+  message.bmc_id = bmc_id;
+
+  // HMAC(Kuid) over Rc, SIDm, ROLEm, ULENGTHm and UNAMEm
+  user_hmac.begin();
+  user_hmac.update(bmc_random, 16);
+  user_hmac.update(&console_id, 4);
+  user_hmac.update(&role, 1);
+  user_hmac.update(&username_length, 1);
+  user_hmac.update(username, username_length);
+  user_hmac.finish(message.authcode);
+  message.authcode_length = user_hmac.size();
+
+  uint8_t payload[RAKP::Message3::HEADER_SIZE + RAKP::MAX_AUTHCODE_SIZE];
+  PacketWriter writer(payload, sizeof(payload));
+  message.write(writer);
+  return writeHandshake(out, size, PayloadType::RAKP3, payload,
+                        writer.position());
+}
+
+Status Session::receiveRAKP4(PacketView &packet) {
+  RAKP::Message4 message;
+  if (readHandshake(packet, PayloadType::RAKP4) == Status::Failure ||
+      message.read(packet) == Status::Failure) {
+    return Status::Failure;
+  }
+  insist_return(message.console_id == console_id, Status::Failure,
+                "RAKP 4 is for session %08x, not %08x", message.console_id,
+                console_id);
+  insist_return(message.integrity_check_length == rakpIntegrityCheckSize(),
+                Status::Failure, "RAKP 4 integrity check is %d bytes",
+                message.integrity_check_length);
+
+  // HMAC(SIK) over Rm, SIDc and GUIDc
+  uint8_t expected[RAKP::MAX_AUTHCODE_SIZE];
+  sik_hmac.begin();
+  sik_hmac.update(console_random, 16);
+  sik_hmac.update(&bmc_id, 4);
+  sik_hmac.update(bmc_guid, 16);
+  sik_hmac.finish(expected);
+  insist_return(CRYPTO_memcmp(expected, message.integrity_check,
+                              message.integrity_check_length) == 0,
+                Status::Failure, "RAKP 4 integrity check mismatch");
+
+  return deriveKeys();
+}
+
+// K1 keys the integrity HMAC and the first 16 bytes of K2 are the AES key.
+// Both are HMAC(SIK) over 20 repeated constant bytes.
+Status Session::deriveKeys() {
+  uint8_t constant[20];
+  uint8_t k1[RAKP::MAX_AUTHCODE_SIZE];
+  uint8_t k2[RAKP::MAX_AUTHCODE_SIZE];
+
+  memset(constant, 0x01, sizeof(constant));
+  sik_hmac.compute(constant, sizeof(constant), k1);
+  memset(constant, 0x02, sizeof(constant));
+  sik_hmac.compute(constant, sizeof(constant), k2);
+
+  if (suite.integrity != IntegrityAlgorithm::None &&
+      integrity.init(integrityDigest(), k1, sik_hmac.size()) ==
+          Status::Failure) {
+    return Status::Failure;
+  }
+  if (suite.confidentiality == ConfidentialityAlgorithm::AES_CBC_128 &&
+      confidentiality.init(k2) == Status::Failure) {
+    return Status::Failure;
+  }
+
+  sequence = 0;
+  active = true;
+  return Status::Success;
+}
+
+size_t Session::seal(uint8_t *out, size_t size, const uint8_t *message,
+                     size_t length) {
+  insist_return(active, 0, "RMCP+ session is not active");
+  const bool encrypted =
+      suite.confidentiality == ConfidentialityAlgorithm::AES_CBC_128;
+  const size_t code_size = integrityCodeSize();
+
+  // Encrypted payloads are an IV, then the message padded with 1, 2, 3...
+  // and a pad length byte to a whole number of blocks.
+  size_t payload_length = length;
+  size_t cipher_pad = 0;
+  if (encrypted) {
+    cipher_pad = (AES_BLOCK_SIZE - (length + 1) % AES_BLOCK_SIZE) %
+                 AES_BLOCK_SIZE;
+    payload_length = AES_BLOCK_SIZE + length + cipher_pad + 1;
+  }
+
+  // The integrity pad makes everything from the auth type through the next
+  // header byte a multiple of 4 bytes.
+  size_t integrity_pad = 0;
+  size_t trailer = 0;
+  if (code_size > 0) {
+    integrity_pad = (4 - (SESSION_SIZE + payload_length + 2) % 4) % 4;
+    trailer = integrity_pad + 2 + code_size;
+  }
+
+  if (RMCP_SIZE + SESSION_SIZE + payload_length + trailer > size) {
+    return 0;
+  }
+
+  // Sequence number 0 is reserved for packets outside of a session.
+  if (++sequence == 0) {
+    sequence = 1;
+  }
+
+  uint8_t type = (uint8_t)PayloadType::IPMI;
+  if (encrypted) {
+    type |= SessionHeader::ENCRYPTED;
+  }
+  if (code_size > 0) {
+    type |= SessionHeader::AUTHENTICATED;
+  }
+
+  PacketWriter writer(out, size);
+  RMCP().write(writer);
+  SessionHeader(type, bmc_id, sequence, payload_length).write(writer);
+
+  if (encrypted) {
+    uint8_t iv[AES_BLOCK_SIZE];
+    uint8_t block[MAX_PACKET_SIZE];
+    insist_return(length + cipher_pad + 1 <= sizeof(block), 0,
+                  "IPMI message of %zd bytes is too long to encrypt", length);
+    confidentiality.nextIV(iv);
+    memcpy(block, message, length);
+    for (size_t i = 0; i < cipher_pad; i++) {
+      block[length + i] = i + 1;
+    }
+    block[length + cipher_pad] = cipher_pad;
+    if (confidentiality.encrypt(iv, block, length + cipher_pad + 1, block) ==
+        Status::Failure) {
+      return 0;
+    }
+    writer.put(iv, sizeof(iv));
+    writer.put(block, length + cipher_pad + 1);
+  } else {
+    writer.put(message, length);
+  }
+
+  if (code_size > 0) {
+    for (size_t i = 0; i < integrity_pad; i++) {
+      writer.put(0xff);
+    }
+    writer.put(integrity_pad);
+    writer.put(NEXT_HEADER);
+
+    uint8_t code[RAKP::MAX_AUTHCODE_SIZE];
+    integrity.compute(out + RMCP_SIZE, writer.position() - RMCP_SIZE, code);
+    writer.put(code, code_size);
+  }
+  return writer.position();
+}
+
+Status Session::open(PacketView &packet, uint8_t *message, size_t size,
+                     size_t &length) {
+  insist_return(active, Status::Failure, "RMCP+ session is not active");
+  RMCP rmcp;
+  SessionHeader header;
+  if (rmcp.read(packet) == Status::Failure ||
+      header.read(packet) == Status::Failure) {
+    return Status::Failure;
+  }
+
+  const bool encrypted =
+      suite.confidentiality == ConfidentialityAlgorithm::AES_CBC_128;
+  const size_t code_size = integrityCodeSize();
+  insist_return(header.type() == PayloadType::IPMI, Status::Failure,
+                "Expected an IPMI payload, but got payload type %02x",
+                (uint8_t)header.type());
+  insist_return(header.id == console_id, Status::Failure,
+                "Packet is for session %08x, not %08x", header.id, console_id);
+  insist_return(
+      ((header.payload_type & SessionHeader::ENCRYPTED) != 0) == encrypted &&
+          ((header.payload_type & SessionHeader::AUTHENTICATED) != 0) ==
+              (code_size > 0),
+      Status::Failure, "Packet protection does not match the cipher suite");
+  insist_return(header.length <= packet.remaining(), Status::Failure,
+                "Session header claims %d bytes of payload, but only %zd "
+                "bytes remain",
+                header.length, packet.remaining());
+
+  const uint8_t *payload = packet.peek();
+  const size_t trailer = packet.remaining() - header.length;
+  if (code_size > 0) {
+    insist_return(trailer >= 2 + code_size && trailer - 2 - code_size < 4,
+                  Status::Failure, "Bad integrity trailer length %zd",
+                  trailer);
+    const size_t covered = SESSION_SIZE + packet.remaining() - code_size;
+    insist_return(payload[packet.remaining() - code_size - 1] == NEXT_HEADER,
+                  Status::Failure, "Bad next header byte");
+
+    uint8_t code[RAKP::MAX_AUTHCODE_SIZE];
+    integrity.compute(payload - SESSION_SIZE, covered, code);
+    insist_return(CRYPTO_memcmp(code,
+                                payload + packet.remaining() - code_size,
+                                code_size) == 0,
+                  Status::Failure,
+                  "Integrity check failed on receiving packet");
+  } else {
+    insist_return(trailer == 0, Status::Failure,
+                  "Unexpected %zd bytes after the payload", trailer);
+  }
+
+  if (encrypted) {
+    insist_return(header.length >= 2 * AES_BLOCK_SIZE &&
+                      header.length % AES_BLOCK_SIZE == 0 &&
+                      (size_t)(header.length - AES_BLOCK_SIZE) <= size,
+                  Status::Failure, "Bad encrypted payload length %d",
+                  header.length);
+    const size_t blocks = header.length - AES_BLOCK_SIZE;
+    if (confidentiality.decrypt(payload, payload + AES_BLOCK_SIZE, blocks,
+                                message) == Status::Failure) {
+      return Status::Failure;
+    }
+    const uint8_t pad = message[blocks - 1];
+    insist_return(pad < AES_BLOCK_SIZE, Status::Failure,
+                  "Bad confidentiality pad length %d", pad);
+    length = blocks - pad - 1;
+  } else {
+    insist_return(header.length <= size, Status::Failure,
+                  "IPMI message of %d bytes does not fit", header.length);
+    memcpy(message, payload, header.length);
+    length = header.length;
+  }
+
+  packet.skip(packet.remaining());
+  return Status::Success;
+}
+} // namespace Lanplus
+} // namespace IPMI
+#endif
@@ -0,0 +1,398 @@
+/*
+    Copyright Jordan Sissel, 2018
+    This file is part of jordansissel/ipmi.
+
+    jordansissel/ipmi is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    jordansissel/ipmi is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with jordansissel/ipmi.  If not, see <http://www.gnu.org/licenses/>.
+  */
+#pragma once
+#include "ipmi.h"
+
+// RMCP+ needs OpenSSL, which the Mongoose OS (ESP32) build does not have.
+#ifndef IPMI_LANPLUS
+#if CS_PLATFORM == CS_P_UNIX || CS_PLATFORM == CS_P_WINDOWS
+#define IPMI_LANPLUS 1
+#else
+#define IPMI_LANPLUS 0
+#endif
+#endif
+
+#if IPMI_LANPLUS
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+
+// IPMI 2.0 RMCP+ sessions, also known as "lanplus".
+//
+// A session is opened with Open Session and the four RAKP messages, which
+// authenticate both sides with HMACs keyed by the user password and derive a
+// session integrity key (SIK). IPMI messages inside the session are then
+// wrapped in an RMCP+ session header, optionally AES-CBC-128 encrypted, and
+// followed by an HMAC integrity trailer.
+namespace IPMI {
+namespace Lanplus {
+// IPMI 2.0 v2 rev 1.1 Table 13-16 Payload Type Numbers
+enum class PayloadType : uint8_t {
+  IPMI = 0x00,
+  OpenSessionRequest = 0x10,
+  OpenSessionResponse = 0x11,
+  RAKP1 = 0x12,
+  RAKP2 = 0x13,
+  RAKP3 = 0x14,
+  RAKP4 = 0x15
+};
+
+// IPMI 2.0 v2 rev 1.1 Table 13-17 Authentication Algorithm Numbers
+enum class AuthenticationAlgorithm : uint8_t {
+  None = 0x00,
+  HMAC_SHA1 = 0x01,
+  HMAC_MD5 = 0x02,
+  HMAC_SHA256 = 0x03
+};
+
+// IPMI 2.0 v2 rev 1.1 Table 13-18 Integrity Algorithm Numbers
+enum class IntegrityAlgorithm : uint8_t {
+  None = 0x00,
+  HMAC_SHA1_96 = 0x01,
+  HMAC_MD5_128 = 0x02,
+  MD5_128 = 0x03,
+  HMAC_SHA256_128 = 0x04
+};
+
+// IPMI 2.0 v2 rev 1.1 Table 13-19 Confidentiality Algorithm Numbers
+enum class ConfidentialityAlgorithm : uint8_t {
+  None = 0x00,
+  AES_CBC_128 = 0x01
+};
+
+const uint8_t AUTH_TYPE_RMCP_PLUS = 0x06;
+// Auth type, payload type, session id, sequence number and payload length.
+const uint8_t SESSION_SIZE = 12;
+const uint8_t AES_BLOCK_SIZE = 16;
+// Large enough for any packet built by this library, including the AES IV,
+// cipher padding and the longest integrity trailer.
+const size_t MAX_PACKET_SIZE = 256;
+// Large enough for any IPMI message received in a session once decrypted. A
+// Get SDR response of GetSdr::MAX_READ bytes is the largest, padded to whole
+// cipher blocks.
+const size_t MAX_MESSAGE_SIZE =
+    (messageLength(3) + GetSdr::MAX_READ) / AES_BLOCK_SIZE * AES_BLOCK_SIZE +
+    AES_BLOCK_SIZE;
+// Large enough for any packet received: the headers, the AES IV, the message
+// and an integrity trailer of up to 3 pad bytes, the pad length, the next
+// header byte and a 16 byte code.
+const size_t MAX_RESPONSE_SIZE = RMCP_SIZE + SESSION_SIZE + AES_BLOCK_SIZE +
+                                 MAX_MESSAGE_SIZE + 3 + 2 + 16;
+
+struct CipherSuite {
+  AuthenticationAlgorithm authentication;
+  IntegrityAlgorithm integrity;
+  ConfidentialityAlgorithm confidentiality;
+};
+
+// The two suites most BMCs enable for lanplus.
+const CipherSuite CIPHER_SUITE_3 = {AuthenticationAlgorithm::HMAC_SHA1,
+                                    IntegrityAlgorithm::HMAC_SHA1_96,
+                                    ConfidentialityAlgorithm::AES_CBC_128};
+const CipherSuite CIPHER_SUITE_17 = {AuthenticationAlgorithm::HMAC_SHA256,
+                                     IntegrityAlgorithm::HMAC_SHA256_128,
+                                     ConfidentialityAlgorithm::AES_CBC_128};
+
+// An HMAC whose key is set once. OpenSSL keeps the keyed inner and outer
+// digest states, so begin() only copies them instead of hashing the key
+// again for every packet.
+class Hmac {
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+  EVP_MAC *mac;
+  EVP_MAC_CTX *ctx;
+#else
+  HMAC_CTX *ctx;
+#endif
+  size_t length;
+
+public:
+  Hmac();
+  ~Hmac();
+  Hmac(const Hmac &) = delete;
+  Hmac &operator=(const Hmac &) = delete;
+
+  // `digest` is an OpenSSL digest name such as "SHA1" or "SHA256".
+  Status init(const char *digest, const uint8_t *key, size_t key_length);
+  // Length of the full, untruncated HMAC.
+  size_t size() const { return length; }
+
+  void begin();
+  void update(const void *data, size_t length);
+  void finish(uint8_t *out);
+
+  void compute(const void *data, size_t length, uint8_t *out) {
+    begin();
+    update(data, length);
+    finish(out);
+  }
+};
+
+// AES-CBC-128 with the key schedule expanded once. The CBC chaining is done
+// here over ECB contexts, since handing OpenSSL a new IV re-initializes its
+// CBC context and costs more than encrypting a short IPMI message. IPMI pads
+// payloads itself, so lengths must be whole blocks.
+class AesCbc {
+  EVP_CIPHER_CTX *encryptor;
+  EVP_CIPHER_CTX *decryptor;
+  uint8_t nonce[16];
+
+public:
+  AesCbc();
+  ~AesCbc();
+  AesCbc(const AesCbc &) = delete;
+  AesCbc &operator=(const AesCbc &) = delete;
+
+  Status init(const uint8_t key[16]);
+  // Makes an unpredictable IV by encrypting a random per-session nonce with a
+  // counter folded in (NIST SP 800-38A, Appendix C), which is much cheaper
+  // than asking the random number generator for every packet.
+  void nextIV(uint8_t iv[16]);
+  Status encrypt(const uint8_t iv[16], const uint8_t *in, size_t length,
+                 uint8_t *out);
+  Status decrypt(const uint8_t iv[16], const uint8_t *in, size_t length,
+                 uint8_t *out);
+};
+
+class SessionHeader {
+  uint8_t auth_type;
+
+public:
+  uint8_t payload_type; // PayloadType plus the encrypted and authenticated bits
+  uint32_t id;
+  uint32_t sequence;
+  uint16_t length;
+
+  SessionHeader() {}
+  SessionHeader(uint8_t payload_type, uint32_t id, uint32_t sequence,
+                uint16_t length)
+      : auth_type(AUTH_TYPE_RMCP_PLUS), payload_type(payload_type), id(id),
+        sequence(sequence), length(length) {}
+
+  static const uint8_t ENCRYPTED = 0x80;
+  static const uint8_t AUTHENTICATED = 0x40;
+  PayloadType type() const { return (PayloadType)(payload_type & 0x3f); }
+
+  void write(PacketWriter &out) const;
+  Status read(PacketView &in);
+};
+
+namespace OpenSession {
+class Request {
+public:
+  uint8_t tag;
+  uint8_t privilege;
+  uint32_t console_id;
+  CipherSuite suite;
+
+  Request() {}
+  Request(uint8_t tag, uint8_t privilege, uint32_t console_id,
+          CipherSuite suite)
+      : tag(tag), privilege(privilege), console_id(console_id), suite(suite) {}
+
+  static constexpr uint16_t DATA_SIZE = 32;
+  void write(PacketWriter &out) const;
+  Status read(PacketView &in);
+};
+
+class Response {
+public:
+  uint8_t tag;
+  uint8_t status_code;
+  uint8_t privilege;
+  uint32_t console_id;
+  uint32_t bmc_id;
+  CipherSuite suite;
+
+  static constexpr uint16_t DATA_SIZE = 36;
+  void write(PacketWriter &out) const;
+  Status read(PacketView &in);
+};
+} // namespace OpenSession
+
+namespace RAKP {
+// The longest key exchange authcode, an untruncated HMAC-SHA256.
+const uint8_t MAX_AUTHCODE_SIZE = 32;
+
+class Message1 {
+public:
+  uint8_t tag;
+  uint32_t bmc_id;
+  uint8_t console_random[16];
+  uint8_t role;
+  uint8_t username_length;
+  uint8_t username[16];
+
+  static constexpr uint16_t HEADER_SIZE = 28;
+  uint16_t size() const { return HEADER_SIZE + username_length; }
+  void write(PacketWriter &out) const;
+  Status read(PacketView &in);
+};
+
+class Message2 {
+public:
+  uint8_t tag;
+  uint8_t status_code;
+  uint32_t console_id;
+  uint8_t bmc_random[16];
+  uint8_t bmc_guid[16];
+  uint8_t authcode[MAX_AUTHCODE_SIZE];
+  uint8_t authcode_length;
+
+  static constexpr uint16_t HEADER_SIZE = 40;
+  uint16_t size() const { return HEADER_SIZE + authcode_length; }
+  void write(PacketWriter &out) const;
+  Status read(PacketView &in);
+};
+
+class Message3 {
+public:
+  uint8_t tag;
+  uint8_t status_code;
+  uint32_t bmc_id;
+  uint8_t authcode[MAX_AUTHCODE_SIZE];
+  uint8_t authcode_length;
+
+  static constexpr uint16_t HEADER_SIZE = 8;
+  uint16_t size() const { return HEADER_SIZE + authcode_length; }
+  void write(PacketWriter &out) const;
+  Status read(PacketView &in);
+};
+
+class Message4 {
+public:
+  uint8_t tag;
+  uint8_t status_code;
+  uint32_t console_id;
+  uint8_t integrity_check[MAX_AUTHCODE_SIZE];
+  uint8_t integrity_check_length;
+
+  static constexpr uint16_t HEADER_SIZE = 8;
+  uint16_t size() const { return HEADER_SIZE + integrity_check_length; }
+  void write(PacketWriter &out) const;
+  Status read(PacketView &in);
+};
+} // namespace RAKP
+
+// One RMCP+ session, from Open Session through every packet sent within it.
+//
+// The console side drives it as:
+//   openSession() -> receiveOpenSession() -> rakp1() -> receiveRAKP2() ->
+//   rakp3() -> receiveRAKP4()
+// after which seal() and open() wrap and unwrap IPMI messages. The HMAC and
+// AES contexts are keyed when the session keys are derived and reused for
+// every packet after that.
+class Session {
+  CipherSuite suite;
+  uint8_t user_key[20]; // Kuid: the password, zero-padded to 20 bytes
+  uint8_t username[16];
+  uint8_t username_length;
+  uint8_t role;
+
+  uint32_t console_id;
+  uint32_t bmc_id;
+  uint32_t sequence;
+  uint8_t console_random[16];
+  uint8_t bmc_random[16];
+  uint8_t bmc_guid[16];
+  uint8_t sik[RAKP::MAX_AUTHCODE_SIZE];
+  bool active;
+
+  Hmac user_hmac;
+  Hmac sik_hmac;
+  Hmac integrity;
+  AesCbc confidentiality;
+
+  const char *authenticationDigest() const;
+  const char *integrityDigest() const;
+  size_t integrityCodeSize() const;
+  size_t rakpIntegrityCheckSize() const;
+  size_t writeHandshake(uint8_t *out, size_t size, PayloadType type,
+                        const uint8_t *payload, uint16_t length) const;
+  Status readHandshake(PacketView &packet, PayloadType type) const;
+  Status deriveKeys();
+
+public:
+  Session(const uint8_t *password, size_t password_length,
+          const char *username, CipherSuite suite);
+
+  bool isActive() const { return active; }
+  uint32_t consoleId() const { return console_id; }
+  uint32_t bmcId() const { return bmc_id; }
+
+  size_t openSession(uint8_t *out, size_t size);
+  Status receiveOpenSession(PacketView &packet);
+  size_t rakp1(uint8_t *out, size_t size);
+  Status receiveRAKP2(PacketView &packet);
+  size_t rakp3(uint8_t *out, size_t size);
+  Status receiveRAKP4(PacketView &packet);
+
+  // Wraps an IPMB message in an RMCP+ packet: session header, the message
+  // (encrypted if the suite asks for it) and the integrity trailer. Returns
+  // the packet length, or 0 if it does not fit in `size` bytes.
+  size_t seal(uint8_t *out, size_t size, const uint8_t *message,
+              size_t length);
+
+  // Checks the integrity trailer of a received packet and writes the
+  // decrypted IPMB message to `message`, setting `length` to its size.
+  Status open(PacketView &packet, uint8_t *message, size_t size,
+              size_t &length);
+};
+
+// Writes a request for command C with the given rqSeq inside an active
+// session.
+template <class C>
+size_t encode(uint8_t *out, size_t size, Session &session, uint8_t rq_seq,
+              const typename C::Request &request) {
+  uint8_t message[C::Request::length()];
+  PacketWriter writer(message, sizeof(message));
+  IPMB(C::netFn, rq_seq, C::command).write(writer);
+  request.write(writer);
+  writer.put((uint8_t)-sum(message + 3, writer.position() - 3));
+  return session.seal(out, size, message, writer.position());
+}
+
+// Writes a request for command C inside an active session.
+template <class C>
+size_t encode(uint8_t *out, size_t size, Session &session,
+              const typename C::Request &request) {
+  return encode<C>(out, size, session, DEFAULT_RQ_SEQ, request);
+}
+
+// Decodes a response to command C received inside an active session.
+template <class C>
+Status decode(PacketView &packet, Session &session, IPMB &ipmb,
+              typename C::Response &response) {
+  uint8_t message[MAX_MESSAGE_SIZE];
+  size_t length;
+  if (session.open(packet, message, sizeof(message), length) ==
+      Status::Failure) {
+    return Status::Failure;
+  }
+
+  PacketView view(message, length);
+  if (decodeMessage<C>(view, ipmb, response) == Status::Failure) {
+    return Status::Failure;
+  }
+  insist_return(
+      view.remaining() == 0, Status::Failure,
+      "Buffer length should be empty if decoding is correct, but has %zd bytes",
+      view.remaining());
+  return Status::Success;
+}
+} // namespace Lanplus
+} // namespace IPMI
+#endif
@@ -0,0 +1,98 @@
+/*
+    Copyright Jordan Sissel, 2018
+    This file is part of jordansissel/ipmi.
+
+    jordansissel/ipmi is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    jordansissel/ipmi is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with jordansissel/ipmi.  If not, see <http://www.gnu.org/licenses/>.
+  */
+#pragma once
+#include "insist.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+// The fleet of simulated BMCs that bmc-sim serves and load-gen drives, one
+// line per BMC or range of loopback ports:
+//
+//   # ports       user  password  latency ms  jitter ms  loss %
+//   20000-24999   root  secret    2           1          0.5
+//   25000         admin hunter2   50
+//
+// Latency, jitter and loss default to 0.
+
+struct BmcConfig {
+  uint16_t port;
+  // NUL padded, as they go on the wire.
+  uint8_t user[16];
+  uint8_t password[16];
+  double latency;
+  double jitter;
+  // Percent of requests dropped unanswered.
+  double loss;
+};
+
+// Appends the BMCs described in `path`, or stdin for "-", to `bmcs`.
+inline bool readBmcConfig(const char *path, std::vector<BmcConfig> &bmcs) {
+  FILE *in = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+  insist_return(in != NULL, false, "Cannot read %s: %s", path,
+                strerror(errno));
+
+  char line[256];
+  for (int number = 1; fgets(line, sizeof(line), in) != NULL; number++) {
+    char *comment = strchr(line, '#');
+    if (comment != NULL) {
+      *comment = '\0';
+    }
+    char ports[32], user[17], password[17];
+    double latency = 0, jitter = 0, loss = 0;
+    const int fields = sscanf(line, "%31s %16s %16s %lf %lf %lf", ports, user,
+                              password, &latency, &jitter, &loss);
+    if (fields <= 0) {
+      continue;
+    }
+    unsigned first, last;
+    const int bounds = sscanf(ports, "%u-%u", &first, &last);
+    if (bounds == 1) {
+      last = first;
+    }
+    if (fields < 3 || bounds < 1 || first == 0 || first > last ||
+        last > 65535 || latency < 0 || jitter < 0 || loss < 0 || loss > 100) {
+      fprintf(stderr,
+              "%s:%d: expected <port>[-<last port>] <user> <password> "
+              "[<latency ms> [<jitter ms> [<loss %%>]]]\n",
+              path, number);
+      if (in != stdin) {
+        fclose(in);
+      }
+      return false;
+    }
+
+    BmcConfig bmc = {};
+    strncpy((char *)bmc.user, user, 16);
+    strncpy((char *)bmc.password, password, 16);
+    bmc.latency = latency;
+    bmc.jitter = jitter;
+    bmc.loss = loss;
+    for (unsigned port = first; port <= last; port++) {
+      bmc.port = port;
+      bmcs.push_back(bmc);
+    }
+  }
+  if (in != stdin) {
+    fclose(in);
+  }
+  return true;
+}
@@ -0,0 +1,709 @@
+/*
+    Copyright Jordan Sissel, 2018
+    This file is part of jordansissel/ipmi.
+
+    jordansissel/ipmi is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    jordansissel/ipmi is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with jordansissel/ipmi.  If not, see <http://www.gnu.org/licenses/>.
+  */
+#include "insist.h"
+#include "ipmi.h"
+#include "linux/bmc_config.h"
+#include "timing_wheel.h"
+
+#include <algorithm>
+#include <deque>
+#include <errno.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <thread>
+#include <time.h>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+
+// Simulates a fleet of IPMI 1.5 BMCs on loopback UDP ports, for load testing
+// clients without hardware. Each BMC has its own user, password, reply
+// latency and loss, read from a file described in linux/bmc_config.h.
+//
+// Unlike the benchmarks' fake BMC, it keeps session state the way a BMC does:
+// it checks the user name, the challenge and every authcode, hands out and
+// tracks session sequence numbers, and enforces the session privilege level.
+// Requests it cannot authenticate are dropped, as a BMC would.
+//
+// Every BMC also serves the same SDR repository of full sensor records,
+// last added to when the simulator started. How many bytes of a record a Get
+// SDR may ask for depends on the port: as many as a reply can carry, 48 or
+// 24, so that readers have something to adapt to.
+
+using namespace IPMI;
+
+// Sessions idle this long are forgotten. The IPMI default inactivity timeout.
+static const double SESSION_TIMEOUT = 60;
+// Sessions a BMC holds before it starts looking for idle ones to forget.
+static const size_t SESSION_PRUNE_SIZE = 1024;
+// Inbound sequence numbers this far behind the highest seen are replays.
+static const uint32_t SEQUENCE_WINDOW = RQ_SEQ_COUNT / 2;
+// Records in the simulated SDR repository.
+static const size_t SDR_SENSORS = 40;
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+struct SimulatedSession {
+  uint8_t challenge[16];
+  AuthCode auth;
+  bool active = false;
+  // The highest level ActivateSession allowed, and the current one.
+  uint8_t max_privilege = 0;
+  uint8_t privilege = (uint8_t)AuthenticationCapability::User;
+  // The first sequence number the client may use, and the highest it has.
+  uint32_t inbound_start = 0;
+  uint32_t inbound = 0;
+  // The next sequence number of our replies.
+  uint32_t outbound = 0;
+  double last_seen = 0;
+};
+
+struct Bmc : BmcConfig {
+  int fd = -1;
+  std::unordered_map<uint32_t, SimulatedSession> sessions;
+  bool powered = true;
+  // The current SDR reservation, and the most a Get SDR may ask for.
+  uint16_t reservation = 0;
+  uint8_t max_sdr_read = GetSdr::MAX_IPMI15_READ;
+};
+
+// A kind of sensor in the simulated SDR repository.
+struct SensorKind {
+  const char *name;
+  uint8_t sensor_type;
+  uint8_t entity_id;
+  uint8_t base_unit;
+  uint8_t m;
+  // R exponent in the high nibble, B exponent in the low one.
+  uint8_t exponents;
+};
+
+static const SensorKind SENSOR_KINDS[] = {
+    {"CPU Temp", 0x01, 0x03, 1, 1, 0x00},    // degrees C
+    {"Voltage", 0x02, 0x07, 4, 10, 0xd0},    // volts, 10 mV steps
+    {"Fan", 0x04, 0x1d, 18, 60, 0x00},       // RPM
+    {"PSU Current", 0x03, 0x0a, 5, 1, 0xf0}, // amps, 0.1 A steps
+};
+static const size_t SENSOR_KIND_COUNT =
+    sizeof(SENSOR_KINDS) / sizeof(SENSOR_KINDS[0]);
+
+// Full sensor records, as Get SDR returns them.
+static std::vector<std::vector<uint8_t>> sdr_repository;
+static uint32_t sdr_last_addition;
+
+static void makeSdrRepository() {
+  sdr_last_addition = time(NULL);
+  for (size_t i = 0; i < SDR_SENSORS; i++) {
+    const SensorKind &kind = SENSOR_KINDS[i % SENSOR_KIND_COUNT];
+    const size_t instance = i / SENSOR_KIND_COUNT;
+    char name[17];
+    snprintf(name, sizeof(name), "%s %zu", kind.name, instance + 1);
+    const size_t name_length = strlen(name);
+
+    // Offsets from 0; the specification counts from 1.
+    std::vector<uint8_t> record(48 + name_length);
+    const uint16_t id = i + 1;
+    memcpy(&record[0], &id, 2);
+    record[2] = 0x51;
+    record[3] = 0x01; // Full sensor record
+    record[4] = record.size() - GetSdr::HEADER_SIZE;
+    record[5] = 0x20; // Owned by the BMC
+    record[7] = i;
+    record[8] = kind.entity_id;
+    record[9] = instance + 1;
+    record[10] = 0x7f;
+    record[11] = 0x68;
+    record[12] = kind.sensor_type;
+    record[13] = 0x01; // Threshold
+    record[21] = kind.base_unit;
+    record[24] = kind.m;
+    record[29] = kind.exponents;
+    record[47] = 0xc0 | name_length; // 8-bit ASCII
+    memcpy(&record[48], name, name_length);
+    sdr_repository.push_back(std::move(record));
+  }
+}
+
+struct Statistics {
+  uint64_t requests = 0;
+  uint64_t replies = 0;
+  uint64_t lost = 0;
+  // Requests dropped for failing authentication or sequence checks.
+  uint64_t rejected = 0;
+  uint64_t sessions = 0;
+};
+
+// A reply held back for its BMC's latency.
+struct DelayedReply {
+  Timer timer;
+  class Worker *worker;
+  int fd;
+  struct sockaddr_storage to;
+  socklen_t to_length;
+  uint8_t packet[MAX_RESPONSE_SIZE];
+  size_t length;
+};
+
+static volatile sig_atomic_t stopping = 0;
+
+static void stop(int) { stopping = 1; }
+
+// Serves a share of the BMCs from one thread: an epoll set over their
+// sockets, and a timing wheel for the replies they delay.
+class Worker {
+  std::vector<Bmc *> bmcs;
+  int epoll_fd = -1;
+  TimingWheel wheel;
+  std::deque<DelayedReply> delayed;
+  std::vector<DelayedReply *> idle;
+  unsigned seed;
+
+  uint32_t random32() {
+    return ((uint32_t)rand_r(&seed) << 16) ^ (uint32_t)rand_r(&seed);
+  }
+  size_t respond(Bmc &bmc, const uint8_t *packet, size_t length, uint8_t *out,
+                 size_t size);
+  size_t respondInSession(Bmc &bmc, Session &header, IPMB &ipmb,
+                          PacketView &view, uint8_t *out, size_t size);
+  size_t respondStorage(Bmc &bmc, SimulatedSession &session, uint32_t id,
+                        IPMB &ipmb, PacketView &view, uint8_t *out,
+                        size_t size);
+  void receive(Bmc &bmc);
+  static void sendDelayed(void *context);
+
+public:
+  Statistics statistics;
+
+  Worker(unsigned seed) : wheel(now()), seed(seed) {}
+  void add(Bmc *bmc) { bmcs.push_back(bmc); }
+  bool start();
+  void run();
+};
+
+bool Worker::start() {
+  epoll_fd = epoll_create1(0);
+  insist_return(epoll_fd >= 0, false, "epoll_create1() failed: %s",
+                strerror(errno));
+  for (Bmc *bmc : bmcs) {
+    struct epoll_event event = {};
+    event.events = EPOLLIN;
+    event.data.ptr = bmc;
+    insist_return(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, bmc->fd, &event) == 0,
+                  false, "epoll_ctl() failed for port %d: %s", bmc->port,
+                  strerror(errno));
+  }
+  return true;
+}
+
+void Worker::run() {
+  struct epoll_event events[256];
+  while (!stopping) {
+    // Wake at least every 100ms to notice SIGINT.
+    int timeout = wheel.millisecondsUntilNext();
+    if (timeout < 0 || timeout > 100) {
+      timeout = 100;
+    }
+    const int ready = epoll_wait(epoll_fd, events, 256, timeout);
+    for (int i = 0; i < ready; i++) {
+      receive(*(Bmc *)events[i].data.ptr);
+    }
+    wheel.advance(now());
+  }
+}
+
+void Worker::sendDelayed(void *context) {
+  DelayedReply *reply = (DelayedReply *)context;
+  sendto(reply->fd, reply->packet, reply->length, 0,
+         (struct sockaddr *)&reply->to, reply->to_length);
+  reply->worker->idle.push_back(reply);
+}
+
+// Answers every datagram waiting on the BMC's socket.
+void Worker::receive(Bmc &bmc) {
+  for (;;) {
+    uint8_t packet[1500];
+    struct sockaddr_storage from;
+    socklen_t from_length = sizeof(from);
+    const ssize_t length =
+        recvfrom(bmc.fd, packet, sizeof(packet), MSG_DONTWAIT,
+                 (struct sockaddr *)&from, &from_length);
+    if (length < 0) {
+      return;
+    }
+    statistics.requests++;
+    if (bmc.loss > 0 && rand_r(&seed) % 10000 < bmc.loss * 100) {
+      statistics.lost++;
+      continue;
+    }
+
+    uint8_t out[MAX_RESPONSE_SIZE];
+    const size_t size = respond(bmc, packet, length, out, sizeof(out));
+    if (size == 0) {
+      continue;
+    }
+    statistics.replies++;
+
+    double delay = bmc.latency;
+    if (bmc.jitter > 0) {
+      delay += bmc.jitter * rand_r(&seed) / RAND_MAX;
+    }
+    if (delay <= 0) {
+      sendto(bmc.fd, out, size, 0, (struct sockaddr *)&from, from_length);
+      continue;
+    }
+
+    DelayedReply *reply;
+    if (idle.empty()) {
+      delayed.emplace_back();
+      reply = &delayed.back();
+      reply->timer.callback = sendDelayed;
+      reply->timer.context = reply;
+      reply->worker = this;
+    } else {
+      reply = idle.back();
+      idle.pop_back();
+    }
+    reply->fd = bmc.fd;
+    memcpy(&reply->to, &from, from_length);
+    reply->to_length = from_length;
+    memcpy(reply->packet, out, size);
+    reply->length = size;
+    wheel.schedule(&reply->timer, now() + delay / 1000);
+  }
+}
+
+// Writes the reply to `packet` into `out` and returns its length, or 0 if it
+// deserves none.
+size_t Worker::respond(Bmc &bmc, const uint8_t *packet, size_t length,
+                       uint8_t *out, size_t size) {
+  // RMCP+ and other session types are not simulated.
+  uint8_t command;
+  if (!messageCommand(packet, length, command)) {
+    return 0;
+  }
+
+  PacketView view(packet, length);
+  RMCP rmcp;
+  Session header;
+  IPMB ipmb;
+  if (rmcp.read(view) == Status::Failure ||
+      header.read(view) == Status::Failure) {
+    return 0;
+  }
+  if (header.getAuthType() != AUTH_TYPE_NONE) {
+    return respondInSession(bmc, header, ipmb, view, out, size);
+  }
+  if (ipmb.read(view) == Status::Failure ||
+      ipmb.getNetworkFunction() != NetworkFunction::AppRequest) {
+    return 0;
+  }
+
+  switch (ipmb.command) {
+  case GetChannelAuthenticationCapabilities::Command::command: {
+    GetChannelAuthenticationCapabilities::Request request;
+    if (decodeRequest<GetChannelAuthenticationCapabilities::Command>(
+            view, ipmb, request) == Status::Failure) {
+      return 0;
+    }
+    // Channel 1, MD5 only.
+    return encodeResponse<GetChannelAuthenticationCapabilities::Command>(
+        out, size, ipmb,
+        GetChannelAuthenticationCapabilities::Response(0x01, 1 << 2, 0));
+  }
+
+  case GetSessionChallenge::Command::command: {
+    GetSessionChallenge::Request request;
+    if (decodeRequest<GetSessionChallenge::Command>(view, ipmb, request) ==
+        Status::Failure) {
+      return 0;
+    }
+    GetSessionChallenge::Response response;
+    memset(response.challenge, 0, 16);
+    response.session_id = 0;
+    if (request.getAuthType() != AUTH_TYPE_MD5) {
+      response.completion_code = 0xcc; // Invalid data field
+    } else if (memcmp(request.getUser(), bmc.user, 16) != 0) {
+      response.completion_code = 0x81; // Invalid user name
+    } else {
+      const double at = now();
+      if (bmc.sessions.size() >= SESSION_PRUNE_SIZE) {
+        for (auto i = bmc.sessions.begin(); i != bmc.sessions.end();) {
+          if (at - i->second.last_seen > SESSION_TIMEOUT) {
+            i = bmc.sessions.erase(i);
+          } else {
+            ++i;
+          }
+        }
+      }
+      uint32_t id;
+      do {
+        id = random32();
+      } while (id == 0 || bmc.sessions.count(id) != 0);
+
+      SimulatedSession &session = bmc.sessions[id];
+      for (size_t i = 0; i < 16; i += 4) {
+        const uint32_t bits = random32();
+        memcpy(session.challenge + i, &bits, 4);
+      }
+      session.auth = AuthCode(bmc.password, id);
+      session.last_seen = at;
+      response.session_id = id;
+      memcpy(response.challenge, session.challenge, 16);
+    }
+    return encodeResponse<GetSessionChallenge::Command>(out, size, ipmb,
+                                                        response);
+  }
+  }
+  return 0;
+}
+
+// The sequence number of the session's next reply. 0 is never used.
+static uint32_t nextSequence(SimulatedSession &session) {
+  const uint32_t sequence = session.outbound++;
+  if (session.outbound == 0) {
+    session.outbound = 1;
+  }
+  return sequence;
+}
+
+// Answers a request sent with an authcode, which only the session it names
+// can check.
+size_t Worker::respondInSession(Bmc &bmc, Session &header, IPMB &ipmb,
+                                PacketView &view, uint8_t *out, size_t size) {
+  auto found = bmc.sessions.find(header.getId());
+  if (found == bmc.sessions.end() ||
+      header.getAuthType() != AUTH_TYPE_MD5 ||
+      header.verify(view, found->second.auth) == Status::Failure ||
+      ipmb.read(view) == Status::Failure) {
+    statistics.rejected++;
+    return 0;
+  }
+  SimulatedSession &session = found->second;
+  const uint32_t id = header.getId();
+
+  if (ipmb.getNetworkFunction() == NetworkFunction::AppRequest &&
+      ipmb.command == ActivateSession::Command::command) {
+    ActivateSession::Request request;
+    if (decodeRequest<ActivateSession::Command>(view, ipmb, request) ==
+            Status::Failure ||
+        memcmp(request.getChallenge(), session.challenge, 16) != 0) {
+      statistics.rejected++;
+      return 0;
+    }
+    ActivateSession::Response response(id, session.inbound_start);
+    if (request.getPrivilege() >
+        (uint8_t)AuthenticationCapability::Administrator) {
+      response.completion_code = 0x86; // Privilege level not available
+    } else if (request.getSequence() == 0) {
+      response.completion_code = 0x84; // Sequence number out of range
+    } else if (!session.active) {
+      // A retransmitted request gets the answer the first one got.
+      session.active = true;
+      session.max_privilege = request.getPrivilege();
+      do {
+        session.inbound_start = random32();
+      } while (session.inbound_start == 0);
+      session.inbound = session.inbound_start - 1;
+      session.outbound = request.getSequence();
+      response.sequence = session.inbound_start;
+      statistics.sessions++;
+    }
+    session.last_seen = now();
+    return encodeResponse<ActivateSession::Command>(out, size, id, 0, ipmb,
+                                                    session.auth, response);
+  }
+
+  // Everything else needs an active session and a fresh sequence number.
+  // Numbers behind the highest seen are let through within a window, for
+  // requests reordered on the way.
+  const uint32_t sequence = header.getSequence();
+  const uint32_t behind = session.inbound - sequence;
+  if (!session.active || sequence == 0 ||
+      (behind < 0x80000000u && behind >= SEQUENCE_WINDOW)) {
+    statistics.rejected++;
+    return 0;
+  }
+  if (behind >= 0x80000000u) {
+    session.inbound = sequence;
+  }
+  session.last_seen = now();
+
+  switch (ipmb.getNetworkFunction()) {
+  case NetworkFunction::AppRequest:
+    if (ipmb.command == SetSessionPrivilege::Command::command) {
+      SetSessionPrivilege::Request request;
+      if (decodeRequest<SetSessionPrivilege::Command>(view, ipmb, request) ==
+          Status::Failure) {
+        return 0;
+      }
+      const uint8_t requested = request.getPrivilege();
+      SetSessionPrivilege::Response response(requested == 0 ? session.privilege
+                                                            : requested);
+      if (requested > session.max_privilege ||
+          (requested != 0 &&
+           requested < (uint8_t)AuthenticationCapability::User)) {
+        response.completion_code = 0x80; // Level not available
+      } else if (requested != 0) {
+        session.privilege = requested;
+      }
+      return encodeResponse<SetSessionPrivilege::Command>(
+          out, size, id, nextSequence(session), ipmb, session.auth, response);
+    }
+    if (ipmb.command == GetDeviceId::Command::command) {
+      GetDeviceId::Request request;
+      if (decodeRequest<GetDeviceId::Command>(view, ipmb, request) ==
+          Status::Failure) {
+        return 0;
+      }
+      GetDeviceId::Response response;
+      response.completion_code = 0;
+      response.device_id = 0x20;
+      response.device_revision = 0x01;
+      response.firmware_major = 1;
+      response.firmware_minor = 0;
+      response.ipmi_version = 0x51;
+      response.additional_support = 0;
+      memset(response.manufacturer_id, 0, 3);
+      memset(response.product_id, 0, 2);
+      return encodeResponse<GetDeviceId::Command>(
+          out, size, id, nextSequence(session), ipmb, session.auth, response);
+    }
+    if (ipmb.command == CloseSession::Command::command) {
+      CloseSession::Request request;
+      if (decodeRequest<CloseSession::Command>(view, ipmb, request) ==
+          Status::Failure) {
+        return 0;
+      }
+      // The reply goes out in the session being closed.
+      const bool own = request.getSessionId() == id;
+      CloseSession::Response response;
+      response.completion_code = own ? 0 : 0x87; // Invalid session ID
+      const size_t length = encodeResponse<CloseSession::Command>(
+          out, size, id, nextSequence(session), ipmb, session.auth, response);
+      if (own) {
+        bmc.sessions.erase(found);
+      }
+      return length;
+    }
+    break;
+
+  case NetworkFunction::ChassisRequest:
+    if (ipmb.command == ChassisControl::Command::command) {
+      ChassisControl::Request request;
+      if (decodeRequest<ChassisControl::Command>(view, ipmb, request) ==
+          Status::Failure) {
+        return 0;
+      }
+      ChassisControl::Response response(0);
+      const uint8_t command = request.getCommand();
+      if (session.privilege < (uint8_t)AuthenticationCapability::Operator) {
+        response.completion_code = 0xd4; // Insufficient privilege
+      } else if (command > (uint8_t)ChassisControlCommand::SoftShutdown) {
+        response.completion_code = 0xcc; // Invalid data field
+      } else if (command == (uint8_t)ChassisControlCommand::PowerDown ||
+                 command == (uint8_t)ChassisControlCommand::SoftShutdown) {
+        bmc.powered = false;
+      } else {
+        bmc.powered = true;
+      }
+      return encodeResponse<ChassisControl::Command>(
+          out, size, id, nextSequence(session), ipmb, session.auth, response);
+    }
+    break;
+
+  case NetworkFunction::StorageRequest:
+    return respondStorage(bmc, session, id, ipmb, view, out, size);
+
+  default:
+    break;
+  }
+  return 0;
+}
+
+// Serves the SDR repository to session `id`.
+size_t Worker::respondStorage(Bmc &bmc, SimulatedSession &session, uint32_t id,
+                              IPMB &ipmb, PacketView &view, uint8_t *out,
+                              size_t size) {
+  switch (ipmb.command) {
+  case GetSdrRepositoryInfo::Command::command: {
+    GetSdrRepositoryInfo::Request request;
+    if (decodeRequest<GetSdrRepositoryInfo::Command>(view, ipmb, request) ==
+        Status::Failure) {
+      return 0;
+    }
+    GetSdrRepositoryInfo::Response response;
+    response.record_count = sdr_repository.size();
+    response.free_space = 0;
+    response.last_addition = sdr_last_addition;
+    response.last_erase = 0xffffffff; // Never
+    response.operations = 0x02;       // Reserve SDR Repository supported
+    return encodeResponse<GetSdrRepositoryInfo::Command>(
+        out, size, id, nextSequence(session), ipmb, session.auth, response);
+  }
+
+  case ReserveSdrRepository::Command::command: {
+    ReserveSdrRepository::Request request;
+    if (decodeRequest<ReserveSdrRepository::Command>(view, ipmb, request) ==
+        Status::Failure) {
+      return 0;
+    }
+    // A new reservation cancels the last one, whoever holds it.
+    if (++bmc.reservation == 0) {
+      bmc.reservation = 1;
+    }
+    ReserveSdrRepository::Response response(bmc.reservation);
+    return encodeResponse<ReserveSdrRepository::Command>(
+        out, size, id, nextSequence(session), ipmb, session.auth, response);
+  }
+
+  case GetSdr::Command::command: {
+    GetSdr::Request request;
+    if (decodeRequest<GetSdr::Command>(view, ipmb, request) ==
+        Status::Failure) {
+      return 0;
+    }
+    GetSdr::Response response;
+    const size_t index = request.getRecord() == GetSdr::FIRST_RECORD
+                             ? 0
+                             : request.getRecord() - 1;
+    if (request.getOffset() != 0 &&
+        request.getReservation() != bmc.reservation) {
+      response.completion_code = 0xc5; // Reservation cancelled
+    } else if (index >= sdr_repository.size()) {
+      response.completion_code = 0xcb; // Record not present
+    } else if (request.getOffset() > sdr_repository[index].size()) {
+      response.completion_code = 0xc9; // Parameter out of range
+    } else if (request.getCount() > bmc.max_sdr_read) {
+      response.completion_code = 0xca; // Cannot return that many bytes
+    } else {
+      const std::vector<uint8_t> &record = sdr_repository[index];
+      response.next_record = index + 1 < sdr_repository.size()
+                                 ? index + 2
+                                 : GetSdr::LAST_RECORD;
+      response.size = std::min<size_t>(request.getCount(),
+                                       record.size() - request.getOffset());
+      memcpy(response.data, &record[request.getOffset()], response.size);
+    }
+    return encodeResponse<GetSdr::Command>(
+        out, size, id, nextSequence(session), ipmb, session.auth, response);
+  }
+
+  default:
+    return 0;
+  }
+}
+
+// Binds the BMC's socket to its port on loopback.
+static bool bind(Bmc &bmc) {
+  bmc.fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+  insist_return(bmc.fd >= 0, false, "socket() failed: %s", strerror(errno));
+  struct sockaddr_in address = {};
+  address.sin_family = AF_INET;
+  address.sin_port = htons(bmc.port);
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  insist_return(
+      ::bind(bmc.fd, (struct sockaddr *)&address, sizeof(address)) == 0,
+      false, "Cannot bind port %d: %s", bmc.port, strerror(errno));
+  return true;
+}
+
+int main(int argc, char **argv) {
+  if (argc < 2 || argc > 3) {
+    printf("Usage: %s <config|-> [threads]\n", argv[0]);
+    return 1;
+  }
+  const size_t threads = argc > 2 && atoi(argv[2]) > 0 ? atoi(argv[2]) : 1;
+
+  std::vector<BmcConfig> configs;
+  if (!readBmcConfig(argv[1], configs)) {
+    return 1;
+  }
+  std::deque<Bmc> bmcs;
+  for (const BmcConfig &config : configs) {
+    bmcs.emplace_back();
+    static_cast<BmcConfig &>(bmcs.back()) = config;
+    static const uint8_t SDR_READ_LIMITS[] = {GetSdr::MAX_IPMI15_READ, 48,
+                                              24};
+    bmcs.back().max_sdr_read = SDR_READ_LIMITS[config.port % 3];
+  }
+  makeSdrRepository();
+
+  // One socket per BMC: thousands of them need more than the usual limit.
+  struct rlimit files;
+  if (getrlimit(RLIMIT_NOFILE, &files) == 0 &&
+      files.rlim_cur < bmcs.size() + 64) {
+    files.rlim_cur = files.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &files);
+  }
+
+  std::deque<Worker> workers;
+  for (size_t i = 0; i < threads; i++) {
+    workers.emplace_back(time(NULL) + i);
+  }
+  for (size_t i = 0; i < bmcs.size(); i++) {
+    if (!bind(bmcs[i])) {
+      return 1;
+    }
+    workers[i % threads].add(&bmcs[i]);
+  }
+  for (Worker &worker : workers) {
+    if (!worker.start()) {
+      return 1;
+    }
+  }
+
+  signal(SIGINT, stop);
+  signal(SIGTERM, stop);
+  printf("Simulating %zu BMCs on %zu threads\n", bmcs.size(), threads);
+  fflush(stdout);
+
+  std::vector<std::thread> running;
+  for (size_t i = 1; i < threads; i++) {
+    running.emplace_back(&Worker::run, &workers[i]);
+  }
+  workers[0].run();
+  for (std::thread &thread : running) {
+    thread.join();
+  }
+
+  Statistics total;
+  for (const Worker &worker : workers) {
+    total.requests += worker.statistics.requests;
+    total.replies += worker.statistics.replies;
+    total.lost += worker.statistics.lost;
+    total.rejected += worker.statistics.rejected;
+    total.sessions += worker.statistics.sessions;
+  }
+  printf("%llu requests, %llu replies, %llu lost, %llu rejected, "
+         "%llu sessions activated\n",
+         (unsigned long long)total.requests,
+         (unsigned long long)total.replies, (unsigned long long)total.lost,
+         (unsigned long long)total.rejected,
+         (unsigned long long)total.sessions);
+  return 0;
+}
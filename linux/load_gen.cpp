@@ -0,0 +1,391 @@
+/*
+    Copyright Jordan Sissel, 2018
+    This file is part of jordansissel/ipmi.
+
+    jordansissel/ipmi is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    jordansissel/ipmi is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with jordansissel/ipmi.  If not, see <http://www.gnu.org/licenses/>.
+  */
+#include "client.h"
+#include "linux/bmc_config.h"
+#include "metrics.h"
+#include "udp_batch_loop.h"
+
+#include <algorithm>
+#include <memory>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+// Drives a fleet of BMCs, normally bmc-sim's, with a mix of operations and
+// reports throughput and latency percentiles for each operation and each
+// handshake stage:
+//
+//   handshake  a new session: a fresh client runs the whole handshake, then
+//              one Get Device ID
+//   chassis    Chassis Control (power up) on an open session
+//   read       Get Device ID on an open session
+//
+// Closed loop (-c) keeps a fixed number of operations outstanding, starting
+// the next as each ends. Open loop (-r) starts operations on a fixed
+// schedule whether or not earlier ones have ended, and times each from when
+// the schedule said it should start rather than when it did. A stall then
+// shows up in the latency of every operation it delayed, not just the one
+// that hit it: the numbers do not suffer from coordinated omission.
+//
+// Chassis control changes power state. Point this at simulators.
+
+using namespace IPMI;
+
+enum class Operation { Handshake, ChassisControl, Read };
+static const size_t OPERATIONS = 3;
+static const char *const operationNames[OPERATIONS] = {"handshake", "chassis",
+                                                       "read"};
+
+// Latencies of one kind of operation or stage, in seconds.
+struct Series {
+  std::string name;
+  std::vector<double> latencies;
+  uint64_t failed = 0;
+};
+
+static double percentile(const std::vector<double> &sorted, double fraction) {
+  if (sorted.empty()) {
+    return 0;
+  }
+  size_t index = (size_t)(fraction * sorted.size());
+  return sorted[index < sorted.size() ? index : sorted.size() - 1];
+}
+
+class LoadGenerator {
+  struct Target {
+    std::string address;
+    uint8_t password[16];
+    // Holds the session that chassis and read operations use.
+    std::unique_ptr<Client> client;
+  };
+
+  UdpBatchLoop &loop;
+  std::vector<Target> targets;
+  unsigned weights[OPERATIONS];
+  unsigned total_weight = 0;
+  size_t next_target = 0;
+  unsigned seed = 1;
+
+  // Clients of finished handshakes, deleted once their callbacks return.
+  std::vector<Client *> finished;
+  size_t handshakes = 0;
+
+  Series operations[OPERATIONS];
+  Series stages[STAGE_METRICS];
+
+  Operation pick();
+  StageObserver observer();
+  void complete(Operation operation, double started, bool succeeded);
+
+public:
+  bool measuring = false;
+  size_t outstanding = 0;
+  size_t completed = 0;
+
+  LoadGenerator(UdpBatchLoop &loop, const std::vector<BmcConfig> &bmcs,
+                const unsigned mix[OPERATIONS]);
+
+  // Opens a session on every target. Returns how many succeeded.
+  size_t warmUp();
+  // Starts one operation, timed from `started` (mg_time() seconds).
+  void start(double started);
+  void poll(int milliseconds);
+  void report(double seconds, FILE *results);
+};
+
+LoadGenerator::LoadGenerator(UdpBatchLoop &loop,
+                             const std::vector<BmcConfig> &bmcs,
+                             const unsigned mix[OPERATIONS])
+    : loop(loop), targets(bmcs.size()) {
+  for (size_t i = 0; i < OPERATIONS; i++) {
+    weights[i] = mix[i];
+    total_weight += mix[i];
+    operations[i].name = operationNames[i];
+  }
+  for (size_t i = 0; i < STAGE_METRICS; i++) {
+    stages[i].name = std::string("stage ") + stateName((ClientState)i);
+  }
+  for (size_t i = 0; i < bmcs.size(); i++) {
+    targets[i].address = "127.0.0.1:" + std::to_string(bmcs[i].port);
+    memcpy(targets[i].password, bmcs[i].password, 16);
+    targets[i].client.reset(new Client(targets[i].password));
+    targets[i].client->setStageObserver(observer());
+    loop.attach(*targets[i].client, targets[i].address.c_str());
+  }
+}
+
+Operation LoadGenerator::pick() {
+  unsigned ticket = rand_r(&seed) % total_weight;
+  for (size_t i = 0; i < OPERATIONS; i++) {
+    if (ticket < weights[i]) {
+      return (Operation)i;
+    }
+    ticket -= weights[i];
+  }
+  return Operation::Read;
+}
+
+StageObserver LoadGenerator::observer() {
+  return [this](ClientState stage, double seconds) {
+    if (measuring) {
+      stages[(size_t)stage].latencies.push_back(seconds);
+    }
+  };
+}
+
+void LoadGenerator::complete(Operation operation, double started,
+                             bool succeeded) {
+  outstanding--;
+  completed++;
+  if (!measuring) {
+    return;
+  }
+  Series &series = operations[(size_t)operation];
+  if (succeeded) {
+    series.latencies.push_back(mg_time() - started);
+  } else {
+    series.failed++;
+  }
+}
+
+size_t LoadGenerator::warmUp() {
+  size_t opened = 0;
+  for (Target &target : targets) {
+    outstanding++;
+    target.client->getDeviceId([this, &opened](const DeviceIdResult &result) {
+      outstanding--;
+      opened += result.status == Status::Success;
+    });
+  }
+  while (outstanding > 0) {
+    poll(100);
+  }
+  return opened;
+}
+
+void LoadGenerator::start(double started) {
+  const Operation operation = pick();
+  Target &target = targets[next_target];
+  next_target = (next_target + 1) % targets.size();
+  outstanding++;
+
+  if (operation == Operation::Handshake) {
+    Client *client = new Client(target.password);
+    client->setStageObserver(observer());
+    if (loop.attach(*client, target.address.c_str()) == Status::Failure) {
+      delete client;
+      complete(operation, started, false);
+      return;
+    }
+    handshakes++;
+    client->getDeviceId([this, client, started](const DeviceIdResult &result) {
+      finished.push_back(client);
+      complete(Operation::Handshake, started,
+               result.status == Status::Success);
+    });
+    return;
+  }
+
+  Status queued;
+  if (operation == Operation::ChassisControl) {
+    queued = target.client->chassisControl(
+        ChassisControlCommand::PowerUp,
+        [this, started](const ChassisControlResult &result) {
+          complete(Operation::ChassisControl, started,
+                   result.status == Status::Success);
+        });
+  } else {
+    queued = target.client->getDeviceId(
+        [this, started](const DeviceIdResult &result) {
+          complete(Operation::Read, started, result.status == Status::Success);
+        });
+  }
+  // The client's queue is full: the fleet is not keeping up.
+  if (queued == Status::Failure) {
+    complete(operation, started, false);
+  }
+}
+
+void LoadGenerator::poll(int milliseconds) {
+  loop.poll(milliseconds);
+  for (Client *client : finished) {
+    loop.detach(*client);
+    delete client;
+  }
+  finished.clear();
+}
+
+void LoadGenerator::report(double seconds, FILE *results) {
+  printf("%-36s %10s %8s %10s %9s %9s %9s %9s\n", "", "count", "failed",
+         "ops/sec", "p50 ms", "p99 ms", "p999 ms", "max ms");
+  std::vector<Series *> all;
+  for (Series &series : operations) {
+    all.push_back(&series);
+  }
+  for (Series &series : stages) {
+    all.push_back(&series);
+  }
+  for (Series *series : all) {
+    std::vector<double> &sorted = series->latencies;
+    if (sorted.empty() && series->failed == 0) {
+      continue;
+    }
+    std::sort(sorted.begin(), sorted.end());
+    const double rate = sorted.size() / seconds;
+    const double p50 = percentile(sorted, 0.5) * 1e3;
+    const double p99 = percentile(sorted, 0.99) * 1e3;
+    const double p999 = percentile(sorted, 0.999) * 1e3;
+    const double max = sorted.empty() ? 0 : sorted.back() * 1e3;
+    printf("%-36s %10zu %8llu %10.1f %9.3f %9.3f %9.3f %9.3f\n",
+           series->name.c_str(), sorted.size(),
+           (unsigned long long)series->failed, rate, p50, p99, p999, max);
+    if (results != NULL) {
+      fprintf(results,
+              "{\"name\":\"%s\",\"count\":%zu,\"failed\":%llu,"
+              "\"ops_per_sec\":%.3f,\"p50_ms\":%.3f,\"p99_ms\":%.3f,"
+              "\"p999_ms\":%.3f,\"max_ms\":%.3f}\n",
+              series->name.c_str(), sorted.size(),
+              (unsigned long long)series->failed, rate, p50, p99, p999, max);
+    }
+  }
+}
+
+static void usage(const char *program) {
+  printf("Usage: %s [-c concurrency | -r ops/sec] [-d seconds] "
+         "[-m handshake:chassis:read] [-o results.jsonl] <config|->\n",
+         program);
+}
+
+int main(int argc, char **argv) {
+  size_t concurrency = 64;
+  double rate = 0;
+  double duration = 10;
+  unsigned mix[OPERATIONS] = {1, 1, 1};
+  const char *output = NULL;
+
+  int option;
+  while ((option = getopt(argc, argv, "c:r:d:m:o:")) != -1) {
+    switch (option) {
+    case 'c':
+      concurrency = atoi(optarg);
+      break;
+    case 'r':
+      rate = atof(optarg);
+      break;
+    case 'd':
+      duration = atof(optarg);
+      break;
+    case 'm':
+      if (sscanf(optarg, "%u:%u:%u", &mix[0], &mix[1], &mix[2]) != 3) {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+    case 'o':
+      output = optarg;
+      break;
+    default:
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  if (optind != argc - 1 || mix[0] + mix[1] + mix[2] == 0 ||
+      (rate <= 0 && concurrency == 0) || duration <= 0) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  std::vector<BmcConfig> bmcs;
+  if (!readBmcConfig(argv[optind], bmcs)) {
+    return 1;
+  }
+  if (bmcs.empty()) {
+    printf("No BMCs in %s\n", argv[optind]);
+    return 1;
+  }
+  for (const BmcConfig &bmc : bmcs) {
+    if (strcmp((const char *)bmc.user, "root") != 0) {
+      printf("Warning: clients log in as root, so BMCs with other users, "
+             "such as port %d, will refuse them\n",
+             bmc.port);
+      break;
+    }
+  }
+
+  FILE *results = NULL;
+  if (output != NULL && (results = fopen(output, "w")) == NULL) {
+    printf("Cannot write %s: %s\n", output, strerror(errno));
+    return 1;
+  }
+
+  UdpBatchLoop loop;
+  if (loop.open(4) == Status::Failure) {
+    return 1;
+  }
+  LoadGenerator generator(loop, bmcs, mix);
+  const size_t opened = generator.warmUp();
+  printf("%zu of %zu sessions open\n", opened, bmcs.size());
+  if (rate > 0) {
+    printf("Open loop at %.0f ops/sec for %.0fs\n", rate, duration);
+  } else {
+    printf("Closed loop, %zu outstanding, for %.0fs\n", concurrency,
+           duration);
+  }
+  fflush(stdout);
+
+  generator.measuring = true;
+  const double begin = mg_time();
+  const double end = begin + duration;
+  uint64_t scheduled = 0;
+  for (double now = begin; now < end; now = mg_time()) {
+    int wait = 100;
+    if (rate > 0) {
+      // Start everything the schedule has come to, each timed from its slot.
+      double due = begin + scheduled / rate;
+      while (due <= now) {
+        generator.start(due);
+        due = begin + ++scheduled / rate;
+      }
+      wait = std::min(wait, (int)((due - now) * 1e3));
+    } else {
+      while (generator.outstanding < concurrency) {
+        generator.start(now);
+      }
+    }
+    generator.poll(wait);
+  }
+
+  // Let what was started finish, for at most as long again.
+  const double drain = mg_time() + duration;
+  while (generator.outstanding > 0 && mg_time() < drain) {
+    generator.poll(100);
+  }
+  const size_t unfinished = generator.outstanding;
+  generator.measuring = false;
+
+  generator.report(duration, results);
+  if (unfinished > 0) {
+    printf("%zu operations still unfinished\n", unfinished);
+  }
+  if (results != NULL) {
+    fclose(results);
+  }
+  return 0;
+}
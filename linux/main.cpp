@@ -23,45 +23,68 @@
 #include <string.h>
 #include <sys/socket.h>
 
-#include "client.h"
+#include "client_manager.h"
 #include "ipmi.h"
+#include "metrics.h"
+#include "trace.h"
 
 int mgos(int argc, char **argv) {
-  if (argc != 3) {
-    printf("Usage: %s <host> <password>\n", argv[0]);
+  if (argc != 3 && !(argc == 4 && strcmp(argv[3], "lanplus") == 0)) {
+    printf("Usage: %s <host>[,<host>...] <password> [lanplus]\n", argv[0]);
     return 1;
   }
 
-  const auto hostname = argv[1];
   uint8_t password[16] = {};
   strncpy((char *)password, argv[2], 16);
 
-  auto client = new IPMI::Client(password);
-
   struct mg_mgr mgr;
   mg_mgr_init(&mgr, NULL);
 
-  struct mg_connect_opts opts = {.user_data = client};
-
-  char *address;
-  asprintf(&address, "udp://%s:623", hostname);
-
-  auto conn =
-      mg_connect_opt(&mgr, address, ipmi_client_connection_handler, opts);
-  free(address);
-  client->setConnection(conn);
+  // Prometheus metrics while the commands run, e.g. IPMI_METRICS=9623.
+  const char *metrics = getenv("IPMI_METRICS");
+  if (metrics != NULL && IPMI::Metrics::serve(&mgr, metrics) == NULL) {
+    printf("Cannot serve metrics on %s\n", metrics);
+  }
 
-  client->chassisControl(IPMI::ChassisControlCommand::PowerUp);
+  IPMI::ClientManager manager(&mgr);
+  if (argc == 4) {
+    manager.useLanplus(IPMI::Lanplus::CIPHER_SUITE_3);
+  }
+  for (char *host = strtok(argv[1], ","); host != NULL;
+       host = strtok(NULL, ",")) {
+    // Per-host latencies for the first HOST_METRICS hosts.
+    if (metrics != NULL) {
+      IPMI::Metrics::watchHost(host);
+    }
+    manager.add(host, password);
+  }
 
-  for (;;) { // Start infinite event loop
-    // if (client->getState() == IPMI::ClientState::NeedChassisControlResponse)
-    // { break;
-    // }
-    mg_mgr_poll(&mgr, 1000);
+  manager.chassisControl(IPMI::ChassisControlCommand::PowerUp,
+                         [](const char *host, IPMI::Status status) {
+                           printf("%s: %s\n", host,
+                                  status == IPMI::Status::Success ? "done"
+                                                                  : "failed");
+                         });
+  while (!manager.done()) {
+    manager.poll(1000);
   }
+  printf("%zu succeeded, %zu failed\n", manager.succeededCount(),
+         manager.failedCount());
+
+  // Read it with trace-decode.
+  const char *trace = getenv("IPMI_TRACE");
+  if (trace != NULL) {
+    FILE *out = fopen(trace, "wb");
+    if (out == NULL || !IPMI::Trace::dump(out)) {
+      printf("Cannot write the trace to %s\n", trace);
+    }
+    if (out != NULL) {
+      fclose(out);
+    }
+  }
+
   mg_mgr_free(&mgr);
-  delete client;
-  return 0;
+  return manager.failedCount() == 0 ? 0 : 1;
 }
 
 int posix(int argc, char **argv) {
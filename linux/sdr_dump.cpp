@@ -0,0 +1,106 @@
+/*
+    Copyright Jordan Sissel, 2018
+    This file is part of jordansissel/ipmi.
+
+    jordansissel/ipmi is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    jordansissel/ipmi is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with jordansissel/ipmi.  If not, see <http://www.gnu.org/licenses/>.
+  */
+#include "sdr.h"
+#include "udp_batch_loop.h"
+
+#include <memory>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+// Prints a BMC's Sensor Data Records, and how they were had: by walking the
+// repository, with the number of requests that took and the partial read
+// size the BMC allowed, or from the cache directory if one is given and the
+// repository has not changed since the last walk. Logs in as root.
+
+using namespace IPMI;
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void print(const SdrRecord *records, size_t count) {
+  printf("%-6s %-4s %-5s %-4s %-7s %-6s %-5s %s\n", "id", "type", "owner",
+         "num", "entity", "sensor", "unit", "name");
+  for (size_t i = 0; i < count; i++) {
+    const SdrRecord &record = records[i];
+    printf("%04x   %02x   %02x    %02x   %02x.%-4u %02x     %-5u %s\n",
+           record.id, record.type, record.owner, record.number,
+           record.entity_id, record.entity_instance, record.sensor_type,
+           record.base_unit, record.name);
+  }
+}
+
+int main(int argc, char **argv) {
+  if (argc < 3 || argc > 4) {
+    printf("Usage: %s <host[:port]> <password> [cache directory]\n", argv[0]);
+    return 1;
+  }
+
+  UdpBatchLoop loop;
+  if (loop.open() == Status::Failure) {
+    return 1;
+  }
+  uint8_t password[16] = {};
+  strncpy((char *)password, argv[2], sizeof(password));
+  Client client(password);
+  if (loop.attach(client, argv[1]) == Status::Failure) {
+    return 1;
+  }
+
+  SdrReader reader(client);
+  std::unique_ptr<SdrCache> cache;
+  if (argc > 3) {
+    cache.reset(new SdrCache(argv[3]));
+    reader.useCache(*cache, argv[1]);
+  }
+
+  bool finished = false;
+  Status result = Status::Failure;
+  size_t found = 0;
+  const double started = now();
+  if (reader.read([&](Status status, const SdrRecord *records,
+                      size_t count) {
+        finished = true;
+        result = status;
+        found = count;
+        if (status == Status::Success) {
+          print(records, count);
+        }
+      }) == Status::Failure) {
+    return 1;
+  }
+  while (!finished) {
+    loop.poll(100);
+  }
+
+  const SdrReader::Statistics &stats = reader.statistics();
+  if (result == Status::Failure) {
+    fprintf(stderr, "Reading the SDR repository failed after %u requests\n",
+            stats.requests);
+    return 1;
+  }
+  fprintf(stderr, "%zu records from the %s in %.1f ms: %u requests, ", found,
+          stats.cached ? "cache" : "repository", (now() - started) * 1000,
+          stats.requests);
+  fprintf(stderr, "%u reservations, %u smaller reads, read size %u\n",
+          stats.reservations, stats.shrinks, reader.readSize());
+  return 0;
+}
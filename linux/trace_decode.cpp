@@ -0,0 +1,160 @@
+/*
+    Copyright Jordan Sissel, 2018
+    This file is part of jordansissel/ipmi.
+
+    jordansissel/ipmi is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    jordansissel/ipmi is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with jordansissel/ipmi.  If not, see <http://www.gnu.org/licenses/>.
+  */
+#include "client.h"
+#include "trace.h"
+
+#include <algorithm>
+#include <string.h>
+#include <vector>
+
+// Prints a trace file written by IPMI::Trace::dump() as text, every thread's
+// events merged in time order.
+
+using IPMI::TraceEvent;
+using IPMI::TraceRecord;
+
+struct Entry {
+  uint64_t thread;
+  TraceRecord record;
+};
+
+static const char *levelName(uint8_t level) {
+  switch (level) {
+  case IPMI_TRACE_ERROR:
+    return "error";
+  case IPMI_TRACE_WARN:
+    return "warn";
+  case IPMI_TRACE_INFO:
+    return "info";
+  case IPMI_TRACE_DEBUG:
+    return "debug";
+  }
+  return "?";
+}
+
+static const char *state(uint32_t value) {
+  return IPMI::stateName((IPMI::ClientState)value);
+}
+
+static const char *abortReason(uint32_t value) {
+  switch ((IPMI::TraceAbort)value) {
+  case IPMI::TraceAbort::ChannelAuthenticationCapabilities:
+    return "ChannelAuthenticationCapabilities request failed";
+  case IPMI::TraceAbort::NoIPMI20:
+    return "no IPMI 2.0 support";
+  case IPMI::TraceAbort::NoMD5:
+    return "no MD5 authcode support";
+  }
+  return "unknown reason";
+}
+
+static void print(const Entry &entry, uint64_t start) {
+  const TraceRecord &r = entry.record;
+  printf("%16.9f thread %llu %#llx %-5s ", (r.nanoseconds - start) / 1e9,
+         (unsigned long long)entry.thread, (unsigned long long)r.object,
+         levelName(r.level));
+  switch ((TraceEvent)r.event) {
+  case TraceEvent::State:
+    printf("state %s -> %s\n", state(r.a), state(r.b));
+    return;
+  case TraceEvent::Send:
+  case TraceEvent::Receive:
+    printf("%s %u bytes, session %08x, %s %02x\n",
+           r.event == (uint8_t)TraceEvent::Send ? "send" : "receive", r.a,
+           r.b, r.c & 0x100 ? "payload" : "command", r.c & 0xff);
+    return;
+  case TraceEvent::Timeout:
+    printf("timeout in %s\n", state(r.a));
+    return;
+  case TraceEvent::Retry:
+    printf("bad reply in %s, %u failures\n", state(r.a), r.b);
+    return;
+  case TraceEvent::GiveUp:
+    printf("gave up in %s after %u failures\n", state(r.a), r.b);
+    return;
+  case TraceEvent::Abort:
+    printf("abort: %s\n", abortReason(r.a));
+    return;
+  case TraceEvent::Refused:
+    printf("chassis control %u refused, completion code %02x\n", r.a, r.b);
+    return;
+  case TraceEvent::Session:
+    printf("session %08x, sequence %08x\n", r.a, r.b);
+    return;
+  case TraceEvent::Connect:
+    printf("connect\n");
+    return;
+  case TraceEvent::Close:
+    printf("close\n");
+    return;
+  case TraceEvent::Dropped:
+    printf("dropped %u bytes\n", r.a);
+    return;
+  }
+  printf("event %u: %08x %08x %08x\n", r.event, r.a, r.b, r.c);
+}
+
+int main(int argc, char **argv) {
+  if (argc != 2) {
+    printf("Usage: %s <trace file>\n", argv[0]);
+    return 1;
+  }
+  FILE *in = fopen(argv[1], "rb");
+  if (in == NULL) {
+    printf("Cannot open %s: %s\n", argv[1], strerror(errno));
+    return 1;
+  }
+
+  IPMI::TraceFileHeader header;
+  if (fread(&header, sizeof(header), 1, in) != 1 ||
+      memcmp(header.magic, IPMI::TRACE_MAGIC, sizeof(header.magic)) != 0 ||
+      header.record_size != sizeof(TraceRecord)) {
+    printf("%s is not a trace file from this version\n", argv[1]);
+    return 1;
+  }
+
+  std::vector<Entry> entries;
+  for (uint32_t i = 0; i < header.rings; i++) {
+    IPMI::TraceRingHeader ring;
+    if (fread(&ring, sizeof(ring), 1, in) != 1) {
+      printf("%s is truncated\n", argv[1]);
+      return 1;
+    }
+    for (uint64_t j = 0; j < ring.records; j++) {
+      Entry entry;
+      entry.thread = ring.thread;
+      if (fread(&entry.record, sizeof(entry.record), 1, in) != 1) {
+        printf("%s is truncated\n", argv[1]);
+        return 1;
+      }
+      entries.push_back(entry);
+    }
+  }
+  fclose(in);
+
+  // Each ring is in order already; merge them.
+  std::stable_sort(entries.begin(), entries.end(),
+                   [](const Entry &a, const Entry &b) {
+                     return a.record.nanoseconds < b.record.nanoseconds;
+                   });
+  const uint64_t start = entries.empty() ? 0 : entries[0].record.nanoseconds;
+  for (const Entry &entry : entries) {
+    print(entry, start);
+  }
+  return 0;
+}
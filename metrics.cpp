@@ -0,0 +1,327 @@
+/*
+    Copyright Jordan Sissel, 2018
+    This file is part of jordansissel/ipmi.
+
+    jordansissel/ipmi is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    jordansissel/ipmi is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with jordansissel/ipmi.  If not, see <http://www.gnu.org/licenses/>.
+  */
+#include "metrics.h"
+#include "client.h"
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+namespace IPMI {
+namespace Metrics {
+static_assert(STAGE_METRICS == (size_t)ClientState::SessionReady + 1,
+              "One stage histogram per ClientState");
+
+// Histogram bucket upper bounds, in seconds. One more bucket, +Inf, holds
+// the rest.
+static const double BOUNDS[] = {0.0005, 0.001, 0.0025, 0.005, 0.01,
+                                0.025,  0.05,  0.1,    0.25,  0.5,
+                                1,      2.5,   5,      10};
+static const char *const BOUND_NAMES[] = {
+    "0.0005", "0.001", "0.0025", "0.005", "0.01", "0.025", "0.05", "0.1",
+    "0.25",   "0.5",   "1",      "2.5",   "5",    "10",    "+Inf"};
+static const size_t BUCKETS = sizeof(BOUNDS) / sizeof(BOUNDS[0]) + 1;
+
+// Only the owning thread writes a Shard, so a load and a store make an
+// increment; they are atomic so that format() may read them meanwhile.
+static void add(std::atomic<uint64_t> &value, uint64_t amount) {
+  value.store(value.load(std::memory_order_relaxed) + amount,
+              std::memory_order_relaxed);
+}
+
+struct Histogram {
+  // Not cumulative; format() adds them up.
+  std::atomic<uint64_t> buckets[BUCKETS];
+  std::atomic<uint64_t> count;
+  std::atomic<uint64_t> nanoseconds;
+
+  void observe(double seconds) {
+    size_t bucket = 0;
+    while (bucket < BUCKETS - 1 && seconds > BOUNDS[bucket]) {
+      bucket++;
+    }
+    add(buckets[bucket], 1);
+    add(count, 1);
+    add(nanoseconds, seconds > 0 ? (uint64_t)(seconds * 1e9) : 0);
+  }
+};
+
+// Zeroed by value-initialization: new Shard().
+struct Shard {
+  std::atomic<uint64_t> counters[COUNTERS];
+  Histogram stages[STAGE_METRICS];
+  Histogram commands[COMMAND_METRICS];
+  Histogram hosts[HOST_METRICS];
+};
+
+// Every thread's shard, kept after the thread exits so its counts stay in
+// the totals. Threads only take the lock to add theirs.
+static std::mutex shards_lock;
+static std::vector<Shard *> shards;
+
+static Shard &shard() {
+  static thread_local Shard *mine = nullptr;
+  if (mine == nullptr) {
+    Shard *made = new Shard();
+    std::lock_guard<std::mutex> lock(shards_lock);
+    shards.push_back(made);
+    mine = made;
+  }
+  return *mine;
+}
+
+void count(Counter counter, uint64_t amount) {
+  add(shard().counters[(size_t)counter], amount);
+}
+
+// Watched host names, by index. Only ever appended to, under shards_lock.
+static std::vector<std::string> watched;
+
+static void observeHost(Shard &s, int host, double seconds) {
+  if (host >= 0 && (size_t)host < HOST_METRICS) {
+    s.hosts[host].observe(seconds);
+  }
+}
+
+void observeStage(uint8_t stage, double seconds, int host) {
+  if (stage < STAGE_METRICS) {
+    Shard &s = shard();
+    s.stages[stage].observe(seconds);
+    observeHost(s, host, seconds);
+  }
+}
+
+void observeCommand(CommandMetric command, double seconds, int host) {
+  Shard &s = shard();
+  s.commands[(size_t)command].observe(seconds);
+  observeHost(s, host, seconds);
+}
+
+// Hosts are addresses; anything that would need escaping in a label, or
+// overflow append()'s line, is refused.
+static const size_t HOST_NAME_SIZE = 128;
+
+int watchHost(const char *host) {
+  if (strlen(host) >= HOST_NAME_SIZE || strpbrk(host, "\\\"\n") != NULL) {
+    return -1;
+  }
+  std::lock_guard<std::mutex> lock(shards_lock);
+  for (size_t i = 0; i < watched.size(); i++) {
+    if (watched[i] == host) {
+      return i;
+    }
+  }
+  if (watched.size() >= HOST_METRICS) {
+    return -1;
+  }
+  watched.push_back(host);
+  return watched.size() - 1;
+}
+
+int hostIndex(const char *host) {
+  std::lock_guard<std::mutex> lock(shards_lock);
+  for (size_t i = 0; i < watched.size(); i++) {
+    if (watched[i] == host) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+// A histogram summed over every shard.
+struct Totals {
+  uint64_t buckets[BUCKETS] = {};
+  uint64_t count = 0;
+  uint64_t nanoseconds = 0;
+
+  void add(const Histogram &histogram) {
+    for (size_t i = 0; i < BUCKETS; i++) {
+      buckets[i] += histogram.buckets[i].load(std::memory_order_relaxed);
+    }
+    count += histogram.count.load(std::memory_order_relaxed);
+    nanoseconds += histogram.nanoseconds.load(std::memory_order_relaxed);
+  }
+};
+
+static void append(std::string &out, const char *format, ...)
+    __attribute__((format(printf, 2, 3)));
+static void append(std::string &out, const char *format, ...) {
+  char line[256];
+  va_list args;
+  va_start(args, format);
+  const int length = vsnprintf(line, sizeof(line), format, args);
+  va_end(args);
+  if (length > 0) {
+    out.append(line, std::min((size_t)length, sizeof(line) - 1));
+  }
+}
+
+static void appendHistogram(std::string &out, const char *name,
+                            const char *label, const char *value,
+                            const Totals &totals) {
+  uint64_t cumulative = 0;
+  for (size_t i = 0; i < BUCKETS; i++) {
+    cumulative += totals.buckets[i];
+    append(out, "%s_bucket{%s=\"%s\",le=\"%s\"} %llu\n", name, label, value,
+           BOUND_NAMES[i], (unsigned long long)cumulative);
+  }
+  append(out, "%s_sum{%s=\"%s\"} %.9f\n", name, label, value,
+         totals.nanoseconds / 1e9);
+  append(out, "%s_count{%s=\"%s\"} %llu\n", name, label, value,
+         (unsigned long long)totals.count);
+}
+
+static const struct {
+  Counter counter;
+  const char *name;
+  const char *help;
+} COUNTER_NAMES[] = {
+    {Counter::PacketsSent, "ipmi_packets_sent_total",
+     "Packets sent to BMCs, retransmissions included."},
+    {Counter::BytesSent, "ipmi_sent_bytes_total",
+     "Bytes of IPMI packets sent to BMCs."},
+    {Counter::PacketsReceived, "ipmi_packets_received_total",
+     "Packets received from BMCs."},
+    {Counter::BytesReceived, "ipmi_received_bytes_total",
+     "Bytes of IPMI packets received from BMCs."},
+    {Counter::Retransmits, "ipmi_retransmits_total",
+     "Packets sent again after a timeout."},
+    {Counter::Timeouts, "ipmi_timeouts_total",
+     "Requests unanswered after every retry."},
+    {Counter::DecodeFailures, "ipmi_decode_failures_total",
+     "Received packets that did not decode or answered nothing outstanding."},
+    {Counter::ChecksumFailures, "ipmi_checksum_failures_total",
+     "Received IPMB messages with a bad checksum."},
+    {Counter::GiveUps, "ipmi_give_ups_total",
+     "Times a client failed too often and dropped its queued commands."},
+    {Counter::SessionsOpened, "ipmi_sessions_opened_total",
+     "Sessions established."},
+};
+static_assert(sizeof(COUNTER_NAMES) / sizeof(COUNTER_NAMES[0]) == COUNTERS,
+              "Every counter needs a name");
+
+std::string format() {
+  uint64_t counters[COUNTERS] = {};
+  Totals stages[STAGE_METRICS];
+  Totals commands[COMMAND_METRICS];
+  Totals hosts[HOST_METRICS];
+  std::vector<std::string> names;
+  {
+    std::lock_guard<std::mutex> lock(shards_lock);
+    names = watched;
+    for (const Shard *s : shards) {
+      for (size_t i = 0; i < COUNTERS; i++) {
+        counters[i] += s->counters[i].load(std::memory_order_relaxed);
+      }
+      for (size_t i = 0; i < STAGE_METRICS; i++) {
+        stages[i].add(s->stages[i]);
+      }
+      for (size_t i = 0; i < COMMAND_METRICS; i++) {
+        commands[i].add(s->commands[i]);
+      }
+      for (size_t i = 0; i < names.size(); i++) {
+        hosts[i].add(s->hosts[i]);
+      }
+    }
+  }
+
+  std::string out;
+  for (const auto &counter : COUNTER_NAMES) {
+    append(out, "# HELP %s %s\n# TYPE %s counter\n%s %llu\n", counter.name,
+           counter.help, counter.name, counter.name,
+           (unsigned long long)counters[(size_t)counter.counter]);
+  }
+
+  append(out, "# HELP ipmi_stage_seconds Handshake stages, from the first "
+              "transmission of their request to its reply.\n"
+              "# TYPE ipmi_stage_seconds histogram\n");
+  for (size_t i = 0; i < STAGE_METRICS; i++) {
+    const ClientState stage = (ClientState)i;
+    if (stage != ClientState::Initial && stage != ClientState::SessionReady) {
+      appendHistogram(out, "ipmi_stage_seconds", "stage", stateName(stage),
+                      stages[i]);
+    }
+  }
+
+  append(out, "# HELP ipmi_command_seconds Commands within a session, from "
+              "their first transmission to their reply.\n"
+              "# TYPE ipmi_command_seconds histogram\n");
+  appendHistogram(out, "ipmi_command_seconds", "command", "ChassisControl",
+                  commands[(size_t)CommandMetric::ChassisControl]);
+  appendHistogram(out, "ipmi_command_seconds", "command", "GetDeviceId",
+                  commands[(size_t)CommandMetric::GetDeviceId]);
+  appendHistogram(out, "ipmi_command_seconds", "command", "Keepalive",
+                  commands[(size_t)CommandMetric::Keepalive]);
+  appendHistogram(out, "ipmi_command_seconds", "command", "Custom",
+                  commands[(size_t)CommandMetric::Custom]);
+  appendHistogram(out, "ipmi_command_seconds", "command", "CloseSession",
+                  commands[(size_t)CommandMetric::CloseSession]);
+
+  if (!names.empty()) {
+    append(out, "# HELP ipmi_host_request_seconds Handshake stages and "
+                "commands sent to each watched host, from first "
+                "transmission to reply.\n"
+                "# TYPE ipmi_host_request_seconds histogram\n");
+  }
+  for (size_t i = 0; i < names.size(); i++) {
+    appendHistogram(out, "ipmi_host_request_seconds", "host",
+                    names[i].c_str(), hosts[i]);
+  }
+  return out;
+}
+
+static void respond(struct mg_connection *nc, int ev, void *ev_data) {
+  if (ev != MG_EV_HTTP_REQUEST) {
+    return;
+  }
+  const struct http_message *request = (const struct http_message *)ev_data;
+  if (mg_vcmp(&request->uri, "/metrics") != 0) {
+    mg_send_head(nc, 404, 0, NULL);
+  } else {
+    const std::string body = format();
+    mg_send_head(nc, 200, body.size(),
+                 "Content-Type: text/plain; version=0.0.4");
+    mg_send(nc, body.data(), body.size());
+  }
+  nc->flags |= MG_F_SEND_AND_CLOSE;
+}
+
+#if CS_PLATFORM == CS_P_UNIX || CS_PLATFORM == CS_P_WINDOWS
+struct mg_connection *serve(struct mg_mgr *mgr, const char *address) {
+  struct mg_connection *listener = mg_bind(mgr, address, respond);
+#else
+static void respond(struct mg_connection *nc, int ev, void *ev_data,
+                    void *user_data) {
+  respond(nc, ev, ev_data);
+  (void)user_data;
+}
+
+struct mg_connection *serve(struct mg_mgr *mgr, const char *address) {
+  struct mg_connection *listener = mg_bind(mgr, address, respond, NULL);
+#endif
+  if (listener != NULL) {
+    mg_set_protocol_http_websocket(listener);
+  }
+  return listener;
+}
+} // namespace Metrics
+} // namespace IPMI
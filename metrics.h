@@ -0,0 +1,91 @@
+/*
+    Copyright Jordan Sissel, 2018
+    This file is part of jordansissel/ipmi.
+
+    jordansissel/ipmi is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    jordansissel/ipmi is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with jordansissel/ipmi.  If not, see <http://www.gnu.org/licenses/>.
+  */
+#pragma once
+#include "mongoose.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+
+namespace IPMI {
+// Counted events, summed over every client in the process. Values index the
+// per-thread tables: append only.
+enum class Counter : uint8_t {
+  // Retransmissions included.
+  PacketsSent,
+  BytesSent,
+  PacketsReceived,
+  BytesReceived,
+  // Packets sent again after a timeout.
+  Retransmits,
+  // Requests unanswered after every retry.
+  Timeouts,
+  // Received packets that did not decode or did not answer anything
+  // outstanding. Checksum failures are among them.
+  DecodeFailures,
+  ChecksumFailures,
+  // Clients that failed too many times and dropped their queued commands.
+  GiveUps,
+  SessionsOpened,
+};
+static const size_t COUNTERS = (size_t)Counter::SessionsOpened + 1;
+
+// Commands sent within a session, for Metrics::observeCommand().
+enum class CommandMetric : uint8_t {
+  ChassisControl,
+  GetDeviceId,
+  Keepalive,
+  // Client::request().
+  Custom,
+  CloseSession
+};
+static const size_t COMMAND_METRICS = (size_t)CommandMetric::CloseSession + 1;
+
+// One per ClientState, for Metrics::observeStage().
+static const size_t STAGE_METRICS = 9;
+
+// At most this many hosts get histograms of their own. Each costs one per
+// thread, and one series per bucket on every scrape, so the set is bounded.
+static const size_t HOST_METRICS = 64;
+
+// Process-wide counters and latency histograms. Each thread updates its own
+// copy without atomic read-modify-writes or locks; readers add the copies up.
+namespace Metrics {
+void count(Counter counter, uint64_t amount = 1);
+// How long a handshake stage took: from its request's first transmission to
+// the reply that ended it, retries included. `stage` is a ClientState.
+// `host` is a watchHost() index, or -1.
+void observeStage(uint8_t stage, double seconds, int host = -1);
+// How long a command took, from its first transmission to its reply.
+void observeCommand(CommandMetric command, double seconds, int host = -1);
+
+// Gives `host` a latency histogram of its own, labelled with it, so that a
+// slow BMC stands out. Returns its index, for Client::setMetricsHost(), or -1
+// once HOST_METRICS are watched or if the name cannot be a label value.
+// Watching a host twice returns the same index.
+int watchHost(const char *host);
+// The index watchHost() gave `host`, or -1.
+int hostIndex(const char *host);
+
+// Every metric in the Prometheus text format, version 0.0.4.
+std::string format();
+
+// Answers GET /metrics with format() on `address`, an HTTP listener added to
+// `mgr`. Returns NULL if it cannot listen.
+struct mg_connection *serve(struct mg_mgr *mgr, const char *address);
+} // namespace Metrics
+} // namespace IPMI
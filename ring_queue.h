@@ -0,0 +1,74 @@
+/*
+    Copyright Jordan Sissel, 2018
+    This file is part of jordansissel/ipmi.
+
+    jordansissel/ipmi is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    jordansissel/ipmi is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with jordansissel/ipmi.  If not, see <http://www.gnu.org/licenses/>.
+  */
+#pragma once
+#include <stddef.h>
+#include <utility>
+
+namespace IPMI {
+// First-in first-out queue of at most Capacity records, stored inline. It
+// never allocates: a full queue refuses more records, and the caller decides
+// what to do with them. Capacity must be a power of two.
+template <class T, size_t Capacity> class RingQueue {
+  static_assert(Capacity > 0 && (Capacity & (Capacity - 1)) == 0,
+                "RingQueue capacity must be a power of two");
+
+  T items[Capacity];
+  size_t head = 0;
+  size_t count = 0;
+
+  static size_t wrap(size_t index) { return index & (Capacity - 1); }
+
+public:
+  static constexpr size_t capacity() { return Capacity; }
+  size_t size() const { return count; }
+  bool empty() const { return count == 0; }
+  bool full() const { return count == Capacity; }
+
+  T &front() { return items[head]; }
+
+  // Both return false, leaving the queue unchanged, when it is full.
+  bool push_back(T item) {
+    if (full()) {
+      return false;
+    }
+    items[wrap(head + count)] = std::move(item);
+    count++;
+    return true;
+  }
+
+  bool push_front(T item) {
+    if (full()) {
+      return false;
+    }
+    head = wrap(head + Capacity - 1);
+    items[head] = std::move(item);
+    count++;
+    return true;
+  }
+
+  // Resets the slot, so that whatever the record holds (such as a callback's
+  // captures) is released now rather than when the slot is reused.
+  T pop_front() {
+    T item = std::move(items[head]);
+    items[head] = T();
+    head = wrap(head + 1);
+    count--;
+    return item;
+  }
+};
+}; // namespace IPMI
@@ -0,0 +1,474 @@
+/*
+    Copyright Jordan Sissel, 2018
+    This file is part of jordansissel/ipmi.
+
+    jordansissel/ipmi is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    jordansissel/ipmi is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with jordansissel/ipmi.  If not, see <http://www.gnu.org/licenses/>.
+  */
+#include "sdr.h"
+#include "insist.h"
+#include "trace.h"
+
+#include <algorithm>
+#include <ctype.h>
+#include <stdio.h>
+#include <string.h>
+
+#ifdef __linux__
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace IPMI {
+// M and B are 10-bit two's complement, split over two bytes.
+static int16_t tenBits(uint8_t low, uint8_t high) {
+  const int16_t value = low | (high & 0xc0) << 2;
+  return value & 0x200 ? value - 0x400 : value;
+}
+
+static int8_t fourBits(uint8_t nibble) {
+  const int8_t value = nibble & 0x0f;
+  return value & 0x08 ? value - 0x10 : value;
+}
+
+// Offsets below count from 0, where the specification counts from 1.
+Status SdrRecord::parse(const uint8_t *bytes, size_t size) {
+  insist_return(size >= GetSdr::HEADER_SIZE && size <= MAX_SIZE &&
+                    size == GetSdr::HEADER_SIZE + (size_t)bytes[4],
+                Status::Failure, "SDR record of %zd bytes has a bad length",
+                size);
+  memset(this, 0, sizeof(*this));
+  memcpy(raw, bytes, size);
+  this->size = size;
+  id = bytes[0] | bytes[1] << 8;
+  version = bytes[2];
+  type = bytes[3];
+
+  size_t name_at = 0;
+  switch ((SdrType)type) {
+  case SdrType::FullSensor:
+  case SdrType::CompactSensor:
+    if (size < (type == (uint8_t)SdrType::FullSensor ? 48 : 32)) {
+      break;
+    }
+    owner = bytes[5];
+    lun = bytes[6] & 0x03;
+    number = bytes[7];
+    entity_id = bytes[8];
+    entity_instance = bytes[9];
+    sensor_type = bytes[12];
+    reading_type = bytes[13];
+    if (type == (uint8_t)SdrType::CompactSensor) {
+      name_at = 31;
+      break;
+    }
+    analog_format = bytes[20] >> 6;
+    base_unit = bytes[21];
+    m = tenBits(bytes[24], bytes[25]);
+    b = tenBits(bytes[26], bytes[27]);
+    r_exponent = fourBits(bytes[29] >> 4);
+    b_exponent = fourBits(bytes[29]);
+    name_at = 47;
+    break;
+  case SdrType::EventOnly:
+    if (size < 17) {
+      break;
+    }
+    owner = bytes[5];
+    lun = bytes[6] & 0x03;
+    number = bytes[7];
+    entity_id = bytes[8];
+    entity_instance = bytes[9];
+    sensor_type = bytes[10];
+    reading_type = bytes[11];
+    name_at = 16;
+    break;
+  case SdrType::FruLocator:
+  case SdrType::McLocator:
+    if (size < 16) {
+      break;
+    }
+    owner = bytes[5];
+    if (type == (uint8_t)SdrType::FruLocator) {
+      number = bytes[6];
+      lun = (bytes[7] >> 3) & 0x03;
+    }
+    entity_id = bytes[12];
+    entity_instance = bytes[13];
+    name_at = 15;
+    break;
+  }
+
+  // The type/length byte: 11b in the top bits is 8-bit ASCII.
+  if (name_at != 0 && bytes[name_at] >> 6 == 3) {
+    const size_t length = std::min<size_t>(
+        std::min<size_t>(bytes[name_at] & 0x1f, size - name_at - 1),
+        sizeof(name) - 1);
+    for (size_t i = 0; i < length; i++) {
+      const uint8_t c = bytes[name_at + 1 + i];
+      name[i] = isprint(c) ? c : '?';
+    }
+  }
+  return Status::Success;
+}
+
+#ifdef __linux__
+// A cache file is this header, then `count` SdrRecords.
+struct SdrCacheHeader {
+  char magic[8];
+  // sizeof(SdrRecord) when written: files of another layout are ignored.
+  uint32_t record_size;
+  uint32_t count;
+  uint32_t last_addition;
+  uint32_t last_erase;
+  uint8_t read_size;
+  uint8_t reserved[7];
+};
+static const char SDR_CACHE_MAGIC[8] = {'I', 'P', 'M', 'I', 'S', 'D', 'R', '1'};
+
+SdrCache::~SdrCache() {
+  for (auto &mapping : mappings) {
+    munmap(mapping.second.address, mapping.second.length);
+  }
+}
+
+// Keys are host names and ports; anything else is replaced.
+std::string SdrCache::path(const std::string &key) const {
+  std::string name = key;
+  for (char &c : name) {
+    if (!isalnum((unsigned char)c) && c != '.' && c != '-') {
+      c = '_';
+    }
+  }
+  return directory + "/" + name + ".sdr";
+}
+
+void SdrCache::unmap(const std::string &key) {
+  auto found = mappings.find(key);
+  if (found != mappings.end()) {
+    munmap(found->second.address, found->second.length);
+    mappings.erase(found);
+  }
+}
+
+bool SdrCache::find(const std::string &key,
+                    const GetSdrRepositoryInfo::Response &info,
+                    const SdrRecord *&records, size_t &count,
+                    uint8_t &read_size) {
+  unmap(key);
+  const int fd = open(path(key).c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return false;
+  }
+  struct stat st;
+  void *address = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(SdrCacheHeader)) {
+    address = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  }
+  close(fd);
+  if (address == MAP_FAILED) {
+    return false;
+  }
+
+  const SdrCacheHeader *header = (const SdrCacheHeader *)address;
+  const size_t length = st.st_size;
+  if (memcmp(header->magic, SDR_CACHE_MAGIC, sizeof(header->magic)) != 0 ||
+      header->record_size != sizeof(SdrRecord) ||
+      length != sizeof(*header) + (size_t)header->count * sizeof(SdrRecord)) {
+    munmap(address, length);
+    return false;
+  }
+  // The file may be damaged, or from a build with another MAX_READ.
+  read_size = std::max<uint8_t>(
+      1, std::min<uint8_t>(header->read_size, GetSdr::MAX_READ));
+  // The record count catches BMCs whose timestamps never change.
+  if (header->last_addition != info.last_addition ||
+      header->last_erase != info.last_erase ||
+      header->count != info.record_count) {
+    munmap(address, length);
+    return false;
+  }
+
+  mappings[key] = Mapping{address, length};
+  records = (const SdrRecord *)(header + 1);
+  count = header->count;
+  return true;
+}
+
+// Written under a temporary name and renamed into place, so that readers
+// never see half a file.
+Status SdrCache::store(const std::string &key,
+                       const GetSdrRepositoryInfo::Response &info,
+                       uint8_t read_size, const SdrRecord *records,
+                       size_t count) {
+  SdrCacheHeader header = {};
+  memcpy(header.magic, SDR_CACHE_MAGIC, sizeof(header.magic));
+  header.record_size = sizeof(SdrRecord);
+  header.count = count;
+  header.last_addition = info.last_addition;
+  header.last_erase = info.last_erase;
+  header.read_size = read_size;
+
+  const std::string final_path = path(key);
+  const std::string temporary = final_path + "." + std::to_string(getpid());
+  FILE *out = fopen(temporary.c_str(), "wb");
+  insist_return(out != NULL, Status::Failure, "Cannot write %s: %s",
+                temporary.c_str(), strerror(errno));
+  const bool written = fwrite(&header, sizeof(header), 1, out) == 1 &&
+                       fwrite(records, sizeof(SdrRecord), count, out) == count;
+  if (fclose(out) != 0 || !written ||
+      rename(temporary.c_str(), final_path.c_str()) != 0) {
+    const int error = errno;
+    unlink(temporary.c_str());
+    insist_return(false, Status::Failure, "Cannot write %s: %s",
+                  final_path.c_str(), strerror(error));
+  }
+  unmap(key);
+  return Status::Success;
+}
+#endif
+
+Status SdrReader::read(Completion done) {
+  insist_return(step == Step::Idle, Status::Failure,
+                "An SDR read is already in progress");
+  this->done = std::move(done);
+  records.clear();
+  cancellations = 0;
+  stats = {};
+  if (send(Step::Info) == Status::Failure) {
+    this->done = nullptr;
+    step = Step::Idle;
+    return Status::Failure;
+  }
+  return Status::Success;
+}
+
+Status SdrReader::send(Step next) {
+  step = next;
+  stats.requests++;
+  if (next == Step::Reserve) {
+    stats.reservations++;
+  }
+  return client.request(*this);
+}
+
+void SdrReader::sendOrFail(Step next) {
+  if (send(next) == Status::Failure) {
+    finish(Status::Failure, nullptr, 0);
+  }
+}
+
+void SdrReader::finish(Status status, const SdrRecord *found, size_t count) {
+  step = Step::Idle;
+  const Completion done = std::move(this->done);
+  this->done = nullptr;
+#ifdef __linux__
+  if (status == Status::Success && cache != nullptr && !stats.cached) {
+    cache->store(key, info, read_size, found, count);
+  }
+#endif
+  if (done) {
+    done(status, found, count);
+  }
+}
+
+NetworkFunction SdrReader::netFn() const {
+  return NetworkFunction::StorageRequest;
+}
+
+uint8_t SdrReader::command() const {
+  switch (step) {
+  case Step::Info:
+    return GetSdrRepositoryInfo::Command::command;
+  case Step::Reserve:
+    return ReserveSdrRepository::Command::command;
+  default:
+    return GetSdr::Command::command;
+  }
+}
+
+size_t SdrReader::write(uint8_t *out) const {
+  if (step != Step::Header && step != Step::Body) {
+    return 0;
+  }
+  const GetSdr::Request request(
+      reservation, record, offset,
+      step == Step::Header
+          ? GetSdr::HEADER_SIZE
+          : std::min<size_t>(read_size, record_size - offset));
+  PacketWriter writer(out, CUSTOM_REQUEST_SIZE);
+  request.write(writer);
+  return writer.position();
+}
+
+void SdrReader::complete(Status status, PacketView response, bool) {
+  if (status == Status::Failure) {
+    finish(Status::Failure, nullptr, 0);
+    return;
+  }
+  switch (step) {
+  case Step::Info:
+    receiveInfo(response);
+    break;
+  case Step::Reserve:
+    receiveReservation(response);
+    break;
+  case Step::Header:
+  case Step::Body:
+    receivePart(response);
+    break;
+  case Step::Idle:
+    break;
+  }
+}
+
+void SdrReader::receiveInfo(PacketView &response) {
+  if (info.read(response) == Status::Failure) {
+    finish(Status::Failure, nullptr, 0);
+    return;
+  }
+#ifdef __linux__
+  if (cache != nullptr) {
+    const SdrRecord *cached;
+    size_t count;
+    uint8_t learned = 0;
+    if (cache->find(key, info, cached, count, learned)) {
+      stats.cached = true;
+      read_size = learned;
+      finish(Status::Success, cached, count);
+      return;
+    }
+    // Larger reads failed last time, so do not try them again.
+    if (learned != 0) {
+      read_size = learned;
+      refused = learned + 1;
+    }
+  }
+#endif
+  if (info.record_count == 0) {
+    finish(Status::Success, nullptr, 0);
+    return;
+  }
+  record = GetSdr::FIRST_RECORD;
+  sendOrFail(Step::Reserve);
+}
+
+void SdrReader::receiveReservation(PacketView &response) {
+  ReserveSdrRepository::Response reserved;
+  if (reserved.read(response) == Status::Failure) {
+    finish(Status::Failure, nullptr, 0);
+    return;
+  }
+  reservation = reserved.reservation;
+  offset = 0;
+  sendOrFail(Step::Header);
+}
+
+void SdrReader::receivePart(PacketView &response) {
+  GetSdr::Response part;
+  if (part.read(response) == Status::Failure) {
+    finish(Status::Failure, nullptr, 0);
+    return;
+  }
+
+  const uint8_t asked =
+      step == Step::Header
+          ? GetSdr::HEADER_SIZE
+          : std::min<size_t>(read_size, record_size - offset);
+  switch (part.completion_code) {
+  case 0x00:
+    break;
+  case 0xc5: // Reservation cancelled: read the record again from its start.
+    if (++cancellations <= MAX_CANCELLATIONS) {
+      sendOrFail(Step::Reserve);
+      return;
+    }
+    ipmi_log(IPMI_TRACE_ERROR,
+             "SDR reservation cancelled %u times reading record %04x\n",
+             MAX_CANCELLATIONS, record);
+    finish(Status::Failure, nullptr, 0);
+    return;
+  case 0xc7: // Request data length invalid
+  case 0xc8: // Request data field length limit exceeded
+  case 0xca: // Cannot return number of requested data bytes
+  case 0xff: // Unspecified, which some BMCs answer instead
+    if (step == Step::Body && asked > 1) {
+      stats.shrinks++;
+      refused = std::min<uint16_t>(refused, asked);
+      read_size = asked / 2;
+      successes = 0;
+      sendOrFail(Step::Body);
+      return;
+    }
+  // fallthrough
+  default:
+    ipmi_log(IPMI_TRACE_ERROR,
+             "Get SDR of record %04x at offset %zu failed: %02x\n", record,
+             offset, part.completion_code);
+    finish(Status::Failure, nullptr, 0);
+    return;
+  }
+
+  if (step == Step::Header) {
+    if (part.size != GetSdr::HEADER_SIZE) {
+      ipmi_log(IPMI_TRACE_ERROR, "SDR header of %u bytes\n", part.size);
+      finish(Status::Failure, nullptr, 0);
+      return;
+    }
+    next_record = part.next_record;
+    record_size = GetSdr::HEADER_SIZE + part.data[4];
+  } else {
+    if (part.size == 0 || part.size > record_size - offset) {
+      ipmi_log(IPMI_TRACE_ERROR, "SDR part of %u bytes, expected at most %zu\n",
+               part.size, record_size - offset);
+      finish(Status::Failure, nullptr, 0);
+      return;
+    }
+    if (++successes >= GROW_AFTER && read_size + 1 < refused) {
+      read_size = std::min(read_size + GROW_STEP, refused - 1);
+      successes = 0;
+    }
+  }
+  memcpy(bytes + offset, part.data, part.size);
+  offset += part.size;
+  if (offset < record_size) {
+    sendOrFail(Step::Body);
+    return;
+  }
+
+  cancellations = 0;
+  records.emplace_back();
+  if (records.back().parse(bytes, record_size) == Status::Failure) {
+    finish(Status::Failure, nullptr, 0);
+    return;
+  }
+  if (next_record == GetSdr::LAST_RECORD) {
+    finish(Status::Success, records.data(), records.size());
+    return;
+  }
+  // The reservation holds the repository still, so more records than it
+  // counted means the BMC is going round in circles.
+  if (records.size() >= info.record_count) {
+    ipmi_log(IPMI_TRACE_ERROR, "SDR repository of %u records does not end\n",
+             info.record_count);
+    finish(Status::Failure, nullptr, 0);
+    return;
+  }
+  record = next_record;
+  offset = 0;
+  sendOrFail(Step::Header);
+}
+}; // namespace IPMI
@@ -0,0 +1,202 @@
+/*
+    Copyright Jordan Sissel, 2018
+    This file is part of jordansissel/ipmi.
+
+    jordansissel/ipmi is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    jordansissel/ipmi is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with jordansissel/ipmi.  If not, see <http://www.gnu.org/licenses/>.
+  */
+#pragma once
+#include "client.h"
+
+#include <functional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace IPMI {
+// Record types SdrRecord::parse() knows beyond the header.
+enum class SdrType : uint8_t {
+  FullSensor = 0x01,
+  CompactSensor = 0x02,
+  EventOnly = 0x03,
+  FruLocator = 0x11,
+  McLocator = 0x12,
+};
+
+// A Sensor Data Record, raw and with the fields sensor scans need parsed
+// out. Plain old data of fixed size, so that a cache file is an array of
+// them and can be used where it is mapped.
+struct SdrRecord {
+  // The header, and the most a one byte length can add.
+  static const size_t MAX_SIZE = GetSdr::HEADER_SIZE + 255;
+
+  uint16_t id;
+  uint8_t version;
+  uint8_t type;
+  // The sensor owner, or the device for locator records.
+  uint8_t owner;
+  uint8_t lun;
+  // The sensor number, or the FRU device ID for FRU locators.
+  uint8_t number;
+  uint8_t entity_id;
+  uint8_t entity_instance;
+  uint8_t sensor_type;
+  uint8_t reading_type;
+  // Full sensor records only: a raw reading x converts to
+  // (m * x + b * 10^b_exponent) * 10^r_exponent units.
+  uint8_t analog_format;
+  uint8_t base_unit;
+  int16_t m;
+  int16_t b;
+  int8_t b_exponent;
+  int8_t r_exponent;
+  // The ID string, if it is 8-bit ASCII. NUL terminated.
+  char name[17];
+  uint16_t size;
+  uint8_t raw[MAX_SIZE];
+
+  // Fills in the record from its `size` raw bytes, header included.
+  Status parse(const uint8_t *bytes, size_t size);
+};
+
+#ifdef __linux__
+// Parsed SDR repositories on disk, one file per BMC in a directory, mapped
+// read-only when found. A file records the repository's last addition and
+// erase timestamps: a BMC reporting others has changed its repository, and
+// its file no longer counts.
+class SdrCache {
+  struct Mapping {
+    void *address;
+    size_t length;
+  };
+  std::string directory;
+  std::unordered_map<std::string, Mapping> mappings;
+
+  std::string path(const std::string &key) const;
+  void unmap(const std::string &key);
+
+public:
+  // `directory` must exist.
+  explicit SdrCache(const std::string &directory) : directory(directory) {}
+  ~SdrCache();
+  SdrCache(const SdrCache &) = delete;
+  SdrCache &operator=(const SdrCache &) = delete;
+
+  // Maps the records stored for BMC `key` and returns true if they are
+  // those of the repository `info` describes. `read_size` is set to the
+  // partial read size learned from the BMC, 1 to GetSdr::MAX_READ, whenever
+  // a file is found, fresh or not. The records stay mapped until `key` is
+  // stored again or the cache is destroyed.
+  bool find(const std::string &key, const GetSdrRepositoryInfo::Response &info,
+            const SdrRecord *&records, size_t &count, uint8_t &read_size);
+  // Replaces the file for `key`. Readers of the old one are not disturbed.
+  Status store(const std::string &key,
+               const GetSdrRepositoryInfo::Response &info, uint8_t read_size,
+               const SdrRecord *records, size_t count);
+};
+#endif
+
+// Reads a BMC's SDR repository within a client's session. Records are read
+// in parts: first the header, then the rest in pieces of the read size. The
+// read size starts at GetSdr::MAX_READ, as ipmitool's does, so a BMC that
+// allows it returns the rest of a record at once. It adapts to the BMC: a
+// piece it cannot return halves it, and a run of successes grows it again,
+// up to below the size that failed. A reservation the BMC cancels (the
+// repository changed, or another reader reserved it) is taken again, and the
+// record read again from its start.
+//
+// With a cache, the walk is skipped when the BMC's repository has not
+// changed since it was stored, and a fresh walk keeps to the read size
+// learned last time.
+class SdrReader : public CustomRequest {
+public:
+  // The records are valid until the callback returns.
+  typedef std::function<void(Status, const SdrRecord *records, size_t count)>
+      Completion;
+
+  struct Statistics {
+    // Requests sent, including the repository info and reservations.
+    uint32_t requests;
+    uint32_t reservations;
+    // Parts the BMC could not return at the read size asked.
+    uint32_t shrinks;
+    // True if the records came from the cache.
+    bool cached;
+  };
+
+  // Reservation cancellations tolerated while reading one record.
+  static const uint32_t MAX_CANCELLATIONS = 8;
+  // Successful parts before trying a larger read size.
+  static const uint32_t GROW_AFTER = 16;
+  static const uint8_t GROW_STEP = 4;
+
+private:
+  enum class Step { Idle, Info, Reserve, Header, Body };
+
+  Client &client;
+  Completion done;
+  Step step = Step::Idle;
+  GetSdrRepositoryInfo::Response info;
+  uint16_t reservation = 0;
+  // The record being read, the one after it, and its bytes so far.
+  uint16_t record = GetSdr::FIRST_RECORD;
+  uint16_t next_record = GetSdr::FIRST_RECORD;
+  uint8_t bytes[SdrRecord::MAX_SIZE];
+  size_t offset = 0;
+  size_t record_size = 0;
+  // The read size, and the smallest one the BMC refused.
+  uint8_t read_size = GetSdr::MAX_READ;
+  uint16_t refused = GetSdr::MAX_READ + 1;
+  uint32_t successes = 0;
+  uint32_t cancellations = 0;
+  std::vector<SdrRecord> records;
+  Statistics stats = {};
+#ifdef __linux__
+  SdrCache *cache = nullptr;
+  std::string key;
+#endif
+
+  Status send(Step next);
+  void sendOrFail(Step next);
+  void finish(Status status, const SdrRecord *found, size_t count);
+  void receiveInfo(PacketView &response);
+  void receiveReservation(PacketView &response);
+  void receivePart(PacketView &response);
+
+public:
+  explicit SdrReader(Client &client) : client(client) {}
+#ifdef __linux__
+  // Keeps the records of BMC `key` in `cache`, which must outlive the
+  // reader.
+  void useCache(SdrCache &cache, const std::string &key) {
+    this->cache = &cache;
+    this->key = key;
+  }
+#endif
+
+  // Reads the repository and calls `done`. Fails without calling it if a
+  // read is already in progress or the client cannot queue the request.
+  Status read(Completion done);
+  const Statistics &statistics() const { return stats; }
+  uint8_t readSize() const { return read_size; }
+
+  // CustomRequest
+  NetworkFunction netFn() const override;
+  uint8_t command() const override;
+  size_t write(uint8_t *out) const override;
+  // Every step is a read; a reservation taken again only cancels the last.
+  bool idempotent() const override { return true; }
+  void complete(Status status, PacketView response,
+                bool outcome_unknown) override;
+};
+}; // namespace IPMI
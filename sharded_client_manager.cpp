@@ -0,0 +1,179 @@
+/*
+    Copyright Jordan Sissel, 2018
+    This file is part of jordansissel/ipmi.
+
+    jordansissel/ipmi is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    jordansissel/ipmi is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with jordansissel/ipmi.  If not, see <http://www.gnu.org/licenses/>.
+  */
+#include "sharded_client_manager.h"
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+namespace IPMI {
+ShardedClientManager::Shard::Shard() {
+  mg_mgr_init(&mgr, NULL);
+  manager.reset(new ClientManager(&mgr));
+}
+
+// Retries a full submission queue, which the shard's thread is draining.
+static void submit(ClientManager &manager, SubmissionQueue::Task task) {
+  while (manager.submit(task) == Status::Failure) {
+    std::this_thread::yield();
+  }
+}
+
+ShardedClientManager::Shard::~Shard() {
+  if (thread.joinable()) {
+    Shard *shard = this;
+    submit(*manager, [shard] { shard->stopping = true; });
+    thread.join();
+  }
+  // The clients go before the connections they point at.
+  manager.reset();
+  mg_mgr_free(&mgr);
+}
+
+ShardedClientManager::ShardedClientManager(size_t count) {
+  if (count == 0) {
+    count = std::thread::hardware_concurrency();
+  }
+  if (count == 0) {
+    count = 1;
+  }
+  for (size_t i = 0; i < count; i++) {
+    shards.emplace_back(new Shard());
+  }
+}
+
+// FNV-1a, so that a host's shard does not depend on the standard library.
+ShardedClientManager::Shard &ShardedClientManager::shardFor(const char *host) {
+  uint32_t hash = 2166136261u;
+  for (const char *c = host; *c != '\0'; c++) {
+    hash = (hash ^ (uint8_t)*c) * 16777619u;
+  }
+  return *shards[hash % shards.size()];
+}
+
+void ShardedClientManager::add(const char *host, uint8_t password[16]) {
+  shardFor(host).manager->add(host, password);
+  hosts++;
+}
+
+void ShardedClientManager::setMaxActive(size_t count) {
+  for (auto &shard : shards) {
+    shard->manager->setMaxActive(count);
+  }
+}
+
+#if IPMI_LANPLUS
+void ShardedClientManager::useLanplus(const Lanplus::CipherSuite &suite) {
+  for (auto &shard : shards) {
+    shard->manager->useLanplus(suite);
+  }
+}
+#endif
+
+// Pins the calling thread to one core, where the platform allows it.
+static void pin(size_t core) {
+#ifdef __linux__
+  const unsigned cores = std::thread::hardware_concurrency();
+  if (cores == 0) {
+    return;
+  }
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(core % cores, &set);
+  pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#else
+  (void)core;
+#endif
+}
+
+void ShardedClientManager::start() {
+  for (size_t i = 0; i < shards.size(); i++) {
+    Shard *shard = shards[i].get();
+    if (shard->thread.joinable()) {
+      continue;
+    }
+    shard->thread = std::thread([i, shard] {
+      pin(i);
+      while (!shard->stopping) {
+        shard->manager->poll(1000);
+      }
+    });
+  }
+}
+
+void ShardedClientManager::shardFinished(Shard &shard) {
+  // Hosts failing inside chassisControl() report before it returns, so both
+  // the last report and the check after the call may see the shard done.
+  if (shard.finished) {
+    return;
+  }
+  shard.finished = true;
+  std::lock_guard<std::mutex> lock(mutex);
+  if (--running == 0) {
+    finished.notify_all();
+  }
+}
+
+void ShardedClientManager::chassisControl(ChassisControlCommand command,
+                                          Report report) {
+  start();
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    running = shards.size();
+  }
+  for (auto &owned : shards) {
+    Shard *shard = owned.get();
+    ClientManager *manager = shard->manager.get();
+    submit(*manager, [this, shard, manager, command, report] {
+      shard->finished = false;
+      manager->chassisControl(command, [this, shard, manager, report](
+                                           const char *host, Status status) {
+        if (report) {
+          report(host, status);
+        }
+        if (manager->done()) {
+          shardFinished(*shard);
+        }
+      });
+      // A shard without hosts has nothing to report.
+      if (manager->done()) {
+        shardFinished(*shard);
+      }
+    });
+  }
+
+  std::unique_lock<std::mutex> lock(mutex);
+  finished.wait(lock, [this] { return running == 0; });
+}
+
+size_t ShardedClientManager::succeededCount() const {
+  size_t count = 0;
+  for (const auto &shard : shards) {
+    count += shard->manager->succeededCount();
+  }
+  return count;
+}
+
+size_t ShardedClientManager::failedCount() const {
+  size_t count = 0;
+  for (const auto &shard : shards) {
+    count += shard->manager->failedCount();
+  }
+  return count;
+}
+}; // namespace IPMI
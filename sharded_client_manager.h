@@ -0,0 +1,92 @@
+/*
+    Copyright Jordan Sissel, 2018
+    This file is part of jordansissel/ipmi.
+
+    jordansissel/ipmi is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    jordansissel/ipmi is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with jordansissel/ipmi.  If not, see <http://www.gnu.org/licenses/>.
+  */
+#pragma once
+#include "client_manager.h"
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace IPMI {
+// Spreads hosts over several ClientManagers, each with its own mg_mgr, run on
+// its own thread pinned to its own core. A host always lands on the same
+// shard, picked by a hash of its address, so its client (session, timers,
+// MD5 and cipher work) stays on one core and no state is shared between
+// threads.
+//
+// The shards' threads start with the first run and poll until the manager is
+// destroyed. Runs reach them through each ClientManager's submission queue,
+// so add hosts and change settings before the first run only.
+class ShardedClientManager {
+public:
+  // Called on the shard's thread, so possibly from several at once.
+  typedef ClientManager::Report Report;
+
+private:
+  struct Shard {
+    struct mg_mgr mgr;
+    std::unique_ptr<ClientManager> manager;
+    std::thread thread;
+    // Set by a submission, on the shard's thread.
+    bool stopping = false;
+    // Whether the shard has counted itself out of the current run; set on
+    // the shard's thread.
+    bool finished = false;
+
+    Shard();
+    ~Shard();
+  };
+
+  std::vector<std::unique_ptr<Shard>> shards;
+  size_t hosts = 0;
+
+  // Shards yet to finish the current run.
+  std::mutex mutex;
+  std::condition_variable finished;
+  size_t running = 0;
+
+  Shard &shardFor(const char *host);
+  void start();
+  void shardFinished(Shard &shard);
+
+public:
+  // One shard per core when `count` is 0.
+  ShardedClientManager(size_t count = 0);
+
+  void add(const char *host, uint8_t password[16]);
+  size_t size() const { return hosts; }
+  size_t shardCount() const { return shards.size(); }
+  // For statistics. Do not touch a shard while a run is in progress.
+  const ClientManager &shard(size_t index) const {
+    return *shards[index]->manager;
+  }
+
+  // Per shard.
+  void setMaxActive(size_t count);
+#if IPMI_LANPLUS
+  void useLanplus(const Lanplus::CipherSuite &suite);
+#endif
+
+  // Sends `command` to every host and returns once all have finished. Each
+  // shard runs its part on its own thread. Call from one thread at a time.
+  void chassisControl(ChassisControlCommand command, Report report = nullptr);
+  size_t succeededCount() const;
+  size_t failedCount() const;
+};
+}; // namespace IPMI
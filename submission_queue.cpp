@@ -0,0 +1,155 @@
+/*
+    Copyright Jordan Sissel, 2018
+    This file is part of jordansissel/ipmi.
+
+    jordansissel/ipmi is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    jordansissel/ipmi is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with jordansissel/ipmi.  If not, see <http://www.gnu.org/licenses/>.
+  */
+#include "submission_queue.h"
+
+namespace IPMI {
+static size_t roundUp(size_t capacity) {
+  size_t size = 2;
+  while (size < capacity) {
+    size <<= 1;
+  }
+  return size;
+}
+
+SubmissionQueue::SubmissionQueue(struct mg_mgr *mgr, size_t capacity)
+    : cells(new Cell[roundUp(capacity)]), mask(roundUp(capacity) - 1) {
+  for (size_t i = 0; i <= mask; i++) {
+    cells[i].sequence.store(i, std::memory_order_relaxed);
+  }
+
+  wakeup[0] = wakeup[1] = INVALID_SOCKET;
+  if (!mg_socketpair(wakeup, SOCK_DGRAM)) {
+    fprintf(stderr, "SubmissionQueue: no socket pair, call drain() instead\n");
+    return;
+  }
+#if CS_PLATFORM == CS_P_UNIX || CS_PLATFORM == CS_P_WINDOWS
+  struct mg_add_sock_opts opts = {};
+  opts.user_data = this;
+  connection = mg_add_sock_opt(mgr, wakeup[1], handler, opts);
+#else
+  struct mg_add_sock_opts opts = {};
+  connection = mg_add_sock_opt(mgr, wakeup[1], handler, this, opts);
+#endif
+}
+
+SubmissionQueue::~SubmissionQueue() {
+  if (connection != NULL) {
+    // mongoose closes wakeup[1] with the connection.
+    connection->user_data = NULL;
+    connection->flags |= MG_F_CLOSE_IMMEDIATELY;
+  }
+  if (wakeup[0] != INVALID_SOCKET) {
+    closesocket(wakeup[0]);
+  }
+}
+
+Status SubmissionQueue::submit(Task task) {
+  Cell *cell;
+  size_t position = enqueue_position.load(std::memory_order_relaxed);
+  for (;;) {
+    cell = &cells[position & mask];
+    const size_t sequence = cell->sequence.load(std::memory_order_acquire);
+    const intptr_t difference = (intptr_t)sequence - (intptr_t)position;
+    if (difference == 0) {
+      // The cell is free; claim it unless another producer got there first.
+      if (enqueue_position.compare_exchange_weak(position, position + 1,
+                                                 std::memory_order_relaxed)) {
+        break;
+      }
+    } else if (difference < 0) {
+      // The consumer has not emptied this cell since the last lap. Not
+      // logged: a producer may well meet this many times in a burst.
+      return Status::Failure;
+    } else {
+      position = enqueue_position.load(std::memory_order_relaxed);
+    }
+  }
+
+  cell->task = std::move(task);
+  cell->sequence.store(position + 1, std::memory_order_release);
+
+  // One byte wakes the loop however many requests follow it before it runs.
+  if (!wakeup_pending.exchange(true) && wakeup[0] != INVALID_SOCKET) {
+    const char byte = 0;
+    // A full socket buffer already holds a wakeup; never wait for room.
+    send(wakeup[0], &byte, 1, MSG_DONTWAIT);
+  }
+  return Status::Success;
+}
+
+Status SubmissionQueue::submit(Client &client, ChassisControlCommand command,
+                               ChassisControlCompletion done) {
+  Client *target = &client;
+  return submit([target, command, done] {
+    if (target->chassisControl(command, done) == Status::Failure && done) {
+      ChassisControlResult refused;
+      refused.command = command;
+      done(refused);
+    }
+  });
+}
+
+bool SubmissionQueue::pop(Task &task) {
+  Cell &cell = cells[dequeue_position & mask];
+  const size_t sequence = cell.sequence.load(std::memory_order_acquire);
+  if (sequence != dequeue_position + 1) {
+    // Empty, or the next producer has claimed the cell but not filled it
+    // yet. Its wakeup follows.
+    return false;
+  }
+
+  task = std::move(cell.task);
+  cell.task = nullptr;
+  cell.sequence.store(dequeue_position + mask + 1, std::memory_order_release);
+  dequeue_position++;
+  return true;
+}
+
+void SubmissionQueue::drain() {
+  // Cleared before draining, so anything submitted from here on sends a new
+  // wakeup. The exchange also makes every submission that saw the flag set
+  // visible here.
+  wakeup_pending.exchange(false);
+
+  Task task;
+  while (pop(task)) {
+    task();
+  }
+}
+
+#if CS_PLATFORM == CS_P_UNIX || CS_PLATFORM == CS_P_WINDOWS
+void SubmissionQueue::handler(struct mg_connection *nc, int ev,
+                              void *ev_data) {
+  auto queue = (SubmissionQueue *)nc->user_data;
+#else
+void SubmissionQueue::handler(struct mg_connection *nc, int ev, void *ev_data,
+                              void *user_data) {
+  auto queue = (SubmissionQueue *)user_data;
+#endif
+  if (ev == MG_EV_RECV) {
+    mbuf_remove(&nc->recv_mbuf, nc->recv_mbuf.len);
+    if (queue != NULL) {
+      queue->drain();
+    }
+  } else if (ev == MG_EV_CLOSE && queue != NULL) {
+    // mg_mgr_free() went first; the destructor has nothing left to close.
+    queue->connection = NULL;
+  }
+  (void)ev_data;
+}
+}; // namespace IPMI
@@ -0,0 +1,88 @@
+/*
+    Copyright Jordan Sissel, 2018
+    This file is part of jordansissel/ipmi.
+
+    jordansissel/ipmi is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    jordansissel/ipmi is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with jordansissel/ipmi.  If not, see <http://www.gnu.org/licenses/>.
+  */
+#pragma once
+#include "client.h"
+#include <atomic>
+#include <functional>
+#include <memory>
+
+namespace IPMI {
+// Hands requests from any thread to the thread polling the mg_mgr, where the
+// clients live. Producers never wait for that thread: submit() claims a slot
+// in a bounded lock-free queue (Vyukov's MPMC ring, used with one consumer)
+// and, unless a wakeup is already on its way, writes one byte to a socket
+// pair that the mg_mgr polls. The poll loop wakes at once and runs every
+// submitted task in order.
+//
+// Every ClientManager has one, drained by its poll(); see
+// ClientManager::submit().
+class SubmissionQueue {
+public:
+  typedef std::function<void()> Task;
+
+private:
+  struct Cell {
+    std::atomic<size_t> sequence;
+    Task task;
+  };
+
+  std::unique_ptr<Cell[]> cells;
+  const size_t mask;
+  // Padded apart, so producers claiming slots do not slow the consumer. Not
+  // with alignas(64), which operator new ignores before C++17, and managers
+  // holding a queue are allocated with it.
+  std::atomic<size_t> enqueue_position{0};
+  char padding0[64];
+  size_t dequeue_position = 0;
+  char padding1[64];
+  std::atomic<bool> wakeup_pending{false};
+
+  // [0] is written by producers; [1] is polled by the mg_mgr.
+  sock_t wakeup[2];
+  mg_connection *connection = nullptr;
+
+  bool pop(Task &task);
+#if CS_PLATFORM == CS_P_UNIX || CS_PLATFORM == CS_P_WINDOWS
+  static void handler(struct mg_connection *nc, int ev, void *ev_data);
+#else
+  static void handler(struct mg_connection *nc, int ev, void *ev_data,
+                      void *user_data);
+#endif
+
+public:
+  // `capacity` is rounded up to a power of two. Create and destroy the queue
+  // on the polling thread, or while no thread polls the mg_mgr.
+  SubmissionQueue(struct mg_mgr *mgr, size_t capacity = 1024);
+  ~SubmissionQueue();
+  SubmissionQueue(const SubmissionQueue &) = delete;
+  SubmissionQueue &operator=(const SubmissionQueue &) = delete;
+
+  // Thread safe. Queues `task` to run on the polling thread. Fails when the
+  // queue is full, which is left to the caller to retry or report.
+  Status submit(Task task);
+  // Thread safe. Queues client.chassisControl(command, done). Fails, without
+  // calling `done`, when the queue is full. If the client then refuses the
+  // command, `done` gets an unanswered failure.
+  Status submit(Client &client, ChassisControlCommand command,
+                ChassisControlCompletion done = nullptr);
+
+  // Runs everything submitted so far. The wakeup calls it; call it directly
+  // to submit without a socket pair, such as from a loop that polls anyway.
+  void drain();
+};
+}; // namespace IPMI
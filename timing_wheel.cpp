@@ -0,0 +1,177 @@
+/*
+    Copyright Jordan Sissel, 2018
+    This file is part of jordansissel/ipmi.
+
+    jordansissel/ipmi is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    jordansissel/ipmi is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with jordansissel/ipmi.  If not, see <http://www.gnu.org/licenses/>.
+  */
+#include "timing_wheel.h"
+#include <limits.h>
+#include <math.h>
+
+namespace IPMI {
+static void initialize(Timer *head) { head->next = head->prev = head; }
+
+static bool empty(const Timer *head) { return head->next == head; }
+
+static void link(Timer *head, Timer *timer) {
+  timer->prev = head->prev;
+  timer->next = head;
+  head->prev->next = timer;
+  head->prev = timer;
+}
+
+static void unlink(Timer *timer) {
+  timer->prev->next = timer->next;
+  timer->next->prev = timer->prev;
+  timer->next = timer->prev = nullptr;
+}
+
+// Moves every timer in the list at `from` to the empty list at `to`.
+static void splice(Timer *from, Timer *to) {
+  if (empty(from)) {
+    return;
+  }
+  to->next = from->next;
+  to->prev = from->prev;
+  to->next->prev = to;
+  to->prev->next = to;
+  initialize(from);
+}
+
+TimingWheel::TimingWheel(double now) : current(tick(now)) {
+  for (auto &level : slots) {
+    for (auto &slot : level) {
+      initialize(&slot);
+    }
+  }
+}
+
+uint64_t TimingWheel::tick(double seconds) {
+  return (uint64_t)(seconds * 1000);
+}
+
+void TimingWheel::schedule(Timer *timer, double at) {
+  if (timer->scheduled()) {
+    cancel(timer);
+  }
+  // Round up, so that a timer never fires before its time.
+  timer->expiry = (uint64_t)ceil(at * 1000);
+  insert(timer);
+  count++;
+}
+
+void TimingWheel::cancel(Timer *timer) {
+  if (!timer->scheduled()) {
+    return;
+  }
+  unlink(timer);
+  count--;
+}
+
+// Files `timer` by how far away it is: in level 0 if due within 64 ticks, in
+// level 1 if within 64^2, and so on. `current` is the next tick to process,
+// so a timer that is already due goes in the very next slot.
+void TimingWheel::insert(Timer *timer) {
+  uint64_t expiry = timer->expiry < current ? current : timer->expiry;
+  const uint64_t delta = expiry - current;
+
+  unsigned level = 0;
+  while (level < LEVELS - 1 &&
+         delta >= (uint64_t)1 << (SLOT_BITS * (level + 1))) {
+    level++;
+  }
+  const uint64_t span = (uint64_t)1 << (SLOT_BITS * LEVELS);
+  if (delta >= span) {
+    expiry = current + span - 1;
+  }
+
+  const unsigned index = (expiry >> (SLOT_BITS * level)) & (SLOTS - 1);
+  link(&slots[level][index], timer);
+}
+
+// Refiles the timers in the slot of `level` that time has just reached. When
+// that is the level's first slot, the level above has come round to its next
+// slot too.
+void TimingWheel::cascade(unsigned level) {
+  const unsigned index = (current >> (SLOT_BITS * level)) & (SLOTS - 1);
+  Timer moving;
+  initialize(&moving);
+  splice(&slots[level][index], &moving);
+  while (!empty(&moving)) {
+    Timer *timer = moving.next;
+    unlink(timer);
+    insert(timer);
+  }
+
+  if (index == 0 && level + 1 < LEVELS) {
+    cascade(level + 1);
+  }
+}
+
+void TimingWheel::advance(double now) {
+  const uint64_t target = tick(now);
+  while (current <= target) {
+    const unsigned index = current & (SLOTS - 1);
+    if (index == 0) {
+      cascade(1);
+    }
+
+    Timer due;
+    initialize(&due);
+    splice(&slots[0][index], &due);
+    // Timers scheduled by the callbacks below land in later slots.
+    current++;
+    while (!empty(&due)) {
+      Timer *timer = due.next;
+      unlink(timer);
+      count--;
+      timer->callback(timer->context);
+    }
+  }
+}
+
+int TimingWheel::millisecondsUntilNext() const {
+  if (count == 0) {
+    return -1;
+  }
+
+  // Level 0 slots hold timers due at exactly that tick.
+  uint64_t next = UINT64_MAX;
+  for (unsigned offset = 0; offset < SLOTS; offset++) {
+    if (!empty(&slots[0][(current + offset) & (SLOTS - 1)])) {
+      next = current + offset;
+      break;
+    }
+  }
+
+  // Higher slots are due no earlier than the tick that reaches them. The
+  // slot `current` falls in is still waiting to cascade if `current` is the
+  // first tick of it.
+  for (unsigned level = 1; level < LEVELS; level++) {
+    const unsigned shift = SLOT_BITS * level;
+    const uint64_t base = current >> shift;
+    const unsigned first = (current & (((uint64_t)1 << shift) - 1)) ? 1 : 0;
+    for (unsigned offset = first; offset < first + SLOTS; offset++) {
+      if (!empty(&slots[level][(base + offset) & (SLOTS - 1)])) {
+        const uint64_t start = (base + offset) << shift;
+        next = start < next ? start : next;
+        break;
+      }
+    }
+  }
+
+  const uint64_t wait = next > current ? next - current : 0;
+  return wait > INT_MAX ? INT_MAX : (int)wait;
+}
+}; // namespace IPMI
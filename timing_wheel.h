@@ -0,0 +1,83 @@
+/*
+    Copyright Jordan Sissel, 2018
+    This file is part of jordansissel/ipmi.
+
+    jordansissel/ipmi is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    jordansissel/ipmi is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with jordansissel/ipmi.  If not, see <http://www.gnu.org/licenses/>.
+  */
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+namespace IPMI {
+// A timer owned by its user and linked into a TimingWheel while scheduled. It
+// must be cancelled before it is destroyed.
+struct Timer {
+  Timer *next = nullptr;
+  Timer *prev = nullptr;
+  uint64_t expiry = 0;
+  void (*callback)(void *context) = nullptr;
+  void *context = nullptr;
+
+  Timer() {}
+  Timer(void (*callback)(void *), void *context)
+      : callback(callback), context(context) {}
+  Timer(const Timer &) = delete;
+  Timer &operator=(const Timer &) = delete;
+
+  bool scheduled() const { return next != nullptr; }
+};
+
+// Hierarchical timing wheel (Varghese and Lauck) with millisecond ticks: four
+// levels of 64 slots, each slot a doubly linked list, so scheduling and
+// cancelling a timer are O(1) however many are pending. Level 0 holds timers
+// due within 64ms; each higher level covers 64 times the span of the one
+// below, and its slots are moved down a level as time reaches them. Timers
+// further out than the top level (about 4.6 hours) wait in its last slot and
+// are placed again when it comes round.
+class TimingWheel {
+public:
+  static const unsigned LEVELS = 4;
+  static const unsigned SLOT_BITS = 6;
+  static const unsigned SLOTS = 1 << SLOT_BITS;
+
+private:
+  // Sentinel heads of circular lists.
+  Timer slots[LEVELS][SLOTS];
+  uint64_t current;
+  size_t count = 0;
+
+  static uint64_t tick(double seconds);
+  void insert(Timer *timer);
+  void cascade(unsigned level);
+
+public:
+  // `now` is in seconds, on the clock later calls use, such as mg_time().
+  TimingWheel(double now);
+
+  // Runs `timer`'s callback once the wheel has advanced past `at` seconds.
+  // Scheduling a timer that is already scheduled moves it.
+  void schedule(Timer *timer, double at);
+  void cancel(Timer *timer);
+
+  // Fires every timer due at or before `now`. Callbacks may schedule and
+  // cancel any timer, including ones due in the same call.
+  void advance(double now);
+
+  // How long a poll may sleep before the next timer could be due: exact for
+  // timers within 64ms, otherwise the time until the slot holding the next
+  // timer is reached. -1 when nothing is scheduled.
+  int millisecondsUntilNext() const;
+  size_t size() const { return count; }
+};
+}; // namespace IPMI
@@ -0,0 +1,121 @@
+/*
+    Copyright Jordan Sissel, 2018
+    This file is part of jordansissel/ipmi.
+
+    jordansissel/ipmi is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    jordansissel/ipmi is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with jordansissel/ipmi.  If not, see <http://www.gnu.org/licenses/>.
+  */
+#include "trace.h"
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <string.h>
+#include <vector>
+
+namespace IPMI {
+namespace Trace {
+static_assert((IPMI_TRACE_RING_SIZE & (IPMI_TRACE_RING_SIZE - 1)) == 0,
+              "IPMI_TRACE_RING_SIZE must be a power of two");
+
+// Written only by its thread. `head` counts every record ever written; it is
+// published after the record, so readers know which slots are complete.
+struct Ring {
+  std::atomic<uint64_t> head{0};
+  uint64_t thread;
+  TraceRecord records[IPMI_TRACE_RING_SIZE];
+};
+
+// Every ring made, for dump(). Threads only take the lock to add theirs.
+static std::mutex rings_lock;
+static std::vector<Ring *> rings;
+
+static Ring *ring() {
+  static thread_local Ring *mine = nullptr;
+  if (mine == nullptr) {
+    Ring *made = new Ring();
+    std::lock_guard<std::mutex> lock(rings_lock);
+    made->thread = rings.size() + 1;
+    rings.push_back(made);
+    mine = made;
+  }
+  return mine;
+}
+
+void record(uint8_t level, TraceEvent event, const void *object, uint32_t a,
+            uint32_t b, uint32_t c) {
+  Ring *r = ring();
+  const uint64_t head = r->head.load(std::memory_order_relaxed);
+  TraceRecord &out = r->records[head & (IPMI_TRACE_RING_SIZE - 1)];
+  out.nanoseconds = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                        std::chrono::steady_clock::now().time_since_epoch())
+                        .count();
+  out.object = (uintptr_t)object;
+  out.a = a;
+  out.b = b;
+  out.c = c;
+  out.event = (uint8_t)event;
+  out.level = level;
+  out.reserved = 0;
+  r->head.store(head + 1, std::memory_order_release);
+}
+
+bool dump(FILE *out) {
+  std::vector<Ring *> all;
+  {
+    std::lock_guard<std::mutex> lock(rings_lock);
+    all = rings;
+  }
+
+  TraceFileHeader header;
+  memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+  header.record_size = sizeof(TraceRecord);
+  header.rings = all.size();
+  if (fwrite(&header, sizeof(header), 1, out) != 1) {
+    return false;
+  }
+
+  std::vector<TraceRecord> copy;
+  for (Ring *r : all) {
+    // Copy whatever the ring holds, then keep only what its thread did not
+    // overwrite while we copied. That includes the slot of the record it may
+    // be storing now, at `now`, which is the oldest record once the ring is
+    // full.
+    const uint64_t end = r->head.load(std::memory_order_acquire);
+    const uint64_t begin =
+        end > IPMI_TRACE_RING_SIZE ? end - IPMI_TRACE_RING_SIZE : 0;
+    copy.clear();
+    for (uint64_t i = begin; i < end; i++) {
+      copy.push_back(r->records[i & (IPMI_TRACE_RING_SIZE - 1)]);
+    }
+    std::atomic_thread_fence(std::memory_order_acquire);
+    const uint64_t now = r->head.load(std::memory_order_relaxed);
+    const uint64_t written = now + 1;
+    const uint64_t overwritten = written > begin + IPMI_TRACE_RING_SIZE
+                                     ? written - IPMI_TRACE_RING_SIZE - begin
+                                     : 0;
+    const uint64_t skip = overwritten < copy.size() ? overwritten : copy.size();
+
+    TraceRingHeader ring_header;
+    ring_header.thread = r->thread;
+    ring_header.records = copy.size() - skip;
+    if (fwrite(&ring_header, sizeof(ring_header), 1, out) != 1 ||
+        fwrite(copy.data() + skip, sizeof(TraceRecord), ring_header.records,
+               out) != ring_header.records) {
+      return false;
+    }
+  }
+  return fflush(out) == 0;
+}
+} // namespace Trace
+} // namespace IPMI
@@ -0,0 +1,130 @@
+/*
+    Copyright Jordan Sissel, 2018
+    This file is part of jordansissel/ipmi.
+
+    jordansissel/ipmi is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    jordansissel/ipmi is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with jordansissel/ipmi.  If not, see <http://www.gnu.org/licenses/>.
+  */
+#pragma once
+#include <stdint.h>
+#include <stdio.h>
+
+// Levels, from the fewest events to the most. Events above IPMI_TRACE_LEVEL
+// compile to nothing, arguments included; 0 turns tracing off entirely.
+#define IPMI_TRACE_ERROR 1
+#define IPMI_TRACE_WARN 2
+#define IPMI_TRACE_INFO 3
+#define IPMI_TRACE_DEBUG 4
+
+#ifndef IPMI_TRACE_LEVEL
+#define IPMI_TRACE_LEVEL IPMI_TRACE_INFO
+#endif
+
+// Records kept per thread; the oldest are overwritten. A power of two.
+#ifndef IPMI_TRACE_RING_SIZE
+#define IPMI_TRACE_RING_SIZE 4096
+#endif
+
+// Records an event in the calling thread's ring. `object` is what it
+// concerns, usually a Client; `a`, `b` and `c` depend on the event.
+#define ipmi_trace(level, event, object, a, b, c)                             \
+  do {                                                                         \
+    if ((level) <= IPMI_TRACE_LEVEL) {                                         \
+      IPMI::Trace::record((level), IPMI::TraceEvent::event, (object), (a),    \
+                          (b), (c));                                           \
+    }                                                                          \
+  } while (0)
+
+// Prints a message on stderr, for the rare events a person should see as
+// they happen. Record them with ipmi_trace() as well.
+#define ipmi_log(level, args...)                                               \
+  do {                                                                         \
+    if ((level) <= IPMI_TRACE_LEVEL) {                                         \
+      fprintf(stderr, ##args);                                                 \
+    }                                                                          \
+  } while (0)
+
+namespace IPMI {
+// What happened. The meaning of each record's `a`, `b` and `c` follows the
+// name; unused ones are 0. Values are part of the trace file format: append
+// only.
+enum class TraceEvent : uint8_t {
+  // a: old ClientState, b: new ClientState.
+  State = 0,
+  // a: length, b: session ID in the header, c: IPMB command, or for RMCP+
+  // 0x100 plus the payload type.
+  Send = 1,
+  Receive = 2,
+  // a: ClientState.
+  Timeout = 3,
+  // a: ClientState, b: failures so far.
+  Retry = 4,
+  GiveUp = 5,
+  // a: TraceAbort.
+  Abort = 6,
+  // a: chassis control command, b: completion code.
+  Refused = 7,
+  // a: session ID, b: initial outbound sequence number.
+  Session = 8,
+  Connect = 9,
+  Close = 10,
+  // a: length. The packet did not fit a transport's buffer.
+  Dropped = 11,
+};
+
+// Why a handshake was abandoned, for TraceEvent::Abort.
+enum class TraceAbort : uint8_t {
+  ChannelAuthenticationCapabilities = 0,
+  NoIPMI20 = 1,
+  NoMD5 = 2,
+};
+
+// One event, as stored in the ring and in trace files.
+struct TraceRecord {
+  uint64_t nanoseconds; // Since an arbitrary, fixed point.
+  uint64_t object;
+  uint32_t a;
+  uint32_t b;
+  uint32_t c;
+  uint8_t event;
+  uint8_t level;
+  uint16_t reserved;
+};
+static_assert(sizeof(TraceRecord) == 32, "TraceRecord is a file format");
+
+// Trace files hold a TraceFileHeader, then for each thread a TraceRingHeader
+// and its records, oldest first. All fields are in host byte order.
+static const char TRACE_MAGIC[8] = {'I', 'P', 'M', 'I', 'T', 'R', 'C', '1'};
+
+struct TraceFileHeader {
+  char magic[8];
+  uint32_t record_size;
+  uint32_t rings;
+};
+
+struct TraceRingHeader {
+  uint64_t thread; // Numbered from 1 in the order threads first traced.
+  uint64_t records;
+};
+
+namespace Trace {
+// Appends to the calling thread's ring, which is allocated on first use and
+// kept after the thread exits. Never blocks, except that first time.
+void record(uint8_t level, TraceEvent event, const void *object, uint32_t a,
+            uint32_t b, uint32_t c);
+
+// Writes every thread's ring to `out`. Threads may keep tracing meanwhile:
+// records they overwrite during the copy are left out.
+bool dump(FILE *out);
+} // namespace Trace
+} // namespace IPMI
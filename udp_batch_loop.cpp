@@ -0,0 +1,348 @@
+/*
+    Copyright Jordan Sissel, 2018
+    This file is part of jordansissel/ipmi.
+
+    jordansissel/ipmi is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    jordansissel/ipmi is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with jordansissel/ipmi.  If not, see <http://www.gnu.org/licenses/>.
+  */
+#include "udp_batch_loop.h"
+
+#ifdef __linux__
+#include <errno.h>
+#include <netdb.h>
+#include <string>
+#include <sys/epoll.h>
+#include <unistd.h>
+
+namespace IPMI {
+// The session ID a reply is addressed to, or 0. IPMI 1.5 headers carry it
+// after the auth type and sequence number. RMCP+ headers carry it after the
+// payload type; the handshake replies, whose header has none, carry the
+// console's session ID at the same offset of their payload.
+static uint32_t replySessionId(const uint8_t *packet, size_t length) {
+  uint32_t id = 0;
+#if IPMI_LANPLUS
+  if (length >= RMCP_SIZE + 6 &&
+      packet[RMCP_SIZE] == Lanplus::AUTH_TYPE_RMCP_PLUS) {
+    memcpy(&id, packet + RMCP_SIZE + 2, 4);
+    const uint8_t type = packet[RMCP_SIZE + 1] & 0x3f;
+    const size_t payload = RMCP_SIZE + 12;
+    if (id == 0 && length >= payload + 8 &&
+        (type == (uint8_t)Lanplus::PayloadType::OpenSessionResponse ||
+         type == (uint8_t)Lanplus::PayloadType::RAKP2 ||
+         type == (uint8_t)Lanplus::PayloadType::RAKP4)) {
+      memcpy(&id, packet + payload + 4, 4);
+    }
+    return id;
+  }
+#endif
+  if (length >= RMCP_SIZE + 9) {
+    memcpy(&id, packet + RMCP_SIZE + 5, 4);
+  }
+  return id;
+}
+
+void UdpBatchLoop::Endpoint::send(const uint8_t *packet, size_t length) {
+  loop.reindex(*this);
+  uint8_t command;
+  if (session == 0 && messageCommand(packet, length, command)) {
+    loop.waiting[key(address)].push_back(Waiter{this, command});
+  }
+  loop.queue(*this, packet, length);
+}
+
+UdpBatchLoop::UdpBatchLoop() : inbound(new Batch()), wheel(mg_time()) {}
+
+UdpBatchLoop::~UdpBatchLoop() {
+  for (auto &entry : endpoints) {
+    entry.second->client.setTransport(nullptr);
+  }
+  if (epoll_fd >= 0) {
+    close(epoll_fd);
+  }
+  for (int fd : sockets) {
+    close(fd);
+  }
+}
+
+uint64_t UdpBatchLoop::key(const struct sockaddr_in &address) {
+  return (uint64_t)address.sin_addr.s_addr << 16 | address.sin_port;
+}
+
+Status UdpBatchLoop::open(size_t count) {
+  epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  insist_return(epoll_fd >= 0, Status::Failure, "epoll_create1() failed: %s",
+                strerror(errno));
+
+  for (size_t i = 0; i < (count == 0 ? 1 : count); i++) {
+    const int fd =
+        socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    insist_return(fd >= 0, Status::Failure, "socket() failed: %s",
+                  strerror(errno));
+    sockets.push_back(fd);
+    outbound.emplace_back(new Batch());
+
+    // Many BMCs' replies queue on each socket. The kernel caps these at
+    // net.core.rmem_max and wmem_max.
+    const int buffer_size = SOCKET_BUFFER_SIZE;
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &buffer_size, sizeof(buffer_size));
+    setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &buffer_size, sizeof(buffer_size));
+
+    struct sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_ANY);
+    insist_return(bind(fd, (struct sockaddr *)&address, sizeof(address)) == 0,
+                  Status::Failure, "bind() failed: %s", strerror(errno));
+
+    struct epoll_event event = {};
+    event.events = EPOLLIN;
+    event.data.u64 = i;
+    insist_return(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) == 0,
+                  Status::Failure, "epoll_ctl() failed: %s", strerror(errno));
+  }
+  return Status::Success;
+}
+
+Status UdpBatchLoop::attach(Client &client, const char *host) {
+  insist_return(!sockets.empty(), Status::Failure, "attach() before open()");
+  insist_return(endpoints.find(&client) == endpoints.end(), Status::Failure,
+                "The client for %s is already attached", host);
+
+  // Split off the port, if any.
+  std::string name = host;
+  std::string port = "623";
+  const size_t colon = name.rfind(':');
+  if (colon != std::string::npos) {
+    port = name.substr(colon + 1);
+    name.resize(colon);
+  }
+
+  struct addrinfo hints = {};
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_DGRAM;
+  struct addrinfo *found = NULL;
+  insist_return(getaddrinfo(name.c_str(), port.c_str(), &hints, &found) == 0,
+                Status::Failure, "Cannot resolve %s", host);
+  struct sockaddr_in address;
+  memcpy(&address, found->ai_addr, sizeof(address));
+  freeaddrinfo(found);
+
+  Endpoint *endpoint = new Endpoint(*this, client, address, next_socket);
+  next_socket = (next_socket + 1) % sockets.size();
+  endpoints[&client].reset(endpoint);
+
+  client.setTimingWheel(&wheel);
+  client.setTransport(endpoint);
+  return Status::Success;
+}
+
+void UdpBatchLoop::detach(Client &client) {
+  auto found = endpoints.find(&client);
+  if (found == endpoints.end()) {
+    return;
+  }
+  Endpoint *endpoint = found->second.get();
+  client.setTransport(nullptr);
+
+  if (endpoint->session != 0) {
+    routes.erase(Route{key(endpoint->address), endpoint->session});
+  }
+  auto queued = waiting.find(key(endpoint->address));
+  if (queued != waiting.end()) {
+    auto &senders = queued->second;
+    for (auto i = senders.begin(); i != senders.end();) {
+      i = i->endpoint == endpoint ? senders.erase(i) : i + 1;
+    }
+    if (senders.empty()) {
+      waiting.erase(queued);
+    }
+  }
+  endpoints.erase(found);
+}
+
+// Files the endpoint under the session ID its client now expects replies for.
+void UdpBatchLoop::reindex(Endpoint &endpoint) {
+  const uint32_t session = endpoint.client.sessionId();
+  if (session == endpoint.session) {
+    return;
+  }
+  const uint64_t address = key(endpoint.address);
+  if (endpoint.session != 0) {
+    routes.erase(Route{address, endpoint.session});
+  }
+  endpoint.session = session;
+  if (session != 0) {
+    routes[Route{address, session}] = &endpoint;
+  }
+}
+
+UdpBatchLoop::Endpoint *UdpBatchLoop::route(const struct sockaddr_in &from,
+                                            const uint8_t *packet,
+                                            size_t length) {
+  const uint64_t address = key(from);
+  const uint32_t session = replySessionId(packet, length);
+  if (session != 0) {
+    auto found = routes.find(Route{address, session});
+    if (found != routes.end()) {
+      return found->second;
+    }
+  }
+
+  // Otherwise the oldest sender of the request it answers takes it. Senders
+  // that have a session ID by now got their answer already (a retransmitted
+  // request's), and are dropped on the way.
+  uint8_t command;
+  auto queued = waiting.find(address);
+  if (queued == waiting.end() || !messageCommand(packet, length, command)) {
+    return nullptr;
+  }
+  Endpoint *endpoint = nullptr;
+  auto &senders = queued->second;
+  for (auto i = senders.begin(); i != senders.end() && endpoint == nullptr;) {
+    if (i->endpoint->session != 0) {
+      i = senders.erase(i);
+    } else if (i->command == command) {
+      endpoint = i->endpoint;
+      i = senders.erase(i);
+    } else {
+      ++i;
+    }
+  }
+  if (senders.empty()) {
+    waiting.erase(queued);
+  }
+  return endpoint;
+}
+
+void UdpBatchLoop::queue(Endpoint &from, const uint8_t *packet,
+                         size_t length) {
+  if (length > PACKET_SIZE) {
+    ipmi_trace(IPMI_TRACE_WARN, Dropped, &from.client, length, 0, 0);
+    ipmi_log(IPMI_TRACE_WARN, "Dropping a %zu byte packet, too big to batch\n",
+             length);
+    return;
+  }
+  Batch &batch = *outbound[from.socket];
+  if (batch.count == BATCH) {
+    flush(from.socket);
+  }
+
+  const unsigned i = batch.count++;
+  memcpy(batch.packets[i], packet, length);
+  batch.addresses[i] = from.address;
+  batch.vectors[i].iov_base = batch.packets[i];
+  batch.vectors[i].iov_len = length;
+  struct msghdr &header = batch.messages[i].msg_hdr;
+  memset(&header, 0, sizeof(header));
+  header.msg_name = &batch.addresses[i];
+  header.msg_namelen = sizeof(batch.addresses[i]);
+  header.msg_iov = &batch.vectors[i];
+  header.msg_iovlen = 1;
+}
+
+void UdpBatchLoop::flush(size_t socket) {
+  Batch &batch = *outbound[socket];
+  unsigned sent = 0;
+  while (sent < batch.count) {
+    const int result = sendmmsg(sockets[socket], &batch.messages[sent],
+                                batch.count - sent, 0);
+    stats.send_calls++;
+    if (result < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      // The socket buffer is full or the network unreachable. Drop the rest,
+      // as the network might have: the clients retransmit.
+      ipmi_log(IPMI_TRACE_WARN, "sendmmsg() dropped %u packets: %s\n",
+               batch.count - sent, strerror(errno));
+      break;
+    }
+    sent += result;
+  }
+  stats.sent += sent;
+  batch.count = 0;
+}
+
+void UdpBatchLoop::flush() {
+  for (size_t socket = 0; socket < sockets.size(); socket++) {
+    flush(socket);
+  }
+}
+
+void UdpBatchLoop::receive(size_t socket) {
+  for (;;) {
+    for (unsigned i = 0; i < BATCH; i++) {
+      inbound->vectors[i].iov_base = inbound->packets[i];
+      inbound->vectors[i].iov_len = PACKET_SIZE;
+      struct msghdr &header = inbound->messages[i].msg_hdr;
+      memset(&header, 0, sizeof(header));
+      header.msg_name = &inbound->addresses[i];
+      header.msg_namelen = sizeof(inbound->addresses[i]);
+      header.msg_iov = &inbound->vectors[i];
+      header.msg_iovlen = 1;
+    }
+
+    const int count = recvmmsg(sockets[socket], inbound->messages, BATCH, 0,
+                               NULL);
+    stats.receive_calls++;
+    if (count <= 0) {
+      return;
+    }
+    stats.received += count;
+
+    for (int i = 0; i < count; i++) {
+      // Routed one by one: a completion may attach or detach clients.
+      const uint8_t *packet = inbound->packets[i];
+      const size_t length = inbound->messages[i].msg_len;
+      Endpoint *endpoint = route(inbound->addresses[i], packet, length);
+      if (endpoint == nullptr) {
+        stats.unknown++;
+        continue;
+      }
+      struct mbuf buffer;
+      buffer.buf = (char *)packet;
+      buffer.len = buffer.size = length;
+      Client &client = endpoint->client;
+      client.receivePacket(buffer);
+      auto still = endpoints.find(&client);
+      if (still != endpoints.end()) {
+        reindex(*still->second);
+      }
+    }
+
+    if (count < (int)BATCH) {
+      // Drained.
+      return;
+    }
+  }
+}
+
+void UdpBatchLoop::poll(int milliseconds) {
+  // Whatever was queued since the last poll goes out before waiting.
+  flush();
+
+  const int next = wheel.millisecondsUntilNext();
+  if (next >= 0 && next < milliseconds) {
+    milliseconds = next;
+  }
+  struct epoll_event events[8];
+  stats.wait_calls++;
+  const int ready = epoll_wait(epoll_fd, events, 8, milliseconds);
+  for (int i = 0; i < ready; i++) {
+    receive(events[i].data.u64);
+  }
+  wheel.advance(mg_time());
+  flush();
+}
+}; // namespace IPMI
+#endif
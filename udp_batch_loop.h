@@ -0,0 +1,156 @@
+/*
+    Copyright Jordan Sissel, 2018
+    This file is part of jordansissel/ipmi.
+
+    jordansissel/ipmi is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    jordansissel/ipmi is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with jordansissel/ipmi.  If not, see <http://www.gnu.org/licenses/>.
+  */
+#pragma once
+#include "client.h"
+
+// recvmmsg(), sendmmsg() and epoll are Linux only.
+#ifdef __linux__
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <deque>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+namespace IPMI {
+// A Linux event loop for fleets of clients, in place of mongoose. A few
+// unconnected UDP sockets serve every client: packets the clients send are
+// queued and go out together with sendmmsg(), and replies are read in
+// batches with recvmmsg(). One poll() therefore costs a few system calls
+// however many BMCs it serves, where mongoose makes one per datagram, and
+// the number of BMCs is not capped by file descriptors.
+//
+// Replies are routed by source address and the session ID in their header,
+// through a hash index, so several clients may talk to one BMC. A reply
+// without a session ID (early in the handshake) goes to the client that
+// first sent that address the request it answers: BMCs answer those the
+// same whoever asks.
+//
+// Timers run on the loop's timing wheel.
+class UdpBatchLoop {
+public:
+  // Datagrams per sendmmsg() or recvmmsg() call.
+  static const unsigned BATCH = 64;
+  static const int SOCKET_BUFFER_SIZE = 4 << 20;
+  // Replies, which may carry a whole SDR record, are the largest.
+#if IPMI_LANPLUS
+  static const size_t PACKET_SIZE = Lanplus::MAX_RESPONSE_SIZE;
+#else
+  static const size_t PACKET_SIZE = MAX_RESPONSE_SIZE;
+#endif
+
+  struct Statistics {
+    uint64_t sent;
+    uint64_t received;
+    // Datagrams no attached client was waiting for.
+    uint64_t unknown;
+    uint64_t send_calls;
+    uint64_t receive_calls;
+    uint64_t wait_calls;
+  };
+
+private:
+  class Endpoint : public Transport {
+  public:
+    UdpBatchLoop &loop;
+    Client &client;
+    struct sockaddr_in address;
+    size_t socket;
+    // The session ID the endpoint is indexed under; 0 if none.
+    uint32_t session = 0;
+
+    Endpoint(UdpBatchLoop &loop, Client &client,
+             const struct sockaddr_in &address, size_t socket)
+        : loop(loop), client(client), address(address), socket(socket) {}
+    void send(const uint8_t *packet, size_t length) override;
+  };
+
+  struct Route {
+    uint64_t address;
+    uint32_t session;
+    bool operator==(const Route &other) const {
+      return address == other.address && session == other.session;
+    }
+  };
+  struct RouteHash {
+    size_t operator()(const Route &route) const {
+      return std::hash<uint64_t>()(route.address * 0x9e3779b97f4a7c15ull ^
+                                   route.session);
+    }
+  };
+
+  // One batch of datagrams, for either direction.
+  struct Batch {
+    uint8_t packets[BATCH][PACKET_SIZE];
+    struct sockaddr_in addresses[BATCH];
+    struct iovec vectors[BATCH];
+    struct mmsghdr messages[BATCH];
+    unsigned count = 0;
+  };
+
+  std::vector<int> sockets;
+  std::vector<std::unique_ptr<Batch>> outbound;
+  std::unique_ptr<Batch> inbound;
+  int epoll_fd = -1;
+  size_t next_socket = 0;
+  TimingWheel wheel;
+
+  std::unordered_map<const Client *, std::unique_ptr<Endpoint>> endpoints;
+  std::unordered_map<Route, Endpoint *, RouteHash> routes;
+  // A request sent without a session ID, awaiting its reply.
+  struct Waiter {
+    Endpoint *endpoint;
+    uint8_t command;
+  };
+  // Per address, in the order sent.
+  std::unordered_map<uint64_t, std::deque<Waiter>> waiting;
+  Statistics stats = {};
+
+  static uint64_t key(const struct sockaddr_in &address);
+  void reindex(Endpoint &endpoint);
+  Endpoint *route(const struct sockaddr_in &from, const uint8_t *packet,
+                  size_t length);
+  void queue(Endpoint &from, const uint8_t *packet, size_t length);
+  void flush(size_t socket);
+  void flush();
+  void receive(size_t socket);
+
+public:
+  UdpBatchLoop();
+  ~UdpBatchLoop();
+  UdpBatchLoop(const UdpBatchLoop &) = delete;
+  UdpBatchLoop &operator=(const UdpBatchLoop &) = delete;
+
+  // Opens `count` sockets, on any port. Clients are spread over them.
+  Status open(size_t count = 1);
+
+  // Routes `client`'s packets to `host` (an IPv4 address or name, with an
+  // optional port that defaults to 623) and its replies back to it. The
+  // client must outlive the attachment.
+  Status attach(Client &client, const char *host);
+  void detach(Client &client);
+  size_t size() const { return endpoints.size(); }
+
+  // Waits up to `milliseconds` for replies, or less if a client timer is
+  // due sooner, delivers them, runs due timers, then sends everything the
+  // clients queued meanwhile.
+  void poll(int milliseconds);
+  const Statistics &statistics() const { return stats; }
+};
+}; // namespace IPMI
+#endif